@@ -0,0 +1,356 @@
+#include "CapturePipeline.h"
+
+CCapturePipeline::CCapturePipeline(CWebcamAccess &wa) : m_wa(wa)
+{
+    m_pOutput = NULL;
+    m_pFrames = NULL;
+    m_frameCount = 0;
+    m_submitted = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_frequency = freq.QuadPart;
+
+    for(int i = 0; i < PipelineStage_Count; i++)
+    {
+        Stage &stage = m_stages[i];
+        stage.pPipeline = this;
+        stage.id = (PipelineStage)i;
+        stage.hInputReady = NULL;
+        stage.hThread = NULL;
+        stage.frames = stage.failures = 0;
+        stage.busyTicks = stage.waitTicks = 0;
+        stage.depthSum = 0;
+        stage.maxDepth = 0;
+    }
+}
+
+CCapturePipeline::~CCapturePipeline()
+{
+    Stop();
+
+    for(UINT i = 0; i < m_frameCount; i++)
+    {
+        SafeRelease(&m_pFrames[i].pSample);
+        delete[] m_pFrames[i].pPixels;
+        delete[] m_pFrames[i].pEncoded;
+    }
+    delete[] m_pFrames;
+
+    for(int i = 0; i < PipelineStage_Count; i++)
+    {
+        if(m_stages[i].hInputReady)
+        {
+            CloseHandle(m_stages[i].hInputReady);
+        }
+    }
+}
+
+LPCWSTR CCapturePipeline::GetStageName(PipelineStage stage)
+{
+    static const LPCWSTR names[PipelineStage_Count] = { L"capture", L"convert", L"encode", L"write" };
+    return names[stage];
+}
+
+//-------------------------------------------------------------------
+// Start
+//
+// Allocates frameCount frames for the current output size of the
+// device and starts the convert, encode and write threads. Every
+// queue can hold the whole pool, so a push never has to wait.
+//-------------------------------------------------------------------
+
+HRESULT CCapturePipeline::Start(UINT frameCount, IPipelineOutput *pOutput)
+{
+    unsigned int width, height;
+    m_wa.GetImageSizes(width, height);
+    UINT bpp = m_wa.GetBytesPerPixel();
+
+    if(m_pFrames || !pOutput || frameCount == 0 || width == 0 || height == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_pOutput = pOutput;
+    m_frameCount = frameCount;
+    m_pFrames = new PipelineFrame[frameCount];
+    ZeroMemory(m_pFrames, frameCount * sizeof(PipelineFrame));
+
+    for(int i = 0; i < PipelineStage_Count; i++)
+    {
+        m_stages[i].input.Initialize(frameCount + 1);
+        m_stages[i].hInputReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if(!m_stages[i].hInputReady)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    for(UINT i = 0; i < frameCount; i++)
+    {
+        PipelineFrame &frame = m_pFrames[i];
+        frame.width = width;
+        frame.height = height;
+        frame.bpp = bpp;
+        frame.pPixels = new BYTE[width * height * bpp];
+        Push(m_stages[PipelineStage_Capture], &frame);
+    }
+
+    for(int i = PipelineStage_Convert; i < PipelineStage_Count; i++)
+    {
+        m_stages[i].hThread = CreateThread(NULL, 0, StageThreadProc, &m_stages[i], 0, NULL);
+        if(!m_stages[i].hThread)
+        {
+            HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+            Stop();
+            return hr;
+        }
+    }
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Submit
+//
+// Called by the capture loop: takes a free frame, waiting for one if
+// the whole pool is in flight, and queues the sample for conversion.
+// The pipeline keeps a reference to the sample until it is converted.
+//-------------------------------------------------------------------
+
+HRESULT CCapturePipeline::Submit(IMFMediaBuffer *pSample, LONGLONG timeStamp)
+{
+    Stage &capture = m_stages[PipelineStage_Capture];
+
+    if(!m_pFrames || !m_stages[PipelineStage_Convert].hThread)
+    {
+        return E_UNEXPECTED;
+    }
+
+    PipelineFrame *pFrame = Pop(capture);
+
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    pFrame->pSample = pSample;
+    pSample->AddRef();
+    pFrame->timeStamp = timeStamp;
+    pFrame->frameNumber = ++m_submitted;
+    pFrame->publishOnly = false;
+    pFrame->failed = false;
+
+    Push(m_stages[PipelineStage_Convert], pFrame);
+
+    QueryPerformanceCounter(&end);
+    capture.busyTicks += end.QuadPart - start.QuadPart;
+    capture.frames++;
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Publish
+//
+// Called by the capture loop for frames that are not saved: queues
+// the sample to be converted into the shared-memory ring by the
+// convert stage. Never waits; if the whole pool is in flight the
+// frame is not published and S_FALSE is returned, since the ring
+// only holds the newest frames anyway.
+//-------------------------------------------------------------------
+
+HRESULT CCapturePipeline::Publish(IMFMediaBuffer *pSample, LONGLONG timeStamp)
+{
+    Stage &capture = m_stages[PipelineStage_Capture];
+    PipelineFrame *pFrame = NULL;
+
+    if(!m_pFrames || !m_stages[PipelineStage_Convert].hThread)
+    {
+        return E_UNEXPECTED;
+    }
+    if(!capture.input.TryPop(&pFrame))
+    {
+        return S_FALSE;
+    }
+
+    pFrame->pSample = pSample;
+    pSample->AddRef();
+    pFrame->timeStamp = timeStamp;
+    pFrame->frameNumber = 0;
+    pFrame->publishOnly = true;
+    pFrame->failed = false;
+
+    Push(m_stages[PipelineStage_Convert], pFrame);
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Stop
+//
+// Lets the stages finish the frames already submitted, then ends
+// their threads. A NULL frame pushed behind the last one tells each
+// stage to pass it on and exit.
+//-------------------------------------------------------------------
+
+void CCapturePipeline::Stop()
+{
+    if(!m_stages[PipelineStage_Convert].hThread)
+    {
+        return;
+    }
+
+    Push(m_stages[PipelineStage_Convert], NULL);
+
+    for(int i = PipelineStage_Convert; i < PipelineStage_Count; i++)
+    {
+        Stage &stage = m_stages[i];
+        if(stage.hThread)
+        {
+            WaitForSingleObject(stage.hThread, INFINITE);
+            CloseHandle(stage.hThread);
+            stage.hThread = NULL;
+        }
+    }
+}
+
+void CCapturePipeline::GetStats(PipelineStage stage, PipelineStageStats *pStats) const
+{
+    const Stage &s = m_stages[stage];
+    UINT64 pops = s.frames + s.failures;
+
+    pStats->frames = s.frames;
+    pStats->failures = s.failures;
+    pStats->busyMs = s.busyTicks * 1000.0 / m_frequency;
+    pStats->waitMs = s.waitTicks * 1000.0 / m_frequency;
+    pStats->averageDepth = pops ? (double)s.depthSum / pops : 0.0;
+    pStats->maxDepth = s.maxDepth;
+}
+
+//-------------------------------------------------------------------
+// Queue helpers
+//
+// Pop is only called by the thread that runs the stage and Push by
+// the thread that runs the stage before it (the write stage returns
+// frames to the capture stage), which is what CSpscQueue requires.
+// The auto-reset event stays set if a push happens between a failed
+// TryPop and the wait, so no wake-up is lost.
+//-------------------------------------------------------------------
+
+PipelineFrame* CCapturePipeline::Pop(Stage &stage)
+{
+    PipelineFrame *pFrame = NULL;
+    UINT depth = stage.input.GetDepth();
+
+    if(!stage.input.TryPop(&pFrame))
+    {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+
+        do
+        {
+            WaitForSingleObject(stage.hInputReady, INFINITE);
+        } while(!stage.input.TryPop(&pFrame));
+
+        QueryPerformanceCounter(&end);
+        stage.waitTicks += end.QuadPart - start.QuadPart;
+        depth = 1;
+    }
+
+    stage.depthSum += depth;
+    if(depth > stage.maxDepth)
+        stage.maxDepth = depth;
+    return pFrame;
+}
+
+void CCapturePipeline::Push(Stage &stage, PipelineFrame *pFrame)
+{
+    // Cannot fail: each queue holds the whole pool and the end marker.
+    stage.input.TryPush(pFrame);
+    SetEvent(stage.hInputReady);
+}
+
+//-------------------------------------------------------------------
+// Stage threads
+//-------------------------------------------------------------------
+
+DWORD WINAPI CCapturePipeline::StageThreadProc(LPVOID pParam)
+{
+    Stage *pStage = (Stage*)pParam;
+
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    pStage->pPipeline->RunStage(*pStage);
+    CoUninitialize();
+    return 0;
+}
+
+void CCapturePipeline::RunStage(Stage &stage)
+{
+    PipelineStage nextStage = stage.id == PipelineStage_Write ?
+        PipelineStage_Capture : (PipelineStage)(stage.id + 1);
+
+    for(;;)
+    {
+        PipelineFrame *pFrame = Pop(stage);
+        if(!pFrame)
+        {
+            if(nextStage != PipelineStage_Capture)
+                Push(m_stages[nextStage], NULL);
+            break;
+        }
+
+        if((pFrame->publishOnly || pFrame->failed) && stage.id != PipelineStage_Convert)
+        {
+            // Already published or not converted, nothing to save.
+            Push(m_stages[nextStage], pFrame);
+            continue;
+        }
+
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+
+        HRESULT hr = ProcessFrame(stage.id, pFrame);
+
+        QueryPerformanceCounter(&end);
+        stage.busyTicks += end.QuadPart - start.QuadPart;
+        if(SUCCEEDED(hr))
+            stage.frames++;
+        else
+            stage.failures++;
+
+        Push(m_stages[nextStage], pFrame);
+    }
+}
+
+HRESULT CCapturePipeline::ProcessFrame(PipelineStage stage, PipelineFrame *pFrame)
+{
+    HRESULT hr = S_OK;
+
+    switch(stage)
+    {
+    case PipelineStage_Convert:
+        if(pFrame->publishOnly)
+        {
+            hr = m_wa.PublishSample(pFrame->pSample, pFrame->timeStamp);
+        }
+        else
+        {
+            hr = m_wa.ConvertSample(pFrame->pSample, pFrame->pPixels + (pFrame->height - 1) * pFrame->width * pFrame->bpp,
+                pFrame->width * -(LONG)pFrame->bpp, pFrame->timeStamp);
+        }
+        SafeRelease(&pFrame->pSample);
+        pFrame->failed = FAILED(hr);
+        break;
+
+    case PipelineStage_Encode:
+        delete[] pFrame->pEncoded;
+        pFrame->pEncoded = NULL;
+        pFrame->cbEncoded = 0;
+        hr = m_pOutput->EncodeFrame(pFrame);
+        break;
+
+    case PipelineStage_Write:
+        hr = m_pOutput->WriteFrame(pFrame);
+        delete[] pFrame->pEncoded;
+        pFrame->pEncoded = NULL;
+        pFrame->cbEncoded = 0;
+        break;
+    }
+    return hr;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "WebcamAccess.h"
+
+//-------------------------------------------------------------------
+//  CSpscQueue
+//
+//  Bounded lock-free queue for one producer thread and one consumer
+//  thread. The producer only writes m_tail and the consumer only
+//  writes m_head; each index is published with an interlocked
+//  exchange after the slot it covers has been written or read, so
+//  neither side ever takes a lock. The capacity is rounded up to a
+//  power of two.
+//-------------------------------------------------------------------
+
+template <class T> class CSpscQueue
+{
+public:
+    CSpscQueue() : m_pItems(NULL), m_mask(0), m_head(0), m_tail(0)
+    {
+    }
+
+    ~CSpscQueue()
+    {
+        delete[] m_pItems;
+    }
+
+    void Initialize(UINT capacity)
+    {
+        UINT size = 1;
+        while(size < capacity)
+        {
+            size <<= 1;
+        }
+
+        delete[] m_pItems;
+        m_pItems = new T[size];
+        m_mask = size - 1;
+        m_head = m_tail = 0;
+    }
+
+    bool TryPush(const T &item)
+    {
+        LONG tail = m_tail;
+        if((ULONG)(tail - m_head) > m_mask)
+        {
+            return false;
+        }
+        m_pItems[tail & m_mask] = item;
+        InterlockedExchange(&m_tail, tail + 1);
+        return true;
+    }
+
+    bool TryPop(T *pItem)
+    {
+        LONG head = m_head;
+        if(head == m_tail)
+        {
+            return false;
+        }
+        *pItem = m_pItems[head & m_mask];
+        InterlockedExchange(&m_head, head + 1);
+        return true;
+    }
+
+    // Exact on the producer and consumer threads, a snapshot elsewhere.
+    UINT GetDepth() const
+    {
+        return (UINT)(m_tail - m_head);
+    }
+
+protected:
+    T               *m_pItems;
+    UINT            m_mask;
+    volatile LONG   m_head;     // Next item to pop, written by the consumer.
+    volatile LONG   m_tail;     // Next free slot, written by the producer.
+};
+
+//-------------------------------------------------------------------
+//  PipelineFrame
+//
+//  One pooled frame travelling through the pipeline. pPixels holds
+//  the converted image bottom-up, like SaveImage expects; pEncoded
+//  is set by the encode stage if the output is compressed. Frames
+//  queued by Publish only go to the shared-memory ring, and frames
+//  the convert stage failed on hold no image; both pass the encode
+//  and write stages untouched.
+//-------------------------------------------------------------------
+
+struct PipelineFrame
+{
+    IMFMediaBuffer  *pSample;       // Native sample, until converted.
+    LONGLONG        timeStamp;
+    UINT64          frameNumber;
+    BYTE            *pPixels;
+    unsigned int    width;
+    unsigned int    height;
+    unsigned int    bpp;
+    BYTE            *pEncoded;      // new[], owned by the frame.
+    DWORD           cbEncoded;
+    bool            publishOnly;
+    bool            failed;         // Set by the convert stage.
+};
+
+//-------------------------------------------------------------------
+//  IPipelineOutput
+//
+//  Encodes and writes frames for CCapturePipeline. EncodeFrame runs
+//  on the encode thread and WriteFrame on the write thread, each
+//  called for one frame at a time in capture order.
+//-------------------------------------------------------------------
+
+struct IPipelineOutput
+{
+    virtual HRESULT EncodeFrame(PipelineFrame *pFrame) = 0;
+    virtual HRESULT WriteFrame(PipelineFrame *pFrame) = 0;
+};
+
+enum PipelineStage
+{
+    PipelineStage_Capture,
+    PipelineStage_Convert,
+    PipelineStage_Encode,
+    PipelineStage_Write,
+    PipelineStage_Count
+};
+
+struct PipelineStageStats
+{
+    UINT64      frames;             // Frames the stage finished.
+    UINT64      failures;
+    double      busyMs;             // Time spent on those frames.
+    double      waitMs;             // Time spent waiting for input.
+    double      averageDepth;       // Input queue depth seen by each frame.
+    UINT        maxDepth;
+};
+
+//-------------------------------------------------------------------
+//  CCapturePipeline class
+//
+//  Runs conversion, encoding and file writes of the frames the
+//  capture loop submits on three threads of their own, connected by
+//  CSpscQueue queues, so the camera keeps being read while earlier
+//  frames are processed and throughput is limited by the slowest
+//  stage instead of the sum of all of them.
+//
+//  A fixed pool of frames circulates from the capture loop through
+//  the stages and back. When all of them are in flight Submit waits
+//  for the write stage to return one, which is the back-pressure
+//  that keeps memory bounded. For the capture stage the input queue
+//  is the pool of free frames.
+//
+//  The convert stage is the only thread that uses the color converter
+//  and the shared-memory ring of CWebcamAccess while the pipeline
+//  runs, so frames the capture loop only wants published go through
+//  it as well (Publish).
+//
+//-------------------------------------------------------------------
+
+class CCapturePipeline
+{
+public:
+    CCapturePipeline(CWebcamAccess &wa);
+    ~CCapturePipeline();
+
+    HRESULT Start(UINT frameCount, IPipelineOutput *pOutput);
+    HRESULT Submit(IMFMediaBuffer *pSample, LONGLONG timeStamp);
+    HRESULT Publish(IMFMediaBuffer *pSample, LONGLONG timeStamp);
+    void Stop();
+
+    void GetStats(PipelineStage stage, PipelineStageStats *pStats) const;
+    static LPCWSTR GetStageName(PipelineStage stage);
+
+protected:
+    struct Stage
+    {
+        CCapturePipeline            *pPipeline;
+        PipelineStage               id;
+        CSpscQueue<PipelineFrame*>  input;
+        HANDLE                      hInputReady;    // Auto-reset, set after each push.
+        HANDLE                      hThread;
+
+        // Written by the thread that runs the stage only.
+        UINT64                      frames;
+        UINT64                      failures;
+        LONGLONG                    busyTicks;
+        LONGLONG                    waitTicks;
+        UINT64                      depthSum;
+        UINT                        maxDepth;
+    };
+
+    CWebcamAccess           &m_wa;
+    IPipelineOutput         *m_pOutput;
+    PipelineFrame           *m_pFrames;
+    UINT                    m_frameCount;
+    UINT64                  m_submitted;
+    Stage                   m_stages[PipelineStage_Count];
+    LONGLONG                m_frequency;
+
+    static DWORD WINAPI StageThreadProc(LPVOID pParam);
+    void RunStage(Stage &stage);
+    HRESULT ProcessFrame(PipelineStage stage, PipelineFrame *pFrame);
+    PipelineFrame* Pop(Stage &stage);
+    void Push(Stage &stage, PipelineFrame *pFrame);
+};
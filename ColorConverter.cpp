@@ -2,14 +2,40 @@
 
 #include <d3d9.h>
 #include <mferror.h>
+#include <emmintrin.h>
+#include <malloc.h>
+#include <math.h>
 #include "BufferLock.h"
 
+#define DEFINE_FOURCC_SUBTYPE(name, fcc) \
+    const GUID name = { fcc, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 } }
+
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerRGGB8, FCC('RGGB'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerGRBG8, FCC('GRBG'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerGBRG8, FCC('GBRG'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerBGGR8, FCC('BA81'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerRGGB16, FCC('RG16'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerGRBG16, FCC('GR16'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerGBRG16, FCC('GB16'));
+DEFINE_FOURCC_SUBTYPE(MFVideoFormat_BayerBGGR16, FCC('BYR2'));
+
 const ConversionFunction CColorConverter::s_FormatConversions[] =
 {
-    { MFVideoFormat_RGB32, CColorConverter::TransformImage_RGB32 },
-    { MFVideoFormat_RGB24, CColorConverter::TransformImage_RGB24 },
-    { MFVideoFormat_YUY2, CColorConverter::TransformImage_YUY2 },
-    { MFVideoFormat_NV12, CColorConverter::TransformImage_NV12 }
+    { MFVideoFormat_RGB32, CColorConverter::TransformImage_RGB32, CColorConverter::SampleLuma_RGB32, 1, 1, 8, CColorConverter::SampleColor_RGB32 },
+    { MFVideoFormat_RGB24, CColorConverter::TransformImage_RGB24, CColorConverter::SampleLuma_RGB24, 1, 1, 8, CColorConverter::SampleColor_RGB24 },
+    { MFVideoFormat_YUY2, CColorConverter::TransformImage_YUY2, CColorConverter::SampleLuma_YUY2, 2, 1, 8, CColorConverter::SampleColor_YUY2 },
+    { MFVideoFormat_NV12, CColorConverter::TransformImage_NV12, CColorConverter::SampleLuma_NV12, 2, 2, 8, CColorConverter::SampleColor_NV12 },
+    { MFVideoFormat_P010, TransformImage_P010, CColorConverter::SampleLuma_P010, 2, 2, 10, NULL },
+    { MFVideoFormat_P016, TransformImage_P010, CColorConverter::SampleLuma_P010, 2, 2, 16, NULL },
+    { MFVideoFormat_Y210, TransformImage_Y210, CColorConverter::SampleLuma_Y210, 2, 1, 10, NULL },
+    { MFVideoFormat_BayerRGGB8, TransformImage_Bayer8, CColorConverter::SampleLuma_Bayer8, 2, 2, 8, CColorConverter::SampleColor_BayerRGGB, Bayer_RGGB },
+    { MFVideoFormat_BayerGRBG8, TransformImage_Bayer8, CColorConverter::SampleLuma_Bayer8, 2, 2, 8, CColorConverter::SampleColor_BayerGRBG, Bayer_GRBG },
+    { MFVideoFormat_BayerGBRG8, TransformImage_Bayer8, CColorConverter::SampleLuma_Bayer8, 2, 2, 8, CColorConverter::SampleColor_BayerGBRG, Bayer_GBRG },
+    { MFVideoFormat_BayerBGGR8, TransformImage_Bayer8, CColorConverter::SampleLuma_Bayer8, 2, 2, 8, CColorConverter::SampleColor_BayerBGGR, Bayer_BGGR },
+    { MFVideoFormat_BayerRGGB16, TransformImage_Bayer16, CColorConverter::SampleLuma_Bayer16, 2, 2, 16, NULL, Bayer_RGGB },
+    { MFVideoFormat_BayerGRBG16, TransformImage_Bayer16, CColorConverter::SampleLuma_Bayer16, 2, 2, 16, NULL, Bayer_GRBG },
+    { MFVideoFormat_BayerGBRG16, TransformImage_Bayer16, CColorConverter::SampleLuma_Bayer16, 2, 2, 16, NULL, Bayer_GBRG },
+    { MFVideoFormat_BayerBGGR16, TransformImage_Bayer16, CColorConverter::SampleLuma_Bayer16, 2, 2, 16, NULL, Bayer_BGGR }
 };
 
 const int CColorConverter::s_NumConversionFuncs = ARRAYSIZE(s_FormatConversions);
@@ -17,13 +43,50 @@ const int CColorConverter::s_NumConversionFuncs = ARRAYSIZE(s_FormatConversions)
 CColorConverter::CColorConverter()
 {
     m_convertFn = NULL;
-
+    m_format = NULL;
+    m_width = m_height = 0;
+    m_lDefaultStride = 0;
+    m_PixelAR.Numerator = m_PixelAR.Denominator = 1;
+    m_interlace = MFVideoInterlace_Progressive;
+    m_hasRoi = false;
+    SetRectEmpty(&m_requestedRoi);
+    SetRectEmpty(&m_params.rcSource);
+    m_deinterlaceMode = Deinterlace_Auto;
+    m_pScratch = NULL;
+    m_params.deinterlace = Deinterlace_Weave;
+    m_params.dominantField = 0;
+    m_params.pScratch = NULL;
+    m_params.pRowBuffer = NULL;
+    m_params.cbScratchRow = 0;
+    m_aspectCorrection = true;
+    m_pTaps = NULL;
+    m_pWeights = NULL;
+    m_params.dwOutWidth = 0;
+    m_params.pTaps = NULL;
+    m_params.pWeights = NULL;
+    m_outputDepth = 8;
+    m_params.wideOutput = false;
+    m_correction = ColorCorrection_None;
+    m_continuousCorrection = false;
+    m_correctionValid = false;
+    m_params.pOutputLut = &m_outputLut[0][0];
+    m_params.correctRgb = false;
+    m_params.bayer = Bayer_None;
+    m_params.demosaic = Demosaic_Bilinear;
+    BuildOutputLut();
+    m_rotation = Rotation_0;
+    m_mirror = false;
+    m_pBand = NULL;
+    m_cbBand = 0;
 }
 
 
 CColorConverter::~CColorConverter()
 {
-
+    delete[] m_pScratch;
+    delete[] m_pTaps;
+    _aligned_free(m_pWeights);
+    delete[] m_pBand;
 }
 
 //-------------------------------------------------------------------
@@ -32,11 +95,6 @@ CColorConverter::~CColorConverter()
 //
 //-------------------------------------------------------------------
 
-__forceinline BYTE Clip(int clr)
-{
-    return (BYTE)(clr < 0 ? 0 : (clr > 255 ? 255 : clr));
-}
-
 __forceinline RGBQUAD ConvertYCrCbToRGB(
     int y,
     int cr,
@@ -52,6 +110,36 @@ __forceinline RGBQUAD ConvertYCrCbToRGB(
     rgbq.rgbRed = Clip((298 * c + 409 * e + 128) >> 8);
     rgbq.rgbGreen = Clip((298 * c - 100 * d - 208 * e + 128) >> 8);
     rgbq.rgbBlue = Clip((298 * c + 516 * d + 128) >> 8);
+    rgbq.rgbReserved = 0;
+
+    return rgbq;
+}
+
+//-------------------------------------------------------------------
+// ConvertYCrCbToRGB
+//
+// Same as above, but pLut holds the B, G and R output tables (see BuildOutputLut), which
+// clip the result and apply the color correction in one lookup.
+//-------------------------------------------------------------------
+
+__forceinline RGBQUAD ConvertYCrCbToRGB(
+    int y,
+    int cr,
+    int cb,
+    const BYTE* pLut
+    )
+{
+    RGBQUAD rgbq;
+
+    int c = y - 16;
+    int d = cb - 128;
+    int e = cr - 128;
+
+    pLut += kOutputLutBias;
+    rgbq.rgbRed = pLut[2 * kOutputLutSize + ((298 * c + 409 * e + 128) >> 8)];
+    rgbq.rgbGreen = pLut[kOutputLutSize + ((298 * c - 100 * d - 208 * e + 128) >> 8)];
+    rgbq.rgbBlue = pLut[(298 * c + 516 * d + 128) >> 8];
+    rgbq.rgbReserved = 0;
 
     return rgbq;
 }
@@ -68,15 +156,21 @@ void CColorConverter::TransformImage_RGB24(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
     )
 {
-    for(DWORD y = 0; y < dwHeightInPixels; y++)
+    const RECT &rc = params.rcSource;
+    const DWORD dwWidth = rc.right - rc.left;
+    pSrc += rc.top * lSrcStride + rc.left * 3;
+
+    for(LONG y = rc.top; y < rc.bottom; y++)
     {
         RGBTRIPLE *pSrcPel = (RGBTRIPLE*)pSrc;
-        DWORD *pDestPel = (DWORD*)pDest;
+        BYTE *pRow = GetRowBuffer(pDest, params, 0);
+        DWORD *pDestPel = (DWORD*)pRow;
 
-        for(DWORD x = 0; x < dwWidthInPixels; x++)
+        for(DWORD x = 0; x < dwWidth; x++)
         {
             pDestPel[x] = D3DCOLOR_XRGB(
                 pSrcPel[x].rgbtRed,
@@ -84,6 +178,11 @@ void CColorConverter::TransformImage_RGB24(
                 pSrcPel[x].rgbtBlue
                 );
         }
+        if(params.correctRgb)
+        {
+            ApplyOutputLut(pRow, dwWidth, params.pOutputLut);
+        }
+        EmitRow(pDest, pRow, dwWidth, params);
 
         pSrc += lSrcStride;
         pDest += lDestStride;
@@ -105,10 +204,33 @@ void CColorConverter::TransformImage_RGB32(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
     )
 {
-    MFCopyImage(pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels * 4, dwHeightInPixels);
+    const RECT &rc = params.rcSource;
+    const DWORD dwWidth = rc.right - rc.left;
+    pSrc += rc.top * lSrcStride + rc.left * 4;
+
+    if(!params.pTaps && !params.correctRgb)
+    {
+        MFCopyImage(pDest, lDestStride, pSrc, lSrcStride, dwWidth * 4, rc.bottom - rc.top);
+        return;
+    }
+
+    for(LONG y = rc.top; y < rc.bottom; y++)
+    {
+        BYTE *pRow = GetRowBuffer(pDest, params, 0);
+        CopyMemory(pRow, pSrc, dwWidth * 4);
+        if(params.correctRgb)
+        {
+            ApplyOutputLut(pRow, dwWidth, params.pOutputLut);
+        }
+        EmitRow(pDest, pRow, dwWidth, params);
+
+        pSrc += lSrcStride;
+        pDest += lDestStride;
+    }
 }
 
 //-------------------------------------------------------------------
@@ -123,15 +245,23 @@ void CColorConverter::TransformImage_YUY2(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
     )
 {
-    for(DWORD y = 0; y < dwHeightInPixels; y++)
+    const RECT &rc = params.rcSource;
+    const DWORD dwWidth = rc.right - rc.left;
+    const DWORD cbRow = dwWidth * 2;
+    pSrc += rc.left * 2;
+
+    for(LONG y = rc.top; y < rc.bottom; y++)
     {
-        RGBQUAD *pDestPel = (RGBQUAD*)pDest;
-        WORD    *pSrcPel = (WORD*)pSrc;
+        BYTE *pRow = GetRowBuffer(pDest, params, 0);
+        RGBQUAD *pDestPel = (RGBQUAD*)pRow;
+        const WORD *pSrcPel = (const WORD*)GetSourceRow(
+            pSrc, lSrcStride, y, dwHeightInPixels, cbRow, params, params.pScratch);
 
-        for(DWORD x = 0; x < dwWidthInPixels; x += 2)
+        for(DWORD x = 0; x < dwWidth; x += 2)
         {
             // Byte order is U0 Y0 V0 Y1
 
@@ -140,11 +270,11 @@ void CColorConverter::TransformImage_YUY2(
             int y1 = (int)LOBYTE(pSrcPel[x + 1]);
             int v0 = (int)HIBYTE(pSrcPel[x + 1]);
 
-            pDestPel[x] = ConvertYCrCbToRGB(y0, v0, u0);
-            pDestPel[x + 1] = ConvertYCrCbToRGB(y1, v0, u0);
+            pDestPel[x] = ConvertYCrCbToRGB(y0, v0, u0, params.pOutputLut);
+            pDestPel[x + 1] = ConvertYCrCbToRGB(y1, v0, u0, params.pOutputLut);
         }
+        EmitRow(pDest, pRow, dwWidth, params);
 
-        pSrc += lSrcStride;
         pDest += lDestStride;
     }
 
@@ -163,24 +293,35 @@ void CColorConverter::TransformImage_NV12(
     const BYTE* pSrc,
     LONG srcStride,
     DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
+    DWORD dwHeightInPixels,
+    const TransformParams& params
     )
 {
-    const BYTE* lpBitsY = pSrc;
-    const BYTE* lpBitsCb = lpBitsY + (dwHeightInPixels * srcStride);;
-    const BYTE* lpBitsCr = lpBitsCb + 1;
-
-    for(UINT y = 0; y < dwHeightInPixels; y += 2)
+    // The chroma plane follows the full-height luma plane. Each chroma row
+    // covers two luma rows and interleaves Cb/Cr, so the byte offset of
+    // an even column is the same as in the luma plane. Chroma rows of an
+    // interlaced frame alternate between the fields like the luma rows,
+    // so both planes go through the same deinterlacing filter.
+    const RECT &rc = params.rcSource;
+    const DWORD cbRow = rc.right - rc.left;
+    const BYTE* lpBitsY = pSrc + rc.left;
+    const BYTE* lpBitsC = pSrc + (dwHeightInPixels * srcStride) + rc.left;
+    BYTE* lpScratch = params.pScratch;
+    const DWORD cbScratch = params.cbScratchRow;
+
+    for(LONG y = rc.top; y < rc.bottom; y += 2)
     {
-        const BYTE* lpLineY1 = lpBitsY;
-        const BYTE* lpLineY2 = lpBitsY + srcStride;
-        const BYTE* lpLineCr = lpBitsCr;
-        const BYTE* lpLineCb = lpBitsCb;
+        const BYTE* lpLineY1 = GetSourceRow(lpBitsY, srcStride, y, dwHeightInPixels, cbRow, params, lpScratch);
+        const BYTE* lpLineY2 = GetSourceRow(lpBitsY, srcStride, y + 1, dwHeightInPixels, cbRow, params, lpScratch + cbScratch);
+        const BYTE* lpLineCb = GetSourceRow(lpBitsC, srcStride, y / 2, dwHeightInPixels / 2, cbRow, params, lpScratch + 2 * cbScratch);
+        const BYTE* lpLineCr = lpLineCb + 1;
 
-        LPBYTE lpDibLine1 = pDst;
-        LPBYTE lpDibLine2 = pDst + dstStride;
+        LPBYTE lpRow1 = GetRowBuffer(pDst, params, 0);
+        LPBYTE lpRow2 = GetRowBuffer(pDst + dstStride, params, 1);
+        LPBYTE lpDibLine1 = lpRow1;
+        LPBYTE lpDibLine2 = lpRow2;
 
-        for(UINT x = 0; x < dwWidthInPixels; x += 2)
+        for(LONG x = rc.left; x < rc.right; x += 2)
         {
             int  y0 = (int)lpLineY1[0];
             int  y1 = (int)lpLineY1[1];
@@ -189,25 +330,25 @@ void CColorConverter::TransformImage_NV12(
             int  cb = (int)lpLineCb[0];
             int  cr = (int)lpLineCr[0];
 
-            RGBQUAD r = ConvertYCrCbToRGB(y0, cr, cb);
+            RGBQUAD r = ConvertYCrCbToRGB(y0, cr, cb, params.pOutputLut);
             lpDibLine1[0] = r.rgbBlue;
             lpDibLine1[1] = r.rgbGreen;
             lpDibLine1[2] = r.rgbRed;
             lpDibLine1[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y1, cr, cb);
+            r = ConvertYCrCbToRGB(y1, cr, cb, params.pOutputLut);
             lpDibLine1[4] = r.rgbBlue;
             lpDibLine1[5] = r.rgbGreen;
             lpDibLine1[6] = r.rgbRed;
             lpDibLine1[7] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y2, cr, cb);
+            r = ConvertYCrCbToRGB(y2, cr, cb, params.pOutputLut);
             lpDibLine2[0] = r.rgbBlue;
             lpDibLine2[1] = r.rgbGreen;
             lpDibLine2[2] = r.rgbRed;
             lpDibLine2[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y3, cr, cb);
+            r = ConvertYCrCbToRGB(y3, cr, cb, params.pOutputLut);
             lpDibLine2[4] = r.rgbBlue;
             lpDibLine2[5] = r.rgbGreen;
             lpDibLine2[6] = r.rgbRed;
@@ -221,166 +362,1702 @@ void CColorConverter::TransformImage_NV12(
             lpDibLine1 += 8;
             lpDibLine2 += 8;
         }
+        EmitRow(pDst, lpRow1, cbRow, params);
+        EmitRow(pDst + dstStride, lpRow2, cbRow, params);
 
         pDst += (2 * dstStride);
-        lpBitsY += (2 * srcStride);
-        lpBitsCr += srcStride;
-        lpBitsCb += srcStride;
     }
 }
 
-HRESULT CColorConverter::SetConversionFunction(REFGUID subtype)
+//-------------------------------------------------------------------
+// Luma sampling functions
+//
+// Write one luma byte per step x step cell, taken from the top-left
+// pixel of the cell, into a tightly packed (width / step) x
+// (height / step) buffer. Used to compare frames without converting
+// them.
+//-------------------------------------------------------------------
+
+__forceinline BYTE LumaFromRGB(int r, int g, int b)
 {
-    m_convertFn = NULL;
+    // BT.601 studio range, to match the Y of the YUV formats.
+    return (BYTE)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
 
-    for(DWORD i = 0; i < s_NumConversionFuncs; i++)
+void CColorConverter::SampleLuma_RGB24(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
+{
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
+
+    for(DWORD y = 0; y < rows; y++)
     {
-        if(s_FormatConversions[i].subtype == subtype)
+        const RGBTRIPLE *pSrcPel = (const RGBTRIPLE*)(pSrc + (LONG)(y * step) * lSrcStride);
+
+        for(DWORD x = 0; x < cols; x++)
         {
-            m_convertFn = s_FormatConversions[i].xform;
-            return S_OK;
+            const RGBTRIPLE &p = pSrcPel[x * step];
+            *pDest++ = LumaFromRGB(p.rgbtRed, p.rgbtGreen, p.rgbtBlue);
         }
     }
+}
 
-    return MF_E_INVALIDMEDIATYPE;
+void CColorConverter::SampleLuma_RGB32(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
+{
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
+
+    for(DWORD y = 0; y < rows; y++)
+    {
+        const RGBQUAD *pSrcPel = (const RGBQUAD*)(pSrc + (LONG)(y * step) * lSrcStride);
+
+        for(DWORD x = 0; x < cols; x++)
+        {
+            const RGBQUAD &p = pSrcPel[x * step];
+            *pDest++ = LumaFromRGB(p.rgbRed, p.rgbGreen, p.rgbBlue);
+        }
+    }
 }
 
-void CColorConverter::ConvertImageToRGB32(BYTE* pDest, LONG destStride, IMFMediaBuffer *buf)
+void CColorConverter::SampleLuma_YUY2(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
 {
-    BYTE *pbScanline0 = NULL;
-    LONG lStride = 0;
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
 
-    VideoBufferLock buffer(buf);
+    for(DWORD y = 0; y < rows; y++)
+    {
+        // Y is every other byte of the packed row.
+        const BYTE *pSrcRow = pSrc + (LONG)(y * step) * lSrcStride;
 
-    HRESULT hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
-    if(SUCCEEDED(hr))
+        for(DWORD x = 0; x < cols; x++)
+        {
+            *pDest++ = pSrcRow[x * step * 2];
+        }
+    }
+}
+
+void CColorConverter::SampleLuma_NV12(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
+{
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
+
+    for(DWORD y = 0; y < rows; y++)
     {
-        if(m_convertFn)
-            m_convertFn(pDest, destStride, pbScanline0, lStride, m_width, m_height);
-    }  
+        const BYTE *pSrcRow = pSrc + (LONG)(y * step) * lSrcStride;
+
+        for(DWORD x = 0; x < cols; x++)
+        {
+            *pDest++ = pSrcRow[x * step];
+        }
+    }
 }
 
-bool CColorConverter::IsFormatSupported(REFGUID subtype) const
+void CColorConverter::SampleLuma_P010(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
 {
-    for(DWORD i = 0; i < s_NumConversionFuncs; i++)
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
+
+    for(DWORD y = 0; y < rows; y++)
     {
-        if(subtype == s_FormatConversions[i].subtype)
+        // High byte of each MSB-aligned 16-bit sample.
+        const BYTE *pSrcRow = pSrc + (LONG)(y * step) * lSrcStride + 1;
+
+        for(DWORD x = 0; x < cols; x++)
         {
-            return TRUE;
+            *pDest++ = pSrcRow[x * step * 2];
         }
     }
-    return FALSE;
 }
 
-HRESULT CColorConverter::GetFormat(DWORD index, GUID *pSubtype) const
+void CColorConverter::SampleLuma_Y210(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
 {
-    if(index < s_NumConversionFuncs)
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
+
+    for(DWORD y = 0; y < rows; y++)
     {
-        *pSubtype = s_FormatConversions[index].subtype;
-        return S_OK;
+        const BYTE *pSrcRow = pSrc + (LONG)(y * step) * lSrcStride + 1;
+
+        for(DWORD x = 0; x < cols; x++)
+        {
+            *pDest++ = pSrcRow[x * step * 4];
+        }
     }
-    return MF_E_NO_MORE_TYPES;
 }
 
 //-------------------------------------------------------------------
-// SetVideoType
+// SampleLuma_Bayer8 / SampleLuma_Bayer16
 //
-// Set the video format.  
+// The 2x2 cell holding the top-left pixel of each step x step cell
+// always contains red, blue and two greens, so its mean stands in for
+// the luma without knowing the pattern.
 //-------------------------------------------------------------------
 
-HRESULT CColorConverter::SetVideoType(IMFMediaType *pType)
+void CColorConverter::SampleLuma_Bayer8(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
 {
-    HRESULT hr = S_OK;
-    GUID subtype = { 0 };
-    MFRatio PAR = { 0 };
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
 
-    // Find the video subtype.
-    hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
-
-    if(SUCCEEDED(hr))
+    for(DWORD y = 0; y < rows; y++)
     {
-        // Choose a conversion function.
-        // (This also validates the format type.)
-
-        hr = SetConversionFunction(subtype);
+        const BYTE *pRow0 = pSrc + (LONG)((y * step) & ~1) * lSrcStride;
+        const BYTE *pRow1 = pRow0 + lSrcStride;
 
-        if(SUCCEEDED(hr))
+        for(DWORD x = 0; x < cols; x++)
         {
-            //
-            // Get some video attributes.
-            //
+            DWORD sx = (x * step) & ~1;
+            BYTE m = (BYTE)((pRow0[sx] + pRow0[sx + 1] + pRow1[sx] + pRow1[sx + 1] + 2) >> 2);
+            *pDest++ = LumaFromRGB(m, m, m);
+        }
+    }
+}
 
-            // Get the frame size.
-            hr = MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &m_width, &m_height);
+void CColorConverter::SampleLuma_Bayer16(
+    BYTE*       pDest,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    UINT        step
+    )
+{
+    DWORD cols = dwWidthInPixels / step;
+    DWORD rows = dwHeightInPixels / step;
 
-            if(SUCCEEDED(hr))
-            {
-                // Get the interlace mode. Default: assume progressive.
-                m_interlace = (MFVideoInterlaceMode)MFGetAttributeUINT32(
-                    pType,
-                    MF_MT_INTERLACE_MODE,
-                    MFVideoInterlace_Progressive
-                    );
+    for(DWORD y = 0; y < rows; y++)
+    {
+        // High byte of each MSB-aligned 16-bit sample.
+        const BYTE *pRow0 = pSrc + (LONG)((y * step) & ~1) * lSrcStride + 1;
+        const BYTE *pRow1 = pRow0 + lSrcStride;
 
-                // Get the image stride.
-                hr = GetDefaultStride(pType, &m_lDefaultStride);
+        for(DWORD x = 0; x < cols; x++)
+        {
+            DWORD sx = ((x * step) & ~1) * 2;
+            BYTE m = (BYTE)((pRow0[sx] + pRow0[sx + 2] + pRow1[sx] + pRow1[sx + 2] + 2) >> 2);
+            *pDest++ = LumaFromRGB(m, m, m);
+        }
+    }
+}
 
-                if(SUCCEEDED(hr))
-                {
-                    // Get the pixel aspect ratio. Default: Assume square pixels (1:1)
-                    hr = MFGetAttributeRatio(
-                        pType,
-                        MF_MT_PIXEL_ASPECT_RATIO,
-                        (UINT32*)&PAR.Numerator,
-                        (UINT32*)&PAR.Denominator
-                        );
+HRESULT CColorConverter::SetConversionFunction(REFGUID subtype)
+{
+    m_convertFn = NULL;
+    m_format = NULL;
+    m_params.bayer = Bayer_None;
 
-                    if(SUCCEEDED(hr))
-                    {
-                        m_PixelAR = PAR;
-                    }
-                    else
-                    {
-                        m_PixelAR.Numerator = m_PixelAR.Denominator = 1;
-                    }
-                }
-            }
+    for(DWORD i = 0; i < s_NumConversionFuncs; i++)
+    {
+        if(s_FormatConversions[i].subtype == subtype)
+        {
+            m_convertFn = s_FormatConversions[i].xform;
+            m_format = &s_FormatConversions[i];
+            m_params.bayer = m_format->bayer;
+            return S_OK;
         }
     }
 
-    return hr;
+    return MF_E_INVALIDMEDIATYPE;
 }
 
-//-----------------------------------------------------------------------------
-// GetDefaultStride
-//
-// Gets the default stride for a video frame, assuming no extra padding bytes.
+//-------------------------------------------------------------------
+// Color sampling functions
 //
-//-----------------------------------------------------------------------------
+// Add the B, G and R values of every step-th pixel and row of the
+// region rc to pHistogram (three tables of 256 counts, B first). They
+// read the native frame, so the statistics for the color correction
+// cost a small fraction of a conversion pass.
+//-------------------------------------------------------------------
 
-HRESULT CColorConverter::GetDefaultStride(IMFMediaType *pType, LONG *plStride)
+static __forceinline void AddToHistogram(DWORD* pHistogram, BYTE b, BYTE g, BYTE r)
 {
-    LONG lStride = 0;
+    pHistogram[b]++;
+    pHistogram[256 + g]++;
+    pHistogram[512 + r]++;
+}
 
-    // Try to get the default stride from the media type.
-    HRESULT hr = pType->GetUINT32(MF_MT_DEFAULT_STRIDE, (UINT32*)&lStride);
-    if(FAILED(hr))
+void CColorConverter::SampleColor_RGB24(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    for(LONG y = rc.top; y < rc.bottom; y += step)
     {
-        // Attribute not set. Try to calculate the default stride.
-        GUID subtype = GUID_NULL;
+        const RGBTRIPLE *pSrcPel = (const RGBTRIPLE*)(pSrc + y * lSrcStride);
 
-        UINT32 width = 0;
-        UINT32 height = 0;
+        for(LONG x = rc.left; x < rc.right; x += step)
+        {
+            AddToHistogram(pHistogram, pSrcPel[x].rgbtBlue, pSrcPel[x].rgbtGreen, pSrcPel[x].rgbtRed);
+        }
+    }
+}
 
-        // Get the subtype and the image size.
-        hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
-        if(SUCCEEDED(hr))
+void CColorConverter::SampleColor_RGB32(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    for(LONG y = rc.top; y < rc.bottom; y += step)
+    {
+        const RGBQUAD *pSrcPel = (const RGBQUAD*)(pSrc + y * lSrcStride);
+
+        for(LONG x = rc.left; x < rc.right; x += step)
         {
-            hr = MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &width, &height);
+            AddToHistogram(pHistogram, pSrcPel[x].rgbBlue, pSrcPel[x].rgbGreen, pSrcPel[x].rgbRed);
         }
-        if(SUCCEEDED(hr))
+    }
+}
+
+void CColorConverter::SampleColor_YUY2(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    for(LONG y = rc.top; y < rc.bottom; y += step)
+    {
+        const BYTE *pSrcRow = pSrc + y * lSrcStride;
+
+        // Sample the first pixel of each pair: Y0 U Y1 V.
+        for(LONG x = rc.left & ~1; x < rc.right; x += (step + 1) & ~1)
         {
-            hr = MFGetStrideForBitmapInfoHeader(subtype.Data1, width, &lStride);
+            const BYTE *pPair = pSrcRow + x * 2;
+            RGBQUAD rgbq = ConvertYCrCbToRGB(pPair[0], pPair[3], pPair[1]);
+            AddToHistogram(pHistogram, rgbq.rgbBlue, rgbq.rgbGreen, rgbq.rgbRed);
+        }
+    }
+}
+
+void CColorConverter::SampleColor_NV12(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    const BYTE *pChroma = pSrc + dwHeightInPixels * lSrcStride;
+
+    for(LONG y = rc.top; y < rc.bottom; y += step)
+    {
+        const BYTE *pLine = pSrc + y * lSrcStride;
+        const BYTE *pLineC = pChroma + (y / 2) * lSrcStride;
+
+        for(LONG x = rc.left & ~1; x < rc.right; x += (step + 1) & ~1)
+        {
+            RGBQUAD rgbq = ConvertYCrCbToRGB(pLine[x], pLineC[x + 1], pLineC[x]);
+            AddToHistogram(pHistogram, rgbq.rgbBlue, rgbq.rgbGreen, rgbq.rgbRed);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// SampleColor_Bayer*
+//
+// One B, G, R triple per sampled 2x2 cell: the red and blue samples
+// and the mean of the greens. redX and redY locate the red sample.
+//-------------------------------------------------------------------
+
+static void SampleColorBayer(DWORD* pHistogram, const BYTE* pSrc, LONG lSrcStride, const RECT& rc, UINT step, LONG redX, LONG redY)
+{
+    LONG cellStep = (step + 1) & ~1;
+
+    for(LONG y = rc.top; y + 1 < rc.bottom; y += cellStep)
+    {
+        const BYTE *pRows[2] = { pSrc + y * lSrcStride, pSrc + (y + 1) * lSrcStride };
+
+        for(LONG x = rc.left; x + 1 < rc.right; x += cellStep)
+        {
+            BYTE r = pRows[redY][x + redX];
+            BYTE b = pRows[1 - redY][x + 1 - redX];
+            BYTE g = (BYTE)((pRows[redY][x + 1 - redX] + pRows[1 - redY][x + redX] + 1) >> 1);
+            AddToHistogram(pHistogram, b, g, r);
+        }
+    }
+}
+
+void CColorConverter::SampleColor_BayerRGGB(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    SampleColorBayer(pHistogram, pSrc, lSrcStride, rc, step, 0, 0);
+}
+
+void CColorConverter::SampleColor_BayerGRBG(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    SampleColorBayer(pHistogram, pSrc, lSrcStride, rc, step, 1, 0);
+}
+
+void CColorConverter::SampleColor_BayerGBRG(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    SampleColorBayer(pHistogram, pSrc, lSrcStride, rc, step, 0, 1);
+}
+
+void CColorConverter::SampleColor_BayerBGGR(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    )
+{
+    SampleColorBayer(pHistogram, pSrc, lSrcStride, rc, step, 1, 1);
+}
+
+HRESULT CColorConverter::ConvertImageToRGB32(BYTE* pDest, LONG destStride, IMFMediaBuffer *buf)
+{
+    BYTE *pbScanline0 = NULL;
+    LONG lStride = 0;
+
+    if(!m_convertFn)
+    {
+        return MF_E_INVALIDMEDIATYPE;
+    }
+
+    VideoBufferLock buffer(buf);
+
+    HRESULT hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
+    if(SUCCEEDED(hr))
+    {
+        // In continuous mode the correction measured on the previous
+        // frame is used and the statistics are gathered afterwards.
+        bool carryOver = m_continuousCorrection && m_correctionValid;
+        if(!carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+
+        if(m_rotation != Rotation_0 || m_mirror)
+            ConvertOriented(pDest, destStride, pbScanline0, lStride);
+        else
+            m_convertFn(pDest, destStride, pbScanline0, lStride, m_width, m_height, m_params);
+
+        if(carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// Tensor conversion
+//
+// The region of interest is converted band by band (one chroma row
+// group at a time, so deinterlacing still applies) into a small RGB-32
+// cache, and only the bands the bilinear filter needs are converted.
+// Each output pixel is filtered, normalized and stored straight into
+// the caller's tensor, so no full size RGB image is ever written.
+//-------------------------------------------------------------------
+
+static WORD FloatToHalf(float f)
+{
+    union { float f; DWORD u; } v;
+    v.f = f;
+
+    WORD sign = (WORD)((v.u >> 16) & 0x8000);
+    int exp = (int)((v.u >> 23) & 0xFF) - 127 + 15;
+    DWORD mant = v.u & 0x7FFFFF;
+
+    if(exp >= 31)
+    {
+        return sign | 0x7C00; // Overflow to infinity.
+    }
+    if(exp <= 0)
+    {
+        if(exp < -10)
+        {
+            return sign;
+        }
+        // Subnormal half.
+        mant |= 0x800000;
+        DWORD shift = 14 - exp;
+        DWORD half = mant >> shift;
+        if((mant >> (shift - 1)) & 1)
+        {
+            half++;
+        }
+        return sign | (WORD)half;
+    }
+
+    // A carry out of the mantissa correctly bumps the exponent.
+    DWORD half = ((DWORD)exp << 10) | (mant >> 13);
+    if(mant & 0x1000)
+    {
+        half++;
+    }
+    return sign | (WORD)half;
+}
+
+static __forceinline __m128 LoadPixel(const BYTE* p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_cvtsi32_si128(*(const int*)p);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero));
+}
+
+DWORD CColorConverter::GetTensorSize(const TensorFormat& format)
+{
+    DWORD cbValue = format.dataType == TensorData_Float16 ? 2 : 4;
+    return format.width * format.height * 3 * cbValue;
+}
+
+//-------------------------------------------------------------------
+// ConvertImageToTensor
+//
+// Converts the region of interest of a frame into a normalized float
+// tensor, resized with a bilinear filter. Aspect correction and the
+// output depth do not apply; pDest must hold GetTensorSize bytes.
+//-------------------------------------------------------------------
+
+HRESULT CColorConverter::ConvertImageToTensor(void* pDest, const TensorFormat& format, IMFMediaBuffer *buf)
+{
+    if(!m_convertFn)
+    {
+        return MF_E_NOT_INITIALIZED;
+    }
+    if(!pDest || format.width == 0 || format.height == 0)
+    {
+        return E_INVALIDARG;
+    }
+    for(int c = 0; c < 3; c++)
+    {
+        if(format.std[c] == 0.0f)
+        {
+            return E_INVALIDARG;
+        }
+    }
+
+    // Sizes in converted pixels, which are 2x2 source pixels for
+    // superpixel demosaicing.
+    const RECT &rc = m_params.rcSource;
+    const LONG shift = GetOutputShift(m_params);
+    const LONG srcWidth = (rc.right - rc.left) >> shift;
+    const LONG srcHeight = (rc.bottom - rc.top) >> shift;
+    const LONG bandRows = max((LONG)m_format->yAlign >> shift, 1L);
+    const LONG cbRow = srcWidth * 4;
+
+    // Two bands cover any pair of adjacent rows.
+    BYTE *pBands = new BYTE[2 * bandRows * cbRow];
+    LONG *pX0 = new LONG[format.width];
+    float *pFx = new float[format.width];
+
+    // Source column pairs for pixel centers, clamped at the edges.
+    float scaleX = (float)srcWidth / format.width;
+    for(UINT x = 0; x < format.width; x++)
+    {
+        float sx = (x + 0.5f) * scaleX - 0.5f;
+        sx = sx < 0.0f ? 0.0f : (sx > srcWidth - 1 ? (float)(srcWidth - 1) : sx);
+        pX0[x] = (LONG)sx;
+        if(pX0[x] >= srcWidth - 1)
+        {
+            pX0[x] = srcWidth > 1 ? srcWidth - 2 : 0;
+        }
+        pFx[x] = srcWidth > 1 ? sx - pX0[x] : 0.0f;
+    }
+
+    // (c / 255 - mean) / std as one multiply-add, in BGRA lane order.
+    float scale[4], bias[4];
+    for(int c = 0; c < 3; c++)
+    {
+        int lane = 2 - c; // R is lane 2 of a BGRA pixel.
+        scale[lane] = 1.0f / (255.0f * format.std[c]);
+        bias[lane] = -format.mean[c] / format.std[c];
+    }
+    scale[3] = bias[3] = 0.0f;
+    const __m128 vScale = _mm_loadu_ps(scale);
+    const __m128 vBias = _mm_loadu_ps(bias);
+
+    // Lane of each tensor channel.
+    const int lanes[3] = { format.bgrOrder ? 0 : 2, 1, format.bgrOrder ? 2 : 0 };
+    const DWORD planeSize = format.width * format.height;
+    const bool chw = format.layout == TensorLayout_CHW;
+    const bool half = format.dataType == TensorData_Float16;
+
+    BYTE *pbScanline0 = NULL;
+    LONG lStride = 0;
+
+    VideoBufferLock buffer(buf);
+
+    HRESULT hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
+    if(SUCCEEDED(hr))
+    {
+        // Same as ConvertImageToRGB32: continuous correction uses the
+        // previous frame and measures this one afterwards.
+        bool carryOver = m_continuousCorrection && m_correctionValid;
+        if(!carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+
+        TransformParams band = m_params;
+        band.pTaps = NULL;
+        band.wideOutput = false;
+
+        LONG bandTop[2] = { -1, -1 };
+        int nextBand = 0;
+        float scaleY = (float)srcHeight / format.height;
+
+        for(UINT y = 0; y < format.height; y++)
+        {
+            float sy = (y + 0.5f) * scaleY - 0.5f;
+            sy = sy < 0.0f ? 0.0f : (sy > srcHeight - 1 ? (float)(srcHeight - 1) : sy);
+            LONG y0 = (LONG)sy;
+            LONG y1 = y0 + 1 < srcHeight ? y0 + 1 : y0;
+            const __m128 fy = _mm_set1_ps(sy - y0);
+
+            // Fetch both rows, converting their bands if not cached.
+            const BYTE *pRows[2];
+            LONG rows[2] = { y0, y1 };
+            for(int i = 0; i < 2; i++)
+            {
+                LONG top = (rows[i] / bandRows) * bandRows;
+                int slot = bandTop[0] == top ? 0 : (bandTop[1] == top ? 1 : -1);
+                if(slot < 0)
+                {
+                    // Never evict the band holding the first row.
+                    slot = (i == 1 && bandTop[nextBand] == (y0 / bandRows) * bandRows) ? 1 - nextBand : nextBand;
+                    nextBand = 1 - slot;
+
+                    SetRect(&band.rcSource, rc.left, rc.top + (top << shift), rc.right, rc.top + ((top + bandRows) << shift));
+                    m_convertFn(pBands + slot * bandRows * cbRow, cbRow, pbScanline0, lStride, m_width, m_height, band);
+                    bandTop[slot] = top;
+                }
+                pRows[i] = pBands + (slot * bandRows + rows[i] - top) * cbRow;
+            }
+
+            for(UINT x = 0; x < format.width; x++)
+            {
+                const BYTE *p0 = pRows[0] + pX0[x] * 4;
+                const BYTE *p1 = pRows[1] + pX0[x] * 4;
+                LONG next = srcWidth > 1 ? 4 : 0;
+                __m128 fx = _mm_set1_ps(pFx[x]);
+
+                __m128 a = LoadPixel(p0);
+                __m128 b = LoadPixel(p1);
+                __m128 upper = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(LoadPixel(p0 + next), a), fx));
+                __m128 lower = _mm_add_ps(b, _mm_mul_ps(_mm_sub_ps(LoadPixel(p1 + next), b), fx));
+                __m128 v = _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), fy));
+                v = _mm_add_ps(_mm_mul_ps(v, vScale), vBias);
+
+                float out[4];
+                _mm_storeu_ps(out, v);
+
+                DWORD index = y * format.width + x;
+                for(int c = 0; c < 3; c++)
+                {
+                    DWORD pos = chw ? c * planeSize + index : index * 3 + c;
+                    if(half)
+                        ((WORD*)pDest)[pos] = FloatToHalf(out[lanes[c]]);
+                    else
+                        ((float*)pDest)[pos] = out[lanes[c]];
+                }
+            }
+        }
+
+        if(carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+    }
+
+    delete[] pBands;
+    delete[] pX0;
+    delete[] pFx;
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// SampleLuma
+//
+// Fills pDest with the subsampled luma of the native frame, see the
+// luma sampling functions above.
+//-------------------------------------------------------------------
+
+HRESULT CColorConverter::SampleLuma(BYTE* pDest, UINT step, IMFMediaBuffer *buf)
+{
+    if(!m_format || step == 0)
+    {
+        return MF_E_NOT_INITIALIZED;
+    }
+
+    BYTE *pbScanline0 = NULL;
+    LONG lStride = 0;
+
+    VideoBufferLock buffer(buf);
+
+    HRESULT hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
+    if(SUCCEEDED(hr))
+    {
+        m_format->sampleLuma(pDest, pbScanline0, lStride, m_width, m_height, step);
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// SetRegionOfInterest
+//
+// Restricts conversion to a rectangle of the frame. Pass NULL to
+// convert the full frame. The rectangle is expanded to the chroma
+// grid of the current format and clipped to the frame, so it can be
+// set before or after the video type. A rectangle outside of the
+// frame fails with E_INVALIDARG and the previous region is kept;
+// SetVideoType fails the same way for frames that miss the region.
+//-------------------------------------------------------------------
+
+HRESULT CColorConverter::SetRegionOfInterest(const RECT *prc)
+{
+    RECT previousRoi = m_requestedRoi;
+    bool hadRoi = m_hasRoi;
+
+    if(prc)
+    {
+        if(prc->left < 0 || prc->top < 0 || prc->right <= prc->left || prc->bottom <= prc->top)
+        {
+            return E_INVALIDARG;
+        }
+        m_requestedRoi = *prc;
+        m_hasRoi = true;
+    }
+    else
+    {
+        SetRectEmpty(&m_requestedRoi);
+        m_hasRoi = false;
+    }
+
+    HRESULT hr = UpdateSourceRect();
+    if(FAILED(hr))
+    {
+        m_requestedRoi = previousRoi;
+        m_hasRoi = hadRoi;
+        UpdateSourceRect();
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// SetDeinterlaceMode
+//
+// Overrides the deinterlacing of the YUV formats. Deinterlace_Auto
+// picks it from MF_MT_INTERLACE_MODE: progressive and single-field
+// samples are left alone, interleaved fields are blended.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetDeinterlaceMode(DeinterlaceMode mode)
+{
+    m_deinterlaceMode = mode;
+    UpdateDeinterlace();
+}
+
+void CColorConverter::UpdateDeinterlace()
+{
+    DeinterlaceMode mode = m_deinterlaceMode;
+
+    if(mode == Deinterlace_Auto)
+    {
+        switch(m_interlace)
+        {
+        case MFVideoInterlace_FieldInterleavedUpperFirst:
+        case MFVideoInterlace_FieldInterleavedLowerFirst:
+        case MFVideoInterlace_MixedInterlaceOrProgressive:
+            mode = Deinterlace_Blend;
+            break;
+
+        default:
+            mode = Deinterlace_Weave;
+            break;
+        }
+    }
+
+    m_params.deinterlace = mode;
+    m_params.dominantField = (m_interlace == MFVideoInterlace_FieldInterleavedLowerFirst) ? 1 : 0;
+}
+
+//-------------------------------------------------------------------
+// SetAspectCorrection
+//
+// Enables or disables horizontal resampling of non-square pixels to
+// square pixels. Enabled by default.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetAspectCorrection(bool enable)
+{
+    m_aspectCorrection = enable;
+    UpdateResampler();
+}
+
+//-------------------------------------------------------------------
+// UpdateResampler
+//
+// Builds the polyphase filter table that stretches the source region
+// by the pixel aspect ratio, so the kernels can resample each row while
+// it is still in cache. Called whenever the video type or the region
+// changes.
+//-------------------------------------------------------------------
+
+void CColorConverter::UpdateResampler()
+{
+    DWORD inWidth = (m_params.rcSource.right - m_params.rcSource.left) >> GetOutputShift(m_params);
+
+    delete[] m_pTaps;
+    m_pTaps = NULL;
+    m_params.pTaps = NULL;
+    m_params.dwOutWidth = inWidth;
+
+    if(!m_aspectCorrection || inWidth == 0 || m_params.wideOutput ||
+        m_PixelAR.Numerator == 0 || m_PixelAR.Denominator == 0 ||
+        m_PixelAR.Numerator == m_PixelAR.Denominator)
+    {
+        return;
+    }
+
+    DWORD outWidth = (DWORD)(((UINT64)inWidth * m_PixelAR.Numerator + m_PixelAR.Denominator / 2) / m_PixelAR.Denominator);
+    if(outWidth == 0 || outWidth == inWidth)
+    {
+        return;
+    }
+
+    if(!m_pWeights)
+    {
+        m_pWeights = (SHORT*)_aligned_malloc(kResamplePhases * 16 * sizeof(SHORT), 16);
+
+        for(LONG phase = 0; phase < kResamplePhases; phase++)
+        {
+            double t = (double)phase / kResamplePhases;
+            double w[4] =
+            {
+                (-t * t * t + 2 * t * t - t) / 2,
+                (3 * t * t * t - 5 * t * t + 2) / 2,
+                (-3 * t * t * t + 4 * t * t + t) / 2,
+                (t * t * t - t * t) / 2
+            };
+
+            SHORT q[4];
+            LONG total = 0;
+            for(int i = 0; i < 4; i++)
+            {
+                q[i] = (SHORT)floor(w[i] * (1 << kResampleShift) + 0.5);
+                total += q[i];
+            }
+            // Keep flat areas exact.
+            q[t < 0.5 ? 1 : 2] += (SHORT)((1 << kResampleShift) - total);
+
+            SHORT *pPhase = m_pWeights + phase * 16;
+            for(int i = 0; i < 4; i++)
+            {
+                pPhase[i * 2] = q[0];
+                pPhase[i * 2 + 1] = q[1];
+                pPhase[8 + i * 2] = q[2];
+                pPhase[8 + i * 2 + 1] = q[3];
+            }
+        }
+    }
+
+    m_pTaps = new ResampleTap[outWidth];
+
+    double scale = (double)inWidth / outWidth;
+    for(DWORD x = 0; x < outWidth; x++)
+    {
+        // Centre of the output pixel in source coordinates, clamped so
+        // the taps stay within the padded row.
+        double sx = (x + 0.5) * scale - 0.5;
+        sx = sx < 0 ? 0 : (sx > inWidth - 1 ? inWidth - 1 : sx);
+
+        LONG ix = (LONG)sx;
+        LONG phase = (LONG)floor((sx - ix) * kResamplePhases + 0.5);
+        if(phase == kResamplePhases)
+        {
+            ix++;
+            phase = 0;
+        }
+
+        m_pTaps[x].srcX = ix;
+        m_pTaps[x].phase = phase;
+    }
+
+    m_params.dwOutWidth = outWidth;
+    m_params.pTaps = m_pTaps;
+    m_params.pWeights = m_pWeights;
+}
+
+//-------------------------------------------------------------------
+// Orientation
+//
+// Rotated or mirrored frames are converted in bands of kOrientBandRows
+// rows into a buffer that stays in the cache, and each band is copied
+// to the destination in 4x4 pixel tiles. For 90 and 270 degrees every
+// output row a band touches receives 16 consecutive pixels, a full
+// cache line, rather than the single pixel of a column-wise write.
+//-------------------------------------------------------------------
+
+static const LONG kOrientBandRows = 16;
+
+// Output position of converted pixel (x, y):
+// u = u0 + ux * x + uy * y, v = v0 + vx * x + vy * y
+struct OrientMap
+{
+    LONG u0, ux, uy;
+    LONG v0, vx, vy;
+};
+
+static OrientMap GetOrientMap(Rotation rotation, bool mirror, LONG width, LONG height)
+{
+    OrientMap m = { 0, 1, 0, 0, 0, 1 };
+    LONG outWidth = width;
+
+    switch(rotation)
+    {
+    case Rotation_90:
+        m.u0 = height - 1; m.ux = 0; m.uy = -1;
+        m.v0 = 0; m.vx = 1; m.vy = 0;
+        outWidth = height;
+        break;
+    case Rotation_180:
+        m.u0 = width - 1; m.ux = -1; m.uy = 0;
+        m.v0 = height - 1; m.vx = 0; m.vy = -1;
+        break;
+    case Rotation_270:
+        m.u0 = 0; m.ux = 0; m.uy = 1;
+        m.v0 = width - 1; m.vx = -1; m.vy = 0;
+        outWidth = height;
+        break;
+    }
+
+    if(mirror)
+    {
+        m.u0 = outWidth - 1 - m.u0;
+        m.ux = -m.ux;
+        m.uy = -m.uy;
+    }
+    return m;
+}
+
+static __forceinline void OrientPixel(BYTE* pDest, LONG destStride, const BYTE* pSrc, const OrientMap& m, LONG x, LONG y, DWORD cbPixel)
+{
+    BYTE *pOut = pDest + (m.v0 + m.vx * x + m.vy * y) * destStride + (m.u0 + m.ux * x + m.uy * y) * (LONG)cbPixel;
+
+    if(cbPixel == 8)
+        *(UINT64*)pOut = *(const UINT64*)pSrc;
+    else
+        *(DWORD*)pOut = *(const DWORD*)pSrc;
+}
+
+//-------------------------------------------------------------------
+// WriteOrientedBand
+//
+// Copies rows y0 .. y0 + rows - 1 of the converted image, held in
+// pBand, to their place in the oriented destination.
+//-------------------------------------------------------------------
+
+static void WriteOrientedBand(
+    BYTE*       pDest,
+    LONG        destStride,
+    const BYTE* pBand,
+    LONG        cbBandRow,
+    LONG        width,
+    LONG        y0,
+    LONG        rows,
+    const OrientMap& m,
+    DWORD       cbPixel
+    )
+{
+    LONG tileWidth = 0;
+    LONG tileRows = 0;
+
+    if(cbPixel == 4)
+    {
+        tileWidth = width & ~3;
+        tileRows = rows & ~3;
+        const bool transpose = m.ux == 0;
+
+        for(LONG bx = 0; bx < tileWidth; bx += 4)
+        {
+            for(LONG by = 0; by < tileRows; by += 4)
+            {
+                const BYTE *pTile = pBand + by * cbBandRow + bx * 4;
+                __m128i r[4];
+                for(int i = 0; i < 4; i++)
+                {
+                    r[i] = _mm_loadu_si128((const __m128i*)(pTile + i * cbBandRow));
+                }
+
+                LONG x = bx;
+                LONG y = y0 + by;
+                LONG step;  // Change of u along the lanes of r[i].
+                LONG rowX, rowY;
+                if(transpose)
+                {
+                    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+                    __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+                    __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+                    __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+                    r[0] = _mm_unpacklo_epi64(t0, t1);
+                    r[1] = _mm_unpackhi_epi64(t0, t1);
+                    r[2] = _mm_unpacklo_epi64(t2, t3);
+                    r[3] = _mm_unpackhi_epi64(t2, t3);
+
+                    // r[i] now holds column x + i, rows y .. y + 3.
+                    step = m.uy;
+                    rowX = 1;
+                    rowY = 0;
+                }
+                else
+                {
+                    step = m.ux;
+                    rowX = 0;
+                    rowY = 1;
+                }
+
+                for(int i = 0; i < 4; i++)
+                {
+                    LONG xi = x + rowX * i;
+                    LONG yi = y + rowY * i;
+                    LONG u = m.u0 + m.ux * xi + m.uy * yi;
+                    LONG v = m.v0 + m.vx * xi + m.vy * yi;
+                    __m128i pixels = r[i];
+
+                    if(step < 0)
+                    {
+                        pixels = _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 1, 2, 3));
+                        u -= 3;
+                    }
+                    _mm_storeu_si128((__m128i*)(pDest + v * destStride + u * 4), pixels);
+                }
+            }
+        }
+    }
+
+    // Pixels outside the 4x4 tiles.
+    for(LONG y = 0; y < rows; y++)
+    {
+        const BYTE *pRow = pBand + y * cbBandRow;
+        LONG x = y < tileRows ? tileWidth : 0;
+
+        for(; x < width; x++)
+        {
+            OrientPixel(pDest, destStride, pRow + x * cbPixel, m, x, y0 + y, cbPixel);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// ConvertOriented
+//
+// Converts the frame band by band and writes each band rotated and/or
+// mirrored, see SetOrientation.
+//-------------------------------------------------------------------
+
+void CColorConverter::ConvertOriented(BYTE* pDest, LONG destStride, const BYTE* pSrc, LONG lSrcStride)
+{
+    const RECT &rc = m_params.rcSource;
+    const LONG shift = GetOutputShift(m_params);
+    const LONG width = m_params.dwOutWidth;
+    const LONG height = (rc.bottom - rc.top) >> shift;
+    const DWORD cbPixel = GetOutputBytesPerPixel();
+    const LONG cbBandRow = width * cbPixel;
+    const DWORD cbBand = kOrientBandRows * cbBandRow;
+
+    if(m_cbBand < cbBand)
+    {
+        delete[] m_pBand;
+        m_pBand = new BYTE[cbBand];
+        m_cbBand = cbBand;
+    }
+
+    OrientMap m = GetOrientMap(m_rotation, m_mirror, width, height);
+    TransformParams band = m_params;
+
+    for(LONG y = 0; y < height; y += kOrientBandRows)
+    {
+        LONG rows = min(kOrientBandRows, height - y);
+        band.rcSource.top = rc.top + (y << shift);
+        band.rcSource.bottom = band.rcSource.top + (rows << shift);
+
+        m_convertFn(m_pBand, cbBandRow, pSrc, lSrcStride, m_width, m_height, band);
+        WriteOrientedBand(pDest, destStride, m_pBand, cbBandRow, width, y, rows, m, cbPixel);
+    }
+}
+
+//-------------------------------------------------------------------
+// Strip conversion
+//
+// ConvertImageStrips hands the frame to a sink (an image encoder or
+// file writer) in strips of about kStripBytes, each converted into the
+// same small buffer while the previous one is still in the cache, so
+// a capture never needs a full size RGB image. Strips are a multiple
+// of kOrientBandRows rows, which keeps them aligned to chroma rows
+// and deinterlacing field pairs.
+//
+// 90 and 270 degree rotations turn source columns into output rows,
+// so those strips are bands of columns, see ConvertRotatedStrips.
+//-------------------------------------------------------------------
+
+static const DWORD kStripBytes = 256 * 1024;
+
+HRESULT CColorConverter::ConvertImageStrips(IStripSink *pSink, IMFMediaBuffer *buf)
+{
+    BYTE *pbScanline0 = NULL;
+    LONG lStride = 0;
+
+    if(!m_convertFn)
+    {
+        return MF_E_INVALIDMEDIATYPE;
+    }
+
+    VideoBufferLock buffer(buf);
+
+    HRESULT hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
+    if(SUCCEEDED(hr))
+    {
+        bool carryOver = m_continuousCorrection && m_correctionValid;
+        if(!carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+
+        hr = ConvertStrips(pSink, pbScanline0, lStride);
+
+        if(carryOver)
+            UpdateColorCorrection(pbScanline0, lStride);
+    }
+    return hr;
+}
+
+HRESULT CColorConverter::ConvertStrips(IStripSink *pSink, const BYTE* pSrc, LONG lSrcStride)
+{
+    const RECT &rc = m_params.rcSource;
+    const LONG shift = GetOutputShift(m_params);
+    const LONG width = m_params.dwOutWidth;
+    const LONG height = (rc.bottom - rc.top) >> shift;
+    const DWORD cbPixel = GetOutputBytesPerPixel();
+    const LONG cbRow = width * cbPixel;
+    HRESULT hr = S_OK;
+
+    if(m_rotation == Rotation_90 || m_rotation == Rotation_270)
+    {
+        return ConvertRotatedStrips(pSink, pSrc, lSrcStride);
+    }
+
+    LONG stripRows = (LONG)(kStripBytes / cbRow) & ~(kOrientBandRows - 1);
+    if(stripRows < kOrientBandRows)
+        stripRows = kOrientBandRows;
+
+    // Rotated by 180 degrees or mirrored frames are converted into the
+    // first half of the buffer and reordered into the second.
+    const bool reorder = m_rotation != Rotation_0 || m_mirror;
+    const DWORD cbStrip = stripRows * cbRow;
+    const DWORD cbBuffer = reorder ? 2 * cbStrip : cbStrip;
+
+    if(m_cbBand < cbBuffer)
+    {
+        delete[] m_pBand;
+        m_pBand = new BYTE[cbBuffer];
+        m_cbBand = cbBuffer;
+    }
+
+    OrientMap m = GetOrientMap(m_rotation, m_mirror, width, height);
+    TransformParams band = m_params;
+
+    for(LONG y = 0; y < height && SUCCEEDED(hr); y += stripRows)
+    {
+        LONG rows = min(stripRows, height - y);
+
+        // Output rows y .. y + rows - 1 come from the same number of
+        // source rows, counted from the bottom for 180 degrees.
+        LONG srcY = m_rotation == Rotation_180 ? height - y - rows : y;
+        band.rcSource.top = rc.top + (srcY << shift);
+        band.rcSource.bottom = band.rcSource.top + (rows << shift);
+
+        m_convertFn(m_pBand, cbRow, pSrc, lSrcStride, m_width, m_height, band);
+
+        if(reorder)
+        {
+            OrientMap stripMap = m;
+            stripMap.v0 -= y;
+
+            BYTE *pStrip = m_pBand + cbStrip;
+            WriteOrientedBand(pStrip, cbRow, m_pBand, cbRow, width, srcY, rows, stripMap, cbPixel);
+            hr = pSink->WriteStrip(pStrip, cbRow, rows);
+        }
+        else
+        {
+            hr = pSink->WriteStrip(m_pBand, cbRow, rows);
+        }
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// ConvertRotatedStrips
+//
+// Each strip of a frame rotated by 90 or 270 degrees holds a band of
+// columns of the unrotated image. m_params is pointed at the chroma
+// aligned source columns of the band, with the resampling taps moved
+// onto them, and ConvertOriented converts and transposes the band
+// into the strip. The bands start at multiples of the strip size, so
+// only the band at the right edge is narrower; for 270 degrees the
+// output starts with that band.
+//-------------------------------------------------------------------
+
+HRESULT CColorConverter::ConvertRotatedStrips(IStripSink *pSink, const BYTE* pSrc, LONG lSrcStride)
+{
+    const TransformParams params = m_params;
+    const RECT &rc = params.rcSource;
+    const LONG shift = GetOutputShift(params);
+    const LONG width = params.dwOutWidth;
+    const LONG height = (rc.bottom - rc.top) >> shift;
+    const LONG inWidth = (rc.right - rc.left) >> shift;
+    const DWORD cbPixel = GetOutputBytesPerPixel();
+    const LONG cbRow = height * cbPixel;
+    const LONG align = max((LONG)m_format->xAlign >> shift, 1L);   // Keeps the bands chroma aligned.
+    HRESULT hr = S_OK;
+
+    LONG stripRows = (LONG)(kStripBytes / cbRow) & ~(kOrientBandRows - 1);
+    if(stripRows < kOrientBandRows)
+        stripRows = kOrientBandRows;
+
+    BYTE *pStrip = new BYTE[(DWORD)stripRows * cbRow];
+    ResampleTap *pTaps = params.pTaps ? new ResampleTap[stripRows] : NULL;
+
+    const LONG bandCount = (width + stripRows - 1) / stripRows;
+    for(LONG i = 0; i < bandCount && SUCCEEDED(hr); i++)
+    {
+        LONG band = m_rotation == Rotation_90 ? i : bandCount - 1 - i;
+        LONG x0 = band * stripRows;
+        LONG x1 = min(x0 + stripRows, width);
+
+        // Columns of the image before resampling. The taps read pixels
+        // srcX - 1 .. srcX + 2; beyond the edges of the region EmitRow
+        // replicates the edge pixels just as for whole rows.
+        LONG left = x0;
+        LONG right = x1;
+        if(pTaps)
+        {
+            left = params.pTaps[x0].srcX - 1;
+            right = params.pTaps[x1 - 1].srcX + 3;
+            if(left < 0)
+                left = 0;
+        }
+        left -= left % align;
+        right = min((right + align - 1) / align * align, inWidth);
+
+        if(pTaps)
+        {
+            for(LONG x = x0; x < x1; x++)
+            {
+                pTaps[x - x0].srcX = params.pTaps[x].srcX - left;
+                pTaps[x - x0].phase = params.pTaps[x].phase;
+            }
+        }
+
+        m_params.rcSource.left = rc.left + (left << shift);
+        m_params.rcSource.right = rc.left + (right << shift);
+        m_params.dwOutWidth = x1 - x0;
+        m_params.pTaps = pTaps;
+
+        ConvertOriented(pStrip, cbRow, pSrc, lSrcStride);
+        hr = pSink->WriteStrip(pStrip, cbRow, x1 - x0);
+    }
+
+    m_params = params;
+    delete[] pTaps;
+    delete[] pStrip;
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// SetOrientation
+//
+// Rotates the output clockwise and then mirrors it horizontally if
+// requested. 90 and 270 degrees swap the output width and height.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetOrientation(Rotation rotation, bool mirror)
+{
+    m_rotation = rotation;
+    m_mirror = mirror;
+}
+
+//-------------------------------------------------------------------
+// SetDemosaicMode
+//
+// Selects the interpolation of the raw Bayer formats, bilinear by
+// default. Demosaic_Superpixel halves the output width and height.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetDemosaicMode(DemosaicMode mode)
+{
+    m_params.demosaic = mode;
+    UpdateResampler();
+}
+
+//-------------------------------------------------------------------
+// SetColorCorrection
+//
+// Enables automatic levels and white balance for the 8-bit formats.
+// The statistics come from a subsampled grid of the native region of
+// interest and are folded into the output tables of the conversion,
+// so the correction adds no work per converted pixel. With continuous
+// set, each frame is corrected with the (smoothed) statistics of the
+// previous frames, which avoids flicker in capture loops.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetColorCorrection(ColorCorrection mode, bool continuous)
+{
+    m_correction = mode;
+    m_continuousCorrection = continuous;
+    m_correctionValid = false;
+    m_params.correctRgb = false;
+    BuildOutputLut();
+}
+
+static const UINT kColorSampleStep = 8;
+static const float kCorrectionSmoothing = 0.25f;   // Weight of the newest frame.
+static const float kMinLevelRange = 64.0f;         // Limits the gain to 4x.
+
+//-------------------------------------------------------------------
+// UpdateColorCorrection
+//
+// Derives the input levels mapped to 0 and 255 per channel from the
+// histograms of the current frame and rebuilds the output tables.
+//-------------------------------------------------------------------
+
+void CColorConverter::UpdateColorCorrection(const BYTE* pSrc, LONG lSrcStride)
+{
+    if(m_correction == ColorCorrection_None || !m_format || !m_format->sampleColor)
+    {
+        return;
+    }
+
+    DWORD histogram[3 * 256];
+    ZeroMemory(histogram, sizeof(histogram));
+    m_format->sampleColor(histogram, pSrc, lSrcStride, m_height, m_params.rcSource, kColorSampleStep);
+
+    DWORD total = 0;
+    for(int i = 0; i < 256; i++)
+    {
+        total += histogram[i];
+    }
+    if(total == 0)
+    {
+        return;
+    }
+
+    // 0.5% and 99.5% percentiles and the mean per channel.
+    float black[3], white[3], mean[3];
+    for(int c = 0; c < 3; c++)
+    {
+        const DWORD *pHist = histogram + c * 256;
+        DWORD lowCount = total / 200;
+        DWORD highCount = total - total / 200;
+        DWORD count = 0;
+        double sum = 0.0;
+
+        black[c] = white[c] = -1.0f;
+        for(int i = 0; i < 256; i++)
+        {
+            count += pHist[i];
+            sum += (double)i * pHist[i];
+            if(black[c] < 0.0f && count > lowCount)
+                black[c] = (float)i;
+            if(white[c] < 0.0f && count >= highCount)
+                white[c] = (float)i;
+        }
+        mean[c] = (float)(sum / total);
+    }
+
+    float low[3], high[3];
+    if(m_correction == ColorCorrection_Levels)
+    {
+        float b = min(black[0], min(black[1], black[2]));
+        float w = max(white[0], max(white[1], white[2]));
+        for(int c = 0; c < 3; c++)
+        {
+            low[c] = b;
+            high[c] = w;
+        }
+    }
+    else if(m_correction == ColorCorrection_WhitePatch)
+    {
+        for(int c = 0; c < 3; c++)
+        {
+            low[c] = black[c];
+            high[c] = white[c];
+        }
+    }
+    else
+    {
+        // Gray world: scale each channel so the means above black agree,
+        // then map the brightest scaled channel to white.
+        float avg = 0.0f;
+        for(int c = 0; c < 3; c++)
+        {
+            avg += max(mean[c] - black[c], 1.0f) / 3.0f;
+        }
+
+        float gain[3], range = 0.0f;
+        for(int c = 0; c < 3; c++)
+        {
+            gain[c] = avg / max(mean[c] - black[c], 1.0f);
+            range = max(range, (white[c] - black[c]) * gain[c]);
+        }
+        for(int c = 0; c < 3; c++)
+        {
+            low[c] = black[c];
+            high[c] = black[c] + range / gain[c];
+        }
+    }
+
+    for(int c = 0; c < 3; c++)
+    {
+        if(high[c] - low[c] < kMinLevelRange)
+        {
+            high[c] = low[c] + kMinLevelRange;
+        }
+        if(m_continuousCorrection && m_correctionValid)
+        {
+            low[c] = m_levelLow[c] + (low[c] - m_levelLow[c]) * kCorrectionSmoothing;
+            high[c] = m_levelHigh[c] + (high[c] - m_levelHigh[c]) * kCorrectionSmoothing;
+        }
+        m_levelLow[c] = low[c];
+        m_levelHigh[c] = high[c];
+    }
+
+    m_correctionValid = true;
+    m_params.correctRgb = true;
+    BuildOutputLut();
+}
+
+//-------------------------------------------------------------------
+// BuildOutputLut
+//
+// Fills the output tables: clipping only, or clipping after mapping
+// m_levelLow..m_levelHigh to 0..255 when a correction is valid.
+//-------------------------------------------------------------------
+
+void CColorConverter::BuildOutputLut()
+{
+    for(int c = 0; c < 3; c++)
+    {
+        float low = 0.0f;
+        float scale = 1.0f;
+        if(m_correctionValid)
+        {
+            low = m_levelLow[c];
+            scale = 255.0f / (m_levelHigh[c] - low);
+        }
+
+        for(int i = 0; i < kOutputLutSize; i++)
+        {
+            float v = (i - kOutputLutBias - low) * scale;
+            m_outputLut[c][i] = Clip((int)floorf(v + 0.5f));
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// SetOutputDepth
+//
+// Selects 8 (BGRA, the default) or 16 bits per channel (RGBA) output.
+// 16-bit output only applies to the high bit depth formats and is not
+// aspect corrected; other formats keep producing 8-bit BGRA.
+//-------------------------------------------------------------------
+
+void CColorConverter::SetOutputDepth(UINT bitsPerChannel)
+{
+    m_outputDepth = bitsPerChannel;
+    UpdateOutputFormat();
+    UpdateResampler();
+}
+
+UINT CColorConverter::GetOutputBytesPerPixel() const
+{
+    return m_params.wideOutput ? 8 : 4;
+}
+
+// 2 for the 16-bit formats (P010, P016, Y210, 16-bit Bayer), 1 for
+// the 8-bit ones.
+UINT CColorConverter::GetInputBytesPerSample() const
+{
+    return m_format && m_format->bitsPerSample > 8 ? 2 : 1;
+}
+
+void CColorConverter::UpdateOutputFormat()
+{
+    m_params.wideOutput = m_outputDepth > 8 && m_format && m_format->bitsPerSample > 8;
+}
+
+void CColorConverter::GetOutputSize(UINT &width, UINT &height) const
+{
+    width = m_params.dwOutWidth;
+    height = (m_params.rcSource.bottom - m_params.rcSource.top) >> GetOutputShift(m_params);
+
+    if(m_rotation == Rotation_90 || m_rotation == Rotation_270)
+    {
+        UINT temp = width;
+        width = height;
+        height = temp;
+    }
+}
+
+HRESULT CColorConverter::UpdateSourceRect()
+{
+    RECT rcFrame = { 0, 0, (LONG)m_width, (LONG)m_height };
+    RECT rc = rcFrame;
+    HRESULT hr = S_OK;
+
+    if(m_hasRoi && m_format)
+    {
+        LONG xAlign = m_format->xAlign;
+        LONG yAlign = m_format->yAlign;
+
+        rc.left = m_requestedRoi.left - m_requestedRoi.left % xAlign;
+        rc.top = m_requestedRoi.top - m_requestedRoi.top % yAlign;
+        rc.right = (m_requestedRoi.right + xAlign - 1) / xAlign * xAlign;
+        rc.bottom = (m_requestedRoi.bottom + yAlign - 1) / yAlign * yAlign;
+
+        // The full frame stands in for a region outside of it until
+        // the caller picks another region or video type.
+        if(!IntersectRect(&rc, &rc, &rcFrame))
+        {
+            rc = rcFrame;
+            hr = E_INVALIDARG;
+        }
+    }
+
+    m_params.rcSource = rc;
+    UpdateResampler();
+    return hr;
+}
+
+bool CColorConverter::IsFormatSupported(REFGUID subtype) const
+{
+    for(DWORD i = 0; i < s_NumConversionFuncs; i++)
+    {
+        if(subtype == s_FormatConversions[i].subtype)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+HRESULT CColorConverter::GetFormat(DWORD index, GUID *pSubtype) const
+{
+    if(index < s_NumConversionFuncs)
+    {
+        *pSubtype = s_FormatConversions[index].subtype;
+        return S_OK;
+    }
+    return MF_E_NO_MORE_TYPES;
+}
+
+//-------------------------------------------------------------------
+// SetVideoType
+//
+// Set the video format.  
+//-------------------------------------------------------------------
+
+HRESULT CColorConverter::SetVideoType(IMFMediaType *pType)
+{
+    HRESULT hr = S_OK;
+    GUID subtype = { 0 };
+    MFRatio PAR = { 0 };
+
+    // Find the video subtype.
+    hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+
+    if(SUCCEEDED(hr))
+    {
+        // Choose a conversion function.
+        // (This also validates the format type.)
+
+        hr = SetConversionFunction(subtype);
+
+        if(SUCCEEDED(hr))
+        {
+            //
+            // Get some video attributes.
+            //
+
+            // Get the frame size.
+            hr = MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &m_width, &m_height);
+
+            if(SUCCEEDED(hr))
+            {
+                // Get the interlace mode. Default: assume progressive.
+                m_interlace = (MFVideoInterlaceMode)MFGetAttributeUINT32(
+                    pType,
+                    MF_MT_INTERLACE_MODE,
+                    MFVideoInterlace_Progressive
+                    );
+
+                // Get the image stride.
+                hr = GetDefaultStride(pType, &m_lDefaultStride);
+
+                if(SUCCEEDED(hr))
+                {
+                    // Get the pixel aspect ratio. Default: Assume square pixels (1:1)
+                    hr = MFGetAttributeRatio(
+                        pType,
+                        MF_MT_PIXEL_ASPECT_RATIO,
+                        (UINT32*)&PAR.Numerator,
+                        (UINT32*)&PAR.Denominator
+                        );
+
+                    if(SUCCEEDED(hr))
+                    {
+                        m_PixelAR = PAR;
+                    }
+                    else
+                    {
+                        m_PixelAR.Numerator = m_PixelAR.Denominator = 1;
+                    }
+
+                    // Room for the filtered source rows of the widest
+                    // format and for padded RGB-32 rows.
+                    delete[] m_pScratch;
+                    m_params.cbScratchRow = (m_width + kRowPadLeft + kRowPadRight) * 4;
+                    m_pScratch = new BYTE[(kNumScratchRows + kNumRowBuffers) * m_params.cbScratchRow];
+                    m_params.pScratch = m_pScratch;
+                    m_params.pRowBuffer = m_pScratch + kNumScratchRows * m_params.cbScratchRow;
+
+                    UpdateOutputFormat();
+                    hr = UpdateSourceRect();
+                    m_correctionValid = false;
+                    m_params.correctRgb = false;
+                    BuildOutputLut();
+                    UpdateDeinterlace();
+                }
+            }
+        }
+    }
+
+    // Nothing is converted with a type that was refused.
+    if(FAILED(hr))
+    {
+        m_convertFn = NULL;
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// GetDefaultStride
+//
+// Gets the default stride for a video frame, assuming no extra padding bytes.
+//
+//-----------------------------------------------------------------------------
+
+HRESULT CColorConverter::GetDefaultStride(IMFMediaType *pType, LONG *plStride)
+{
+    LONG lStride = 0;
+
+    // Try to get the default stride from the media type.
+    HRESULT hr = pType->GetUINT32(MF_MT_DEFAULT_STRIDE, (UINT32*)&lStride);
+    if(FAILED(hr))
+    {
+        // Attribute not set. Try to calculate the default stride.
+        GUID subtype = GUID_NULL;
+
+        UINT32 width = 0;
+        UINT32 height = 0;
+
+        // Get the subtype and the image size.
+        hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+        if(SUCCEEDED(hr))
+        {
+            hr = MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &width, &height);
+        }
+        if(SUCCEEDED(hr))
+        {
+            hr = MFGetStrideForBitmapInfoHeader(subtype.Data1, width, &lStride);
+
+            // Not every platform knows the 16-bit formats.
+            if(FAILED(hr) && (subtype == MFVideoFormat_P010 || subtype == MFVideoFormat_P016))
+            {
+                lStride = width * 2;
+                hr = S_OK;
+            }
+            else if(FAILED(hr) && subtype == MFVideoFormat_Y210)
+            {
+                lStride = width * 4;
+                hr = S_OK;
+            }
+            else if(FAILED(hr) && m_format && m_format->bayer != Bayer_None)
+            {
+                lStride = width * m_format->bitsPerSample / 8;
+                hr = S_OK;
+            }
         }
 
         // Set the attribute for later reference.
@@ -1,14 +1,92 @@
 #pragma once
 
 #include <mfapi.h>
+#include "ConvertKernels.h"
+
+enum Rotation
+{
+    Rotation_0,
+    Rotation_90,                // Clockwise.
+    Rotation_180,
+    Rotation_270
+};
+
+// Raw Bayer subtypes, using the FourCCs of the V4L2 formats. The 16-bit
+// variants hold MSB-aligned little-endian samples like P016.
+extern const GUID MFVideoFormat_BayerRGGB8;     // 'RGGB'
+extern const GUID MFVideoFormat_BayerGRBG8;     // 'GRBG'
+extern const GUID MFVideoFormat_BayerGBRG8;     // 'GBRG'
+extern const GUID MFVideoFormat_BayerBGGR8;     // 'BA81'
+extern const GUID MFVideoFormat_BayerRGGB16;    // 'RG16'
+extern const GUID MFVideoFormat_BayerGRBG16;    // 'GR16'
+extern const GUID MFVideoFormat_BayerGBRG16;    // 'GB16'
+extern const GUID MFVideoFormat_BayerBGGR16;    // 'BYR2'
+
+enum ColorCorrection
+{
+    ColorCorrection_None,
+    ColorCorrection_Levels,     // Common black and white level for all channels.
+    ColorCorrection_GrayWorld,  // Levels plus gains that make the average gray.
+    ColorCorrection_WhitePatch  // Per-channel levels, the brightest patch becomes white.
+};
+
+enum TensorLayout
+{
+    TensorLayout_CHW,           // One plane per channel.
+    TensorLayout_HWC            // Channels interleaved per pixel.
+};
+
+enum TensorDataType
+{
+    TensorData_Float32,
+    TensorData_Float16          // IEEE half precision.
+};
+
+//-------------------------------------------------------------------
+// TensorFormat
+//
+// Output of ConvertImageToTensor: a width x height, 3-channel tensor
+// holding (c / 255 - mean[i]) / std[i] per channel, in R, G, B order
+// unless bgrOrder is set.
+//-------------------------------------------------------------------
+
+struct TensorFormat
+{
+    UINT            width;
+    UINT            height;
+    TensorLayout    layout;
+    TensorDataType  dataType;
+    bool            bgrOrder;
+    float           mean[3];
+    float           std[3];
+};
 
 typedef void(*IMAGE_TRANSFORM_FN)(
+    BYTE*                   pDest,
+    LONG                    lDestStride,
+    const BYTE*             pSrc,
+    LONG                    lSrcStride,
+    DWORD                   dwWidthInPixels,
+    DWORD                   dwHeightInPixels,
+    const TransformParams&  params
+    );
+
+typedef void(*COLOR_SAMPLE_FN)(
+    DWORD*      pHistogram,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwHeightInPixels,
+    const RECT& rc,
+    UINT        step
+    );
+
+typedef void(*LUMA_SAMPLE_FN)(
     BYTE*       pDest,
-    LONG        lDestStride,
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    UINT        step
     );
 
 
@@ -16,6 +94,24 @@ struct ConversionFunction
 {
     GUID               subtype;
     IMAGE_TRANSFORM_FN xform;
+    LUMA_SAMPLE_FN     sampleLuma;
+    UINT               xAlign;  // Horizontal chroma subsampling, in pixels.
+    UINT               yAlign;  // Vertical chroma subsampling, in pixels.
+    UINT               bitsPerSample;
+    COLOR_SAMPLE_FN    sampleColor; // NULL if color correction is not supported.
+    BayerPattern       bayer;
+};
+
+//-------------------------------------------------------------------
+// IStripSink
+//
+// Receives a converted frame from ConvertImageStrips as consecutive
+// top-down strips of rows.
+//-------------------------------------------------------------------
+
+struct IStripSink
+{
+    virtual HRESULT WriteStrip(const BYTE* pRows, LONG stride, UINT rowCount) = 0;
 };
 
 class CColorConverter
@@ -25,10 +121,25 @@ public:
     ~CColorConverter();
 
     HRESULT SetConversionFunction(REFGUID subtype);
-    void ConvertImageToRGB32(BYTE* pDest, LONG destStride, IMFMediaBuffer *buf);
+    HRESULT ConvertImageToRGB32(BYTE* pDest, LONG destStride, IMFMediaBuffer *buf);
+    HRESULT ConvertImageStrips(IStripSink *pSink, IMFMediaBuffer *buf);
+    HRESULT ConvertImageToTensor(void* pDest, const TensorFormat& format, IMFMediaBuffer *buf);
+    HRESULT SampleLuma(BYTE* pDest, UINT step, IMFMediaBuffer *buf);
     bool IsFormatSupported(REFGUID subtype) const;
     HRESULT GetFormat(DWORD index, GUID *pSubtype) const;
     HRESULT SetVideoType(IMFMediaType *pType);
+    HRESULT SetRegionOfInterest(const RECT *prc);
+    void SetDeinterlaceMode(DeinterlaceMode mode);
+    void SetAspectCorrection(bool enable);
+    void SetOutputDepth(UINT bitsPerChannel);
+    void SetColorCorrection(ColorCorrection mode, bool continuous);
+    void SetOrientation(Rotation rotation, bool mirror);
+    void SetDemosaicMode(DemosaicMode mode);
+    UINT GetOutputBytesPerPixel() const;
+    UINT GetInputBytesPerSample() const;
+    void GetOutputSize(UINT &width, UINT &height) const;
+
+    static DWORD GetTensorSize(const TensorFormat& format);
 
     UINT                    m_width;
     UINT                    m_height;
@@ -38,6 +149,26 @@ public:
 
 protected:
     IMAGE_TRANSFORM_FN      m_convertFn;
+    const ConversionFunction *m_format;
+    TransformParams         m_params;
+    RECT                    m_requestedRoi;
+    bool                    m_hasRoi;
+    DeinterlaceMode         m_deinterlaceMode;
+    BYTE                    *m_pScratch;
+    bool                    m_aspectCorrection;
+    ResampleTap             *m_pTaps;
+    SHORT                   *m_pWeights;
+    UINT                    m_outputDepth;
+    ColorCorrection         m_correction;
+    bool                    m_continuousCorrection;
+    bool                    m_correctionValid;
+    float                   m_levelLow[3];
+    float                   m_levelHigh[3];
+    BYTE                    m_outputLut[3][kOutputLutSize];
+    Rotation                m_rotation;
+    bool                    m_mirror;
+    BYTE                    *m_pBand;
+    DWORD                   m_cbBand;
 
     static void TransformImage_RGB24(
         BYTE*       pDest,
@@ -45,7 +176,8 @@ protected:
         const BYTE* pSrc,
         LONG        lSrcStride,
         DWORD       dwWidthInPixels,
-        DWORD       dwHeightInPixels
+        DWORD       dwHeightInPixels,
+        const TransformParams& params
         );
 
     static void TransformImage_RGB32(
@@ -54,7 +186,8 @@ protected:
         const BYTE* pSrc,
         LONG        lSrcStride,
         DWORD       dwWidthInPixels,
-        DWORD       dwHeightInPixels
+        DWORD       dwHeightInPixels,
+        const TransformParams& params
         );
 
     static void TransformImage_YUY2(
@@ -63,7 +196,8 @@ protected:
         const BYTE* pSrc,
         LONG        lSrcStride,
         DWORD       dwWidthInPixels,
-        DWORD       dwHeightInPixels
+        DWORD       dwHeightInPixels,
+        const TransformParams& params
         );
 
     static void TransformImage_NV12(
@@ -72,12 +206,166 @@ protected:
         const BYTE* pSrc,
         LONG srcStride,
         DWORD dwWidthInPixels,
-        DWORD dwHeightInPixels
+        DWORD dwHeightInPixels,
+        const TransformParams& params
+        );
+
+    static void SampleLuma_RGB24(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_RGB32(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_YUY2(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_NV12(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_P010(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_Y210(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_Bayer8(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleLuma_Bayer16(
+        BYTE*       pDest,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwWidthInPixels,
+        DWORD       dwHeightInPixels,
+        UINT        step
+        );
+
+    static void SampleColor_RGB24(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_RGB32(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_YUY2(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_NV12(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_BayerRGGB(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_BayerGRBG(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_BayerGBRG(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
+        );
+
+    static void SampleColor_BayerBGGR(
+        DWORD*      pHistogram,
+        const BYTE* pSrc,
+        LONG        lSrcStride,
+        DWORD       dwHeightInPixels,
+        const RECT& rc,
+        UINT        step
         );
 
     static const ConversionFunction s_FormatConversions[];
     static const int s_NumConversionFuncs;
 
     HRESULT GetDefaultStride(IMFMediaType *pType, LONG *plStride);
+    HRESULT UpdateSourceRect();
+    void UpdateDeinterlace();
+    void UpdateResampler();
+    void UpdateOutputFormat();
+    void UpdateColorCorrection(const BYTE* pSrc, LONG lSrcStride);
+    void BuildOutputLut();
+    void ConvertOriented(BYTE* pDest, LONG destStride, const BYTE* pSrc, LONG lSrcStride);
+    HRESULT ConvertStrips(IStripSink *pSink, const BYTE* pSrc, LONG lSrcStride);
+    HRESULT ConvertRotatedStrips(IStripSink *pSink, const BYTE* pSrc, LONG lSrcStride);
 };
 
@@ -0,0 +1,815 @@
+#include "ConvertKernels.h"
+
+#include <limits.h>
+
+//-------------------------------------------------------------------
+// GetSourceRow
+//
+// Returns cbRow bytes of row y of a plane with the deinterlacing filter
+// applied, so the YUV kernels handle the fields in the same pass as
+// the color conversion. pRow0 points at the first byte to convert in
+// row 0 of the plane, cbSample is 2 for 16-bit formats. Rows that need
+// no filtering are returned in place, otherwise the filtered row is
+// written to pScratch. The scalar tails round like the SSE2 loops, so
+// the result does not depend on the row width.
+//-------------------------------------------------------------------
+
+const BYTE* GetSourceRow(
+    const BYTE*             pRow0,
+    LONG                    lStride,
+    LONG                    y,
+    LONG                    rows,
+    DWORD                   cbRow,
+    const TransformParams&  params,
+    BYTE*                   pScratch,
+    DWORD                   cbSample
+    )
+{
+    const BYTE *pRow = pRow0 + y * lStride;
+
+    if(params.deinterlace == Deinterlace_Weave || rows < 2)
+    {
+        return pRow;
+    }
+    if(params.deinterlace == Deinterlace_Bob && (y & 1) == params.dominantField)
+    {
+        return pRow;
+    }
+
+    // Neighbours in the other field, mirrored at the frame edges.
+    const BYTE *pAbove = pRow0 + (y > 0 ? y - 1 : y + 1) * lStride;
+    const BYTE *pBelow = pRow0 + (y + 1 < rows ? y + 1 : y - 1) * lStride;
+
+    DWORD i = 0;
+    if(cbSample == 2)
+    {
+        // 16-bit little-endian samples.
+        const WORD *pA = (const WORD*)pAbove;
+        const WORD *pB = (const WORD*)pBelow;
+        const WORD *pC = (const WORD*)pRow;
+        WORD *pS = (WORD*)pScratch;
+        DWORD count = cbRow / 2;
+
+        for(; i + 8 <= count; i += 8)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(pA + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(pB + i));
+            __m128i v = _mm_avg_epu16(a, b);
+            if(params.deinterlace == Deinterlace_Blend)
+            {
+                v = _mm_avg_epu16(v, _mm_loadu_si128((const __m128i*)(pC + i)));
+            }
+            _mm_storeu_si128((__m128i*)(pS + i), v);
+        }
+        for(; i < count; i++)
+        {
+            if(params.deinterlace == Deinterlace_Bob)
+                pS[i] = (WORD)((pA[i] + pB[i] + 1) >> 1);
+            else
+                pS[i] = (WORD)((((pA[i] + pB[i] + 1) >> 1) + pC[i] + 1) >> 1);
+        }
+    }
+    else if(params.deinterlace == Deinterlace_Bob)
+    {
+        for(; i + 16 <= cbRow; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(pAbove + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(pBelow + i));
+            _mm_storeu_si128((__m128i*)(pScratch + i), _mm_avg_epu8(a, b));
+        }
+        for(; i < cbRow; i++)
+        {
+            pScratch[i] = (BYTE)((pAbove[i] + pBelow[i] + 1) >> 1);
+        }
+    }
+    else
+    {
+        for(; i + 16 <= cbRow; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(pAbove + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(pBelow + i));
+            __m128i c = _mm_loadu_si128((const __m128i*)(pRow + i));
+            _mm_storeu_si128((__m128i*)(pScratch + i), _mm_avg_epu8(_mm_avg_epu8(a, b), c));
+        }
+        for(; i < cbRow; i++)
+        {
+            pScratch[i] = (BYTE)((((pAbove[i] + pBelow[i] + 1) >> 1) + pRow[i] + 1) >> 1);
+        }
+    }
+
+    return pScratch;
+}
+
+//-------------------------------------------------------------------
+// ResampleRow
+//-------------------------------------------------------------------
+
+void ResampleRow(BYTE* pDest, const BYTE* pSrc, const TransformParams& params)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (kResampleShift - 1));
+    const __m128i *pWeights = (const __m128i*)params.pWeights;
+
+    for(DWORD x = 0; x < params.dwOutWidth; x++)
+    {
+        const ResampleTap &tap = params.pTaps[x];
+
+        // Source pixels srcX - 1 .. srcX + 2, widened to 16 bits and
+        // interleaved as b0 b1 g0 g1 r0 r1 a0 a1 / b2 b3 g2 g3 ...
+        __m128i p = _mm_loadu_si128((const __m128i*)(pSrc + (tap.srcX - 1) * 4));
+        __m128i p01 = _mm_unpacklo_epi8(p, zero);
+        __m128i p23 = _mm_unpackhi_epi8(p, zero);
+        p01 = _mm_unpacklo_epi16(p01, _mm_srli_si128(p01, 8));
+        p23 = _mm_unpacklo_epi16(p23, _mm_srli_si128(p23, 8));
+
+        __m128i sum = _mm_add_epi32(
+            _mm_madd_epi16(p01, _mm_load_si128(pWeights + tap.phase * 2)),
+            _mm_madd_epi16(p23, _mm_load_si128(pWeights + tap.phase * 2 + 1)));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), kResampleShift);
+
+        sum = _mm_packs_epi32(sum, sum);
+        *(DWORD*)(pDest + x * 4) = (DWORD)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    }
+}
+
+//-------------------------------------------------------------------
+// ApplyOutputLut
+//
+// Runs a row of RGB-32 pixels through the output tables, for sources
+// that are already RGB and only need the color correction.
+//-------------------------------------------------------------------
+
+void ApplyOutputLut(BYTE* pRow, DWORD dwWidthInPixels, const BYTE* pLut)
+{
+    pLut += kOutputLutBias;
+
+    for(DWORD x = 0; x < dwWidthInPixels; x++)
+    {
+        pRow[0] = pLut[pRow[0]];
+        pRow[1] = pLut[kOutputLutSize + pRow[1]];
+        pRow[2] = pLut[2 * kOutputLutSize + pRow[2]];
+        pRow += 4;
+    }
+}
+
+//-------------------------------------------------------------------
+// High bit depth conversion
+//
+// P010, P016 and Y210 store MSB-aligned 16-bit samples. They are
+// converted at 14-bit precision with the coefficients of
+// ConvertYCrCbToRGB scaled by 32, then rounded to 8-bit BGRA or
+// expanded to 16-bit RGBA.
+//-------------------------------------------------------------------
+
+static const int kY14Offset = 16 << 6;
+static const int kC14Offset = 128 << 6;
+
+static __forceinline WORD Expand14(int v)
+{
+    v = (v + (1 << 12)) >> 13;
+    v = v < 0 ? 0 : (v > 16383 ? 16383 : v);
+    return (WORD)((v << 2) | (v >> 12));
+}
+
+static __forceinline void ConvertPixel14(int y, int cb, int cr, BYTE* pDest, bool wide)
+{
+    int c = y - kY14Offset;
+    int d = cb - kC14Offset;
+    int e = cr - kC14Offset;
+
+    int r = 9536 * c + 13088 * e;
+    int g = 9536 * c - 3200 * d - 6656 * e;
+    int b = 9536 * c + 16512 * d;
+
+    if(wide)
+    {
+        WORD *pPel = (WORD*)pDest;
+        pPel[0] = Expand14(r);
+        pPel[1] = Expand14(g);
+        pPel[2] = Expand14(b);
+        pPel[3] = 0xFFFF;
+    }
+    else
+    {
+        pDest[0] = Clip((b + (1 << 18)) >> 19);
+        pDest[1] = Clip((g + (1 << 18)) >> 19);
+        pDest[2] = Clip((r + (1 << 18)) >> 19);
+        pDest[3] = 0; // Alpha
+    }
+}
+
+//-------------------------------------------------------------------
+// StoreWide14
+//
+// Clamps eight 14-bit R, G and B values and stores them as 16-bit RGBA
+// pixels with opaque alpha.
+//-------------------------------------------------------------------
+
+static __forceinline void StoreWide14(__m128i r, __m128i g, __m128i b, BYTE* pDest)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max14 = _mm_set1_epi16(16383);
+    const __m128i alpha = _mm_set1_epi16(-1);
+
+    r = _mm_min_epi16(_mm_max_epi16(r, zero), max14);
+    g = _mm_min_epi16(_mm_max_epi16(g, zero), max14);
+    b = _mm_min_epi16(_mm_max_epi16(b, zero), max14);
+    r = _mm_or_si128(_mm_slli_epi16(r, 2), _mm_srli_epi16(r, 12));
+    g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 12));
+    b = _mm_or_si128(_mm_slli_epi16(b, 2), _mm_srli_epi16(b, 12));
+
+    __m128i rg = _mm_unpacklo_epi16(r, g);
+    __m128i ba = _mm_unpacklo_epi16(b, alpha);
+    _mm_storeu_si128((__m128i*)pDest, _mm_unpacklo_epi32(rg, ba));
+    _mm_storeu_si128((__m128i*)(pDest + 16), _mm_unpackhi_epi32(rg, ba));
+    rg = _mm_unpackhi_epi16(r, g);
+    ba = _mm_unpackhi_epi16(b, alpha);
+    _mm_storeu_si128((__m128i*)(pDest + 32), _mm_unpacklo_epi32(rg, ba));
+    _mm_storeu_si128((__m128i*)(pDest + 48), _mm_unpackhi_epi32(rg, ba));
+}
+
+//-------------------------------------------------------------------
+// ConvertBlock14
+//
+// SSE2 version of ConvertPixel14 for eight pixels. c holds the luma
+// minus its offset, cbcr four Cb/Cr pairs minus their offset, all at
+// 14-bit precision.
+//-------------------------------------------------------------------
+
+static __forceinline void ConvertBlock14(__m128i c, __m128i cbcr, BYTE* pDest, bool wide)
+{
+    const __m128i kCoeffR = _mm_setr_epi16(0, 13088, 0, 13088, 0, 13088, 0, 13088);
+    const __m128i kCoeffG = _mm_setr_epi16(-3200, -6656, -3200, -6656, -3200, -6656, -3200, -6656);
+    const __m128i kCoeffB = _mm_setr_epi16(16512, 0, 16512, 0, 16512, 0, 16512, 0);
+    const __m128i kCoeffY = _mm_set1_epi16(9536);
+
+    // Chroma terms, one per pixel pair.
+    __m128i rc = _mm_madd_epi16(cbcr, kCoeffR);
+    __m128i gc = _mm_madd_epi16(cbcr, kCoeffG);
+    __m128i bc = _mm_madd_epi16(cbcr, kCoeffB);
+
+    // 32-bit luma terms for pixels 0-3 and 4-7.
+    __m128i lo = _mm_mullo_epi16(c, kCoeffY);
+    __m128i hi = _mm_mulhi_epi16(c, kCoeffY);
+    __m128i y03 = _mm_unpacklo_epi16(lo, hi);
+    __m128i y47 = _mm_unpackhi_epi16(lo, hi);
+
+    __m128i r03 = _mm_add_epi32(y03, _mm_shuffle_epi32(rc, _MM_SHUFFLE(1, 1, 0, 0)));
+    __m128i r47 = _mm_add_epi32(y47, _mm_shuffle_epi32(rc, _MM_SHUFFLE(3, 3, 2, 2)));
+    __m128i g03 = _mm_add_epi32(y03, _mm_shuffle_epi32(gc, _MM_SHUFFLE(1, 1, 0, 0)));
+    __m128i g47 = _mm_add_epi32(y47, _mm_shuffle_epi32(gc, _MM_SHUFFLE(3, 3, 2, 2)));
+    __m128i b03 = _mm_add_epi32(y03, _mm_shuffle_epi32(bc, _MM_SHUFFLE(1, 1, 0, 0)));
+    __m128i b47 = _mm_add_epi32(y47, _mm_shuffle_epi32(bc, _MM_SHUFFLE(3, 3, 2, 2)));
+
+    if(wide)
+    {
+        const __m128i round = _mm_set1_epi32(1 << 12);
+
+        __m128i r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(r03, round), 13), _mm_srai_epi32(_mm_add_epi32(r47, round), 13));
+        __m128i g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(g03, round), 13), _mm_srai_epi32(_mm_add_epi32(g47, round), 13));
+        __m128i b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(b03, round), 13), _mm_srai_epi32(_mm_add_epi32(b47, round), 13));
+
+        StoreWide14(r, g, b, pDest);
+    }
+    else
+    {
+        const __m128i round = _mm_set1_epi32(1 << 18);
+        const __m128i zero = _mm_setzero_si128();
+
+        __m128i r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(r03, round), 19), _mm_srai_epi32(_mm_add_epi32(r47, round), 19));
+        __m128i g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(g03, round), 19), _mm_srai_epi32(_mm_add_epi32(g47, round), 19));
+        __m128i b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(b03, round), 19), _mm_srai_epi32(_mm_add_epi32(b47, round), 19));
+
+        __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+        __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), zero);
+        _mm_storeu_si128((__m128i*)pDest, _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i*)(pDest + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+}
+
+//-------------------------------------------------------------------
+// ConvertRow_P010
+//
+// One row of 16-bit luma with its interleaved 16-bit Cb/Cr row.
+//-------------------------------------------------------------------
+
+static void ConvertRow_P010(BYTE* pDest, const WORD* pY, const WORD* pCbCr, DWORD dwWidthInPixels, bool wide)
+{
+    const __m128i offsetY = _mm_set1_epi16(kY14Offset);
+    const __m128i offsetC = _mm_set1_epi16(kC14Offset);
+    const DWORD cbPixel = wide ? 8 : 4;
+
+    DWORD x = 0;
+    for(; x + 8 <= dwWidthInPixels; x += 8)
+    {
+        __m128i c = _mm_sub_epi16(_mm_srli_epi16(_mm_loadu_si128((const __m128i*)(pY + x)), 2), offsetY);
+        __m128i cbcr = _mm_sub_epi16(_mm_srli_epi16(_mm_loadu_si128((const __m128i*)(pCbCr + x)), 2), offsetC);
+
+        ConvertBlock14(c, cbcr, pDest + x * cbPixel, wide);
+    }
+    for(; x < dwWidthInPixels; x += 2)
+    {
+        int cb = pCbCr[x] >> 2;
+        int cr = pCbCr[x + 1] >> 2;
+
+        ConvertPixel14(pY[x] >> 2, cb, cr, pDest + x * cbPixel, wide);
+        if(x + 1 < dwWidthInPixels)
+        {
+            ConvertPixel14(pY[x + 1] >> 2, cb, cr, pDest + (x + 1) * cbPixel, wide);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// ConvertRow_Y210
+//
+// One row of packed 16-bit Y0 Cb Y1 Cr samples.
+//-------------------------------------------------------------------
+
+static void ConvertRow_Y210(BYTE* pDest, const WORD* pSrc, DWORD dwWidthInPixels, bool wide)
+{
+    const __m128i offsetY = _mm_set1_epi16(kY14Offset);
+    const __m128i offsetC = _mm_set1_epi16(kC14Offset);
+    const DWORD cbPixel = wide ? 8 : 4;
+
+    DWORD x = 0;
+    for(; x + 8 <= dwWidthInPixels; x += 8)
+    {
+        // After the shift all samples fit in 14 bits, so the signed
+        // packs below split even (luma) and odd (chroma) samples.
+        __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(pSrc + x * 2)), 2);
+        __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(pSrc + x * 2 + 8)), 2);
+
+        __m128i luma = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+            _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+        __m128i cbcr = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+
+        ConvertBlock14(_mm_sub_epi16(luma, offsetY), _mm_sub_epi16(cbcr, offsetC), pDest + x * cbPixel, wide);
+    }
+    for(; x < dwWidthInPixels; x += 2)
+    {
+        const WORD *pPair = pSrc + x * 2;
+        int cb = pPair[1] >> 2;
+        int cr = pPair[3] >> 2;
+
+        ConvertPixel14(pPair[0] >> 2, cb, cr, pDest + x * cbPixel, wide);
+        if(x + 1 < dwWidthInPixels)
+        {
+            ConvertPixel14(pPair[2] >> 2, cb, cr, pDest + (x + 1) * cbPixel, wide);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TransformImage_P010
+//
+// P010 and P016 to RGB-32 or 16-bit RGBA
+//-------------------------------------------------------------------
+
+void TransformImage_P010(
+    BYTE* pDst,
+    LONG dstStride,
+    const BYTE* pSrc,
+    LONG srcStride,
+    DWORD dwWidthInPixels,
+    DWORD dwHeightInPixels,
+    const TransformParams& params
+    )
+{
+    // Same layout as NV12 with two bytes per sample.
+    const RECT &rc = params.rcSource;
+    const DWORD dwWidth = rc.right - rc.left;
+    const DWORD cbRow = dwWidth * 2;
+    const DWORD cbRowC = ((dwWidth + 1) & ~1) * 2;     // Whole Cb/Cr pairs.
+    const BYTE* lpBitsY = pSrc + rc.left * 2;
+    const BYTE* lpBitsC = pSrc + (dwHeightInPixels * srcStride) + rc.left * 2;
+    BYTE* lpScratch = params.pScratch;
+    const DWORD cbScratch = params.cbScratchRow;
+
+    for(LONG y = rc.top; y < rc.bottom; y += 2)
+    {
+        const WORD* lpLineY1 = (const WORD*)GetSourceRow(lpBitsY, srcStride, y, dwHeightInPixels, cbRow, params, lpScratch, 2);
+        const WORD* lpLineY2 = (const WORD*)GetSourceRow(lpBitsY, srcStride, y + 1, dwHeightInPixels, cbRow, params, lpScratch + cbScratch, 2);
+        const WORD* lpLineC = (const WORD*)GetSourceRow(lpBitsC, srcStride, y / 2, dwHeightInPixels / 2, cbRowC, params, lpScratch + 2 * cbScratch, 2);
+
+        BYTE* lpRow1 = GetRowBuffer(pDst, params, 0);
+        BYTE* lpRow2 = GetRowBuffer(pDst + dstStride, params, 1);
+
+        ConvertRow_P010(lpRow1, lpLineY1, lpLineC, dwWidth, params.wideOutput);
+        ConvertRow_P010(lpRow2, lpLineY2, lpLineC, dwWidth, params.wideOutput);
+
+        EmitRow(pDst, lpRow1, dwWidth, params);
+        EmitRow(pDst + dstStride, lpRow2, dwWidth, params);
+
+        pDst += (2 * dstStride);
+    }
+}
+
+//-------------------------------------------------------------------
+// TransformImage_Y210
+//
+// Y210 to RGB-32 or 16-bit RGBA
+//-------------------------------------------------------------------
+
+void TransformImage_Y210(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
+    )
+{
+    const RECT &rc = params.rcSource;
+    const DWORD dwWidth = rc.right - rc.left;
+    const DWORD cbRow = ((dwWidth + 1) & ~1) * 4;      // Whole Y0 Cb Y1 Cr groups.
+    pSrc += rc.left * 4;
+
+    for(LONG y = rc.top; y < rc.bottom; y++)
+    {
+        const WORD *pSrcRow = (const WORD*)GetSourceRow(
+            pSrc, lSrcStride, y, dwHeightInPixels, cbRow, params, params.pScratch, 2);
+        BYTE *pRow = GetRowBuffer(pDest, params, 0);
+
+        ConvertRow_Y210(pRow, pSrcRow, dwWidth, params.wideOutput);
+        EmitRow(pDest, pRow, dwWidth, params);
+
+        pDest += lDestStride;
+    }
+}
+
+//-------------------------------------------------------------------
+// Bayer demosaicing
+//
+// Raw rows are expanded to 14-bit samples, the precision of the high
+// bit depth path, with kBayerPad mirrored columns on each side, into a
+// ring of the five rows around the output row. Each output row is then
+// interpolated with SSE2 eight pixels at a time: the values for both
+// kinds of site (green or not) are computed for every lane and picked
+// with a mask of the lanes holding red or blue samples.
+//
+// An output row depends only on the source frame, never on rows
+// converted before it, so bands of rows (see ConvertOriented) come
+// out the same as the full frame and can be converted independently,
+// each with its own scratch rows. Rows and columns outside the region
+// of interest serve as context; at the frame edges the rows and
+// columns are mirrored, which keeps the color of every padded sample.
+// Deinterlacing does not apply to raw frames.
+//-------------------------------------------------------------------
+
+static const LONG kBayerPad = 2;
+static const LONG kBayerCacheRows = kNumScratchRows;     // Rows of TransformParams::pScratch.
+
+static __forceinline LONG MirrorIndex(LONG i, LONG size)
+{
+    if(i < 0)
+        i = -i;
+    if(i >= size)
+        i = 2 * size - 2 - i;
+    return i;
+}
+
+static __forceinline WORD LoadBayerSample(const BYTE* pRow, LONG x, DWORD cbSample)
+{
+    return cbSample == 1 ? (WORD)(pRow[x] << 6) : (WORD)(((const WORD*)pRow)[x] >> 2);
+}
+
+//-------------------------------------------------------------------
+// ExpandBayerRow
+//
+// Writes columns left - kBayerPad .. left + width + kBayerPad - 1 of a
+// raw row to pDest[-kBayerPad] onwards as 14-bit samples.
+//-------------------------------------------------------------------
+
+static void ExpandBayerRow(WORD* pDest, const BYTE* pRow, LONG left, LONG width, LONG frameWidth, DWORD cbSample)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const LONG first = -left > -kBayerPad ? -left : -kBayerPad;
+    const LONG last = frameWidth - left < width + kBayerPad ? frameWidth - left : width + kBayerPad;
+
+    LONG x = -kBayerPad;
+    for(; x < first; x++)
+    {
+        pDest[x] = LoadBayerSample(pRow, MirrorIndex(left + x, frameWidth), cbSample);
+    }
+    for(; x + 8 <= last; x += 8)
+    {
+        __m128i v;
+        if(cbSample == 1)
+            v = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + left + x)), zero), 6);
+        else
+            v = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(pRow + (left + x) * 2)), 2);
+        _mm_storeu_si128((__m128i*)(pDest + x), v);
+    }
+    for(; x < width + kBayerPad; x++)
+    {
+        pDest[x] = LoadBayerSample(pRow, MirrorIndex(left + x, frameWidth), cbSample);
+    }
+}
+
+//-------------------------------------------------------------------
+// BayerRowCache
+//
+// Ring of expanded rows, indexed by frame row (which may lie outside
+// the frame by up to kBayerPad rows).
+//-------------------------------------------------------------------
+
+struct BayerRowCache
+{
+    const BYTE* pSrc;
+    LONG        lSrcStride;
+    LONG        frameWidth;
+    LONG        frameHeight;
+    LONG        left;
+    LONG        width;
+    DWORD       cbSample;
+    BYTE*       pScratch;
+    DWORD       cbScratchRow;
+    LONG        rows[kBayerCacheRows];
+
+    const WORD* GetRow(LONG y)
+    {
+        LONG slot = (y + kBayerCacheRows) % kBayerCacheRows;
+        WORD *pRow = (WORD*)(pScratch + slot * cbScratchRow) + kBayerPad;
+
+        if(rows[slot] != y)
+        {
+            ExpandBayerRow(pRow, pSrc + MirrorIndex(y, frameHeight) * lSrcStride, left, width, frameWidth, cbSample);
+            rows[slot] = y;
+        }
+        return pRow;
+    }
+};
+
+static __forceinline __m128i Load8(const WORD* p)
+{
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+static __forceinline __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static __forceinline __m128i Clamp14(__m128i v)
+{
+    return _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), _mm_set1_epi16(16383));
+}
+
+static __forceinline __m128i Abs16(__m128i v)
+{
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+//-------------------------------------------------------------------
+// StoreRgb14
+//
+// Stores eight pixels of 14-bit R, G and B as 8-bit BGRA or 16-bit
+// RGBA. Only count pixels are written.
+//-------------------------------------------------------------------
+
+static __forceinline void StoreRgb14(__m128i r, __m128i g, __m128i b, BYTE* pDest, bool wide, DWORD count)
+{
+    BYTE block[64];
+    BYTE *pOut = count >= 8 ? pDest : block;
+
+    if(wide)
+    {
+        StoreWide14(r, g, b, pOut);
+    }
+    else
+    {
+        const __m128i round = _mm_set1_epi16(1 << 5);
+        const __m128i zero = _mm_setzero_si128();
+
+        r = _mm_srai_epi16(_mm_add_epi16(r, round), 6);
+        g = _mm_srai_epi16(_mm_add_epi16(g, round), 6);
+        b = _mm_srai_epi16(_mm_add_epi16(b, round), 6);
+
+        __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+        __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), zero);
+        _mm_storeu_si128((__m128i*)pOut, _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i*)(pOut + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+
+    if(pOut == block)
+    {
+        memcpy(pDest, block, count * (wide ? 8 : 4));
+    }
+}
+
+//-------------------------------------------------------------------
+// DemosaicRow
+//
+// Interpolates one row from the expanded rows y - 2 .. y + 2 in
+// ppRows. siteParity is the column parity of the red or blue samples
+// of the row, redRow tells which of the two it holds.
+//
+// Bilinear averages the nearest samples of each color. Edge-aware
+// takes green at red and blue sites along the direction with the
+// smaller gradient, corrected by the second derivative of the site's
+// own color (Hamilton-Adams), and red and blue with the gradient
+// corrected 5x5 filters of Malvar, He and Cutler. The filter sums are
+// rearranged into averages plus scaled differences so they stay in
+// 16-bit lanes.
+//-------------------------------------------------------------------
+
+static void DemosaicRow(BYTE* pDest, const WORD* const* ppRows, DWORD width, LONG siteParity, bool redRow, DemosaicMode mode, bool wide)
+{
+    const __m128i evenLanes = _mm_setr_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+    const __m128i site = siteParity ? _mm_xor_si128(evenLanes, _mm_set1_epi16(-1)) : evenLanes;
+    const DWORD cbPixel = wide ? 8 : 4;
+    const WORD *pN2 = ppRows[0];
+    const WORD *pN = ppRows[1];
+    const WORD *pC = ppRows[2];
+    const WORD *pS = ppRows[3];
+    const WORD *pS2 = ppRows[4];
+
+    for(DWORD x = 0; x < width; x += 8)
+    {
+        __m128i c = Load8(pC + x);
+        __m128i w = Load8(pC + x - 1);
+        __m128i e = Load8(pC + x + 1);
+        __m128i n = Load8(pN + x);
+        __m128i s = Load8(pS + x);
+        __m128i h = _mm_avg_epu16(w, e);
+        __m128i v = _mm_avg_epu16(n, s);
+        __m128i diag = _mm_avg_epu16(
+            _mm_avg_epu16(Load8(pN + x - 1), Load8(pN + x + 1)),
+            _mm_avg_epu16(Load8(pS + x - 1), Load8(pS + x + 1)));
+
+        // own: the color of the row's red or blue sites, found left and
+        // right of its green sites. other: the color above and below.
+        __m128i greenAtSite, otherAtSite, ownAtGreen, otherAtGreen;
+
+        if(mode == Demosaic_EdgeAware)
+        {
+            __m128i h2 = _mm_avg_epu16(Load8(pC + x - 2), Load8(pC + x + 2));
+            __m128i v2 = _mm_avg_epu16(Load8(pN2 + x), Load8(pS2 + x));
+            __m128i dh2 = _mm_sub_epi16(c, h2);
+            __m128i dv2 = _mm_sub_epi16(c, v2);
+            __m128i dd = _mm_sub_epi16(c, diag);
+
+            __m128i gH = Clamp14(_mm_add_epi16(h, _mm_srai_epi16(dh2, 1)));
+            __m128i gV = Clamp14(_mm_add_epi16(v, _mm_srai_epi16(dv2, 1)));
+            __m128i gradH = _mm_add_epi16(_mm_srli_epi16(Abs16(_mm_sub_epi16(w, e)), 1), Abs16(dh2));
+            __m128i gradV = _mm_add_epi16(_mm_srli_epi16(Abs16(_mm_sub_epi16(n, s)), 1), Abs16(dv2));
+            greenAtSite = Select(_mm_cmplt_epi16(gradH, gradV), gH,
+                Select(_mm_cmplt_epi16(gradV, gradH), gV, _mm_avg_epu16(gH, gV)));
+
+            // diag + 3/4 (c - average of the same color two samples away)
+            __m128i d4 = _mm_sub_epi16(c, _mm_avg_epu16(h2, v2));
+            otherAtSite = _mm_add_epi16(diag, _mm_add_epi16(_mm_srai_epi16(d4, 1), _mm_srai_epi16(d4, 2)));
+
+            // h + (c - diag) / 2 + (c - h2) / 4 - (c - v2) / 8, and transposed
+            __m128i common = _mm_srai_epi16(dd, 1);
+            ownAtGreen = _mm_add_epi16(h, _mm_add_epi16(common, _mm_sub_epi16(_mm_srai_epi16(dh2, 2), _mm_srai_epi16(dv2, 3))));
+            otherAtGreen = _mm_add_epi16(v, _mm_add_epi16(common, _mm_sub_epi16(_mm_srai_epi16(dv2, 2), _mm_srai_epi16(dh2, 3))));
+        }
+        else
+        {
+            greenAtSite = _mm_avg_epu16(h, v);
+            otherAtSite = diag;
+            ownAtGreen = h;
+            otherAtGreen = v;
+        }
+
+        __m128i g = Select(site, greenAtSite, c);
+        __m128i own = Clamp14(Select(site, c, ownAtGreen));
+        __m128i other = Clamp14(Select(site, otherAtSite, otherAtGreen));
+
+        StoreRgb14(redRow ? own : other, Clamp14(g), redRow ? other : own, pDest + x * cbPixel, wide, width - x);
+    }
+}
+
+//-------------------------------------------------------------------
+// SuperpixelRow
+//
+// One output pixel per 2x2 cell of the expanded rows pTop and pBottom:
+// the red and blue samples and the average of the two greens.
+//-------------------------------------------------------------------
+
+static __forceinline void SplitEvenOdd(const WORD* p, __m128i& even, __m128i& odd)
+{
+    // 14-bit samples, so the signed packs cannot saturate.
+    __m128i a = Load8(p);
+    __m128i b = Load8(p + 8);
+    even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+    odd = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
+
+static void SuperpixelRow(BYTE* pDest, const WORD* pTop, const WORD* pBottom, DWORD width, LONG redX, LONG redY, bool wide)
+{
+    const DWORD cbPixel = wide ? 8 : 4;
+
+    for(DWORD x = 0; x < width; x += 8)
+    {
+        __m128i cell[2][2];
+        SplitEvenOdd(pTop + x * 2, cell[0][0], cell[0][1]);
+        SplitEvenOdd(pBottom + x * 2, cell[1][0], cell[1][1]);
+
+        __m128i r = cell[redY][redX];
+        __m128i b = cell[1 - redY][1 - redX];
+        __m128i g = _mm_avg_epu16(cell[redY][1 - redX], cell[1 - redY][redX]);
+
+        StoreRgb14(r, g, b, pDest + x * cbPixel, wide, width - x);
+    }
+}
+
+//-------------------------------------------------------------------
+// TransformImage_Bayer
+//
+// Raw Bayer with cbSample bytes per sample to RGB-32 or 16-bit RGBA.
+//-------------------------------------------------------------------
+
+static void TransformImage_Bayer(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    const TransformParams& params,
+    DWORD       cbSample
+    )
+{
+    const RECT &rc = params.rcSource;
+    const LONG shift = GetOutputShift(params);
+    const DWORD dwWidth = (rc.right - rc.left) >> shift;
+    const LONG redX = (params.bayer == Bayer_GRBG || params.bayer == Bayer_BGGR) ? 1 : 0;
+    const LONG redY = (params.bayer == Bayer_GBRG || params.bayer == Bayer_BGGR) ? 1 : 0;
+
+    BayerRowCache cache;
+    cache.pSrc = pSrc;
+    cache.lSrcStride = lSrcStride;
+    cache.frameWidth = dwWidthInPixels;
+    cache.frameHeight = dwHeightInPixels;
+    cache.left = rc.left;
+    cache.width = rc.right - rc.left;
+    cache.cbSample = cbSample;
+    cache.pScratch = params.pScratch;
+    cache.cbScratchRow = params.cbScratchRow;
+    for(LONG i = 0; i < kBayerCacheRows; i++)
+    {
+        cache.rows[i] = INT_MIN;
+    }
+
+    for(LONG y = rc.top; y < rc.bottom; y += 1 << shift)
+    {
+        BYTE *pRow = GetRowBuffer(pDest, params, 0);
+
+        if(shift)
+        {
+            const WORD *pTop = cache.GetRow(y);
+            const WORD *pBottom = cache.GetRow(y + 1);
+            SuperpixelRow(pRow, pTop, pBottom, dwWidth, redX, redY, params.wideOutput);
+        }
+        else
+        {
+            const WORD *pRows[5];
+            for(LONG i = 0; i < 5; i++)
+            {
+                pRows[i] = cache.GetRow(y - 2 + i);
+            }
+
+            bool redRow = (y & 1) == redY;
+            DemosaicRow(pRow, pRows, dwWidth, redRow ? redX : 1 - redX, redRow, params.demosaic, params.wideOutput);
+        }
+
+        if(!params.wideOutput && params.correctRgb)
+        {
+            ApplyOutputLut(pRow, dwWidth, params.pOutputLut);
+        }
+        EmitRow(pDest, pRow, dwWidth, params);
+
+        pDest += lDestStride;
+    }
+}
+
+void TransformImage_Bayer8(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
+    )
+{
+    TransformImage_Bayer(pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels, dwHeightInPixels, params, 1);
+}
+
+void TransformImage_Bayer16(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    const TransformParams& params
+    )
+{
+    TransformImage_Bayer(pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels, dwHeightInPixels, params, 2);
+}
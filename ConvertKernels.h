@@ -0,0 +1,228 @@
+#pragma once
+
+//-------------------------------------------------------------------
+//  Conversion kernels
+//
+//  The row kernels of CColorConverter that only work on memory: the
+//  deinterlacing source rows, horizontal resampling, the high bit
+//  depth formats and raw Bayer demosaicing. CColorConverter picks a
+//  kernel for the subtype of the media type and fills in
+//  TransformParams; the kernels do not depend on Media Foundation.
+//
+//  This header and ConvertKernels.cpp only use the C library and
+//  SSE2, so the kernels can be built and tested on POSIX systems.
+//
+//-------------------------------------------------------------------
+
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+typedef uint8_t     BYTE;
+typedef uint16_t    WORD;
+typedef uint32_t    DWORD;
+typedef int32_t     LONG;
+typedef int16_t     SHORT;
+
+struct RECT
+{
+    LONG    left;
+    LONG    top;
+    LONG    right;
+    LONG    bottom;
+};
+
+#ifndef __forceinline
+#define __forceinline inline __attribute__((always_inline))
+#endif
+#endif
+
+enum DeinterlaceMode
+{
+    Deinterlace_Auto,           // Chosen from the interlace mode of the media type.
+    Deinterlace_Weave,          // Leave both fields interleaved as captured.
+    Deinterlace_Bob,            // Keep the dominant field, interpolate the other.
+    Deinterlace_Blend           // Vertical [1 2 1] blend of both fields.
+};
+
+enum DemosaicMode
+{
+    Demosaic_Bilinear,          // Average of the nearest samples of each color.
+    Demosaic_EdgeAware,         // Green along the smoother direction, gradient-corrected red and blue.
+    Demosaic_Superpixel         // One pixel per 2x2 cell, half width and height.
+};
+
+// Color of the top-left sample of each 2x2 cell and its row.
+enum BayerPattern
+{
+    Bayer_None,
+    Bayer_RGGB,
+    Bayer_GRBG,
+    Bayer_GBRG,
+    Bayer_BGGR
+};
+
+// The 8-bit kernels map their unclipped results through per-channel
+// output tables, which hold the clipping and the color correction.
+const int kOutputLutBias = 288;
+const int kOutputLutSize = 832;
+
+// Scratch memory of the kernels, see TransformParams.
+const DWORD kNumScratchRows = 5;
+const DWORD kNumRowBuffers = 2;
+
+struct ResampleTap
+{
+    LONG            srcX;           // Second of the four source pixels.
+    LONG            phase;          // Row of the polyphase weight table.
+};
+
+struct TransformParams
+{
+    RECT            rcSource;       // Region of the frame to convert, chroma aligned.
+    DeinterlaceMode deinterlace;    // Never Deinterlace_Auto.
+    LONG            dominantField;  // 0: even rows, 1: odd rows. Used by Deinterlace_Bob.
+    BYTE*           pScratch;       // kNumScratchRows rows of cbScratchRow bytes.
+    BYTE*           pRowBuffer;     // kNumRowBuffers RGB-32 rows of cbScratchRow bytes.
+    DWORD           cbScratchRow;
+    DWORD           dwOutWidth;     // Output width after pixel aspect correction.
+    const ResampleTap* pTaps;       // dwOutWidth taps, NULL if not resampling.
+    const SHORT*    pWeights;       // Polyphase weights, 16 per phase, 16-byte aligned.
+    bool            wideOutput;     // 16-bit RGBA output instead of 8-bit BGRA.
+    const BYTE*     pOutputLut;     // B, G and R tables of kOutputLutSize entries.
+    bool            correctRgb;     // RGB sources go through pOutputLut as well.
+    BayerPattern    bayer;          // Bayer_None unless the source is raw Bayer.
+    DemosaicMode    demosaic;
+};
+
+__forceinline BYTE Clip(int clr)
+{
+    return (BYTE)(clr < 0 ? 0 : (clr > 255 ? 255 : clr));
+}
+
+const BYTE* GetSourceRow(
+    const BYTE*             pRow0,
+    LONG                    lStride,
+    LONG                    y,
+    LONG                    rows,
+    DWORD                   cbRow,
+    const TransformParams&  params,
+    BYTE*                   pScratch,
+    DWORD                   cbSample = 1
+    );
+
+//-------------------------------------------------------------------
+// Polyphase horizontal resampling
+//
+// Four-tap Catmull-Rom filter with kResamplePhases sub-pixel phases
+// and 14-bit weights. The weights of each phase are stored as
+// { w0, w1 } x 4 followed by { w2, w3 } x 4 to match the channel
+// interleaving used by ResampleRow.
+//-------------------------------------------------------------------
+
+const LONG kResamplePhases = 64;
+const LONG kResampleShift = 14;
+const LONG kRowPadLeft = 1;     // Pixels of edge padding around
+const LONG kRowPadRight = 2;    // a row before resampling.
+
+void ResampleRow(BYTE* pDest, const BYTE* pSrc, const TransformParams& params);
+void ApplyOutputLut(BYTE* pRow, DWORD dwWidthInPixels, const BYTE* pLut);
+
+//-------------------------------------------------------------------
+// GetRowBuffer / EmitRow
+//
+// The kernels write each converted RGB-32 row to the buffer returned by
+// GetRowBuffer, then call EmitRow. Without post-processing the buffer
+// is the destination row itself and EmitRow does nothing. Otherwise the
+// row is staged in a padded row buffer, which is still in cache when
+// EmitRow resamples it into the destination. slot selects one of
+// kNumRowBuffers buffers for kernels that produce rows in pairs.
+//-------------------------------------------------------------------
+
+static __forceinline BYTE* GetRowBuffer(BYTE* pDest, const TransformParams& params, DWORD slot)
+{
+    if(!params.pTaps)
+    {
+        return pDest;
+    }
+    return params.pRowBuffer + slot * params.cbScratchRow + kRowPadLeft * 4;
+}
+
+static __forceinline void EmitRow(BYTE* pDest, BYTE* pRow, DWORD dwWidthInPixels, const TransformParams& params)
+{
+    if(!params.pTaps)
+    {
+        return;
+    }
+
+    // Replicate the edge pixels so the filter taps never leave the row.
+    DWORD *pPel = (DWORD*)pRow;
+    pPel[-1] = pPel[0];
+    pPel[dwWidthInPixels] = pPel[dwWidthInPixels + 1] = pPel[dwWidthInPixels - 1];
+
+    ResampleRow(pDest, pRow, params);
+}
+
+//-------------------------------------------------------------------
+// GetOutputShift
+//
+// Source pixels per output pixel in each direction, as a shift: 1 for
+// superpixel demosaicing, otherwise 0.
+//-------------------------------------------------------------------
+
+__forceinline LONG GetOutputShift(const TransformParams& params)
+{
+    return (params.bayer != Bayer_None && params.demosaic == Demosaic_Superpixel) ? 1 : 0;
+}
+
+//-------------------------------------------------------------------
+// Kernels with the IMAGE_TRANSFORM_FN signature
+//
+// TransformImage_P010: P010 and P016 to RGB-32 or 16-bit RGBA.
+// TransformImage_Y210: Y210 to RGB-32 or 16-bit RGBA.
+// TransformImage_Bayer8 / 16: raw Bayer with 8-bit or MSB-aligned
+// 16-bit samples to RGB-32 or 16-bit RGBA.
+//-------------------------------------------------------------------
+
+void TransformImage_P010(
+    BYTE*                   pDest,
+    LONG                    lDestStride,
+    const BYTE*             pSrc,
+    LONG                    lSrcStride,
+    DWORD                   dwWidthInPixels,
+    DWORD                   dwHeightInPixels,
+    const TransformParams&  params
+    );
+
+void TransformImage_Y210(
+    BYTE*                   pDest,
+    LONG                    lDestStride,
+    const BYTE*             pSrc,
+    LONG                    lSrcStride,
+    DWORD                   dwWidthInPixels,
+    DWORD                   dwHeightInPixels,
+    const TransformParams&  params
+    );
+
+void TransformImage_Bayer8(
+    BYTE*                   pDest,
+    LONG                    lDestStride,
+    const BYTE*             pSrc,
+    LONG                    lSrcStride,
+    DWORD                   dwWidthInPixels,
+    DWORD                   dwHeightInPixels,
+    const TransformParams&  params
+    );
+
+void TransformImage_Bayer16(
+    BYTE*                   pDest,
+    LONG                    lDestStride,
+    const BYTE*             pSrc,
+    LONG                    lSrcStride,
+    DWORD                   dwWidthInPixels,
+    DWORD                   dwHeightInPixels,
+    const TransformParams&  params
+    );
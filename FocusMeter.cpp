@@ -0,0 +1,129 @@
+#include "FocusMeter.h"
+
+#include <emmintrin.h>
+#include <malloc.h>
+
+CFocusMeter::CFocusMeter()
+{
+    m_step = 0;
+    m_cols = m_rows = 0;
+    m_pSample = NULL;
+}
+
+CFocusMeter::~CFocusMeter()
+{
+    Release();
+}
+
+void CFocusMeter::Release()
+{
+    _aligned_free(m_pSample);
+    m_pSample = NULL;
+}
+
+//-------------------------------------------------------------------
+// Initialize
+//
+// Allocates the luma buffer for a frame of the given size sampled
+// every step pixels. The padding lets Measure load 8 bytes past the
+// last column.
+//-------------------------------------------------------------------
+
+HRESULT CFocusMeter::Initialize(UINT frameWidth, UINT frameHeight, UINT step)
+{
+    Release();
+
+    if(step == 0 || frameWidth < 3 * step || frameHeight < 3 * step)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_step = step;
+    m_cols = frameWidth / step;
+    m_rows = frameHeight / step;
+
+    m_pSample = (BYTE*)_aligned_malloc(m_cols * m_rows + 16, 16);
+    if(!m_pSample)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    ZeroMemory(m_pSample, m_cols * m_rows + 16);
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Measure
+//
+// Returns the variance of 4c - n - s - e - w over the inner cells of
+// the sample buffer. Eight cells per step: the Laplacian fits in 16
+// bits, _mm_madd_epi16 sums it and its square into 32-bit lanes, and
+// the lanes are added up in 64 bits once per row.
+//-------------------------------------------------------------------
+
+double CFocusMeter::Measure() const
+{
+    if(!m_pSample)
+    {
+        return 0.0;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sumSq64 = _mm_setzero_si128();
+    INT64 total = 0;
+    UINT64 totalSq = 0;
+
+    const UINT lastCol = m_cols - 1;
+    const UINT vectorEnd = 1 + ((lastCol - 1) & ~7);
+
+    for(UINT y = 1; y + 1 < m_rows; y++)
+    {
+        const BYTE *pRow = m_pSample + y * m_cols;
+        const BYTE *pUp = pRow - m_cols;
+        const BYTE *pDown = pRow + m_cols;
+        __m128i sum = _mm_setzero_si128();
+        __m128i sumSq = _mm_setzero_si128();
+        UINT x = 1;
+
+        for(; x < vectorEnd; x += 8)
+        {
+            __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x)), zero);
+            __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x - 1)), zero);
+            __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x + 1)), zero);
+            __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pUp + x)), zero);
+            __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pDown + x)), zero);
+
+            __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+                _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(lap, ones));
+            sumSq = _mm_add_epi32(sumSq, _mm_madd_epi16(lap, lap));
+        }
+
+        INT32 sumLanes[4];
+        _mm_storeu_si128((__m128i*)sumLanes, sum);
+        total += (INT64)sumLanes[0] + sumLanes[1] + sumLanes[2] + sumLanes[3];
+
+        // The squares are positive, so the lanes are widened unsigned.
+        sumSq64 = _mm_add_epi64(sumSq64, _mm_unpacklo_epi32(sumSq, zero));
+        sumSq64 = _mm_add_epi64(sumSq64, _mm_unpackhi_epi32(sumSq, zero));
+
+        for(; x < lastCol; x++)
+        {
+            int lap = 4 * pRow[x] - pRow[x - 1] - pRow[x + 1] - pUp[x] - pDown[x];
+            total += lap;
+            totalSq += lap * lap;
+        }
+    }
+
+    UINT64 sumSqLanes[2];
+    _mm_storeu_si128((__m128i*)sumSqLanes, sumSq64);
+    totalSq += sumSqLanes[0] + sumSqLanes[1];
+
+    double count = (double)(m_cols - 2) * (m_rows - 2);
+    double mean = total / count;
+    double meanSq = totalSq / count;
+
+    return meanSq - mean * mean;
+}
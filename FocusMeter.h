@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Windows.h>
+
+//-------------------------------------------------------------------
+//  CFocusMeter class
+//
+//  Scores the sharpness of a frame by the variance of the Laplacian
+//  of its subsampled native luma (see CColorConverter::SampleLuma).
+//  Blur from motion or focus removes the fine detail the Laplacian
+//  responds to, so of several frames of the same scene the sharpest
+//  one has the highest score. Scores are only comparable between
+//  frames of the same size and step.
+//
+//-------------------------------------------------------------------
+
+class CFocusMeter
+{
+public:
+    CFocusMeter();
+    ~CFocusMeter();
+
+    HRESULT Initialize(UINT frameWidth, UINT frameHeight, UINT step);
+
+    UINT GetStep() const { return m_step; }
+    BYTE* GetSampleBuffer() { return m_pSample; }
+    double Measure() const;
+
+protected:
+    UINT        m_step;
+    UINT        m_cols;
+    UINT        m_rows;
+    BYTE        *m_pSample;     // m_cols * m_rows plus 16 bytes of padding.
+
+    void Release();
+};
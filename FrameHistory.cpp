@@ -0,0 +1,292 @@
+#include "FrameHistory.h"
+
+template <class T> static void SafeRelease(T **ppT)
+{
+    if(*ppT)
+    {
+        (*ppT)->Release();
+        *ppT = NULL;
+    }
+}
+
+CFrameHistory::CFrameHistory()
+{
+    m_pSlots = NULL;
+    m_slotCount = 0;
+    m_preFrames = 0;
+    m_postFrames = 0;
+    m_pSink = NULL;
+    m_hWriterThread = NULL;
+    m_stop = false;
+    m_triggerPending = false;
+    m_frameCount = 0;
+    m_eventActive = false;
+    m_nextToWrite = 1;
+    m_eventEnd = 0;
+    m_eventCount = 0;
+    m_written = 0;
+    m_lost = 0;
+    m_dropped = 0;
+
+    InitializeCriticalSection(&m_lock);
+    InitializeConditionVariable(&m_work);
+}
+
+CFrameHistory::~CFrameHistory()
+{
+    Shutdown();
+
+    for(UINT i = 0; i < m_slotCount; i++)
+    {
+        SafeRelease(&m_pSlots[i].pBuffer);
+    }
+    delete[] m_pSlots;
+
+    DeleteCriticalSection(&m_lock);
+}
+
+//-------------------------------------------------------------------
+// Initialize
+//
+// Sets up the ring and starts the writer thread. The slot buffers are
+// allocated with the first sample, once its size is known.
+//-------------------------------------------------------------------
+
+HRESULT CFrameHistory::Initialize(UINT preFrames, UINT postFrames, IHistorySink *pSink)
+{
+    if(m_pSlots || !pSink || preFrames + postFrames == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_slotCount = preFrames + postFrames;
+    m_pSlots = new Slot[m_slotCount];
+    ZeroMemory(m_pSlots, m_slotCount * sizeof(Slot));
+
+    m_preFrames = preFrames;
+    m_postFrames = postFrames;
+    m_pSink = pSink;
+
+    m_hWriterThread = CreateThread(NULL, 0, WriterThreadProc, this, 0, NULL);
+    if(!m_hWriterThread)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// AddSample
+//
+// Called by the capture loop for every sample: copies it into the
+// oldest slot and starts or extends the event if a trigger is
+// pending. A sample whose slot the sink is still reading is dropped.
+//-------------------------------------------------------------------
+
+HRESULT CFrameHistory::AddSample(IMFMediaBuffer *buf, LONGLONG timeStamp)
+{
+    BYTE *pSrc = NULL;
+    DWORD cbSrc = 0;
+    bool wake = false;
+
+    if(!m_pSlots)
+    {
+        return E_UNEXPECTED;
+    }
+
+    HRESULT hr = buf->Lock(&pSrc, NULL, &cbSrc);
+    if(FAILED(hr))
+    {
+        return hr;
+    }
+
+    EnterCriticalSection(&m_lock);
+
+    Slot &slot = m_pSlots[m_frameCount % m_slotCount];
+
+    if(slot.busy)
+    {
+        m_dropped++;
+    }
+    else
+    {
+        DWORD cbMax = 0;
+        if(slot.pBuffer)
+        {
+            slot.pBuffer->GetMaxLength(&cbMax);
+        }
+        if(cbMax < cbSrc)
+        {
+            SafeRelease(&slot.pBuffer);
+            hr = MFCreateMemoryBuffer(cbSrc, &slot.pBuffer);
+        }
+
+        BYTE *pDest = NULL;
+        if(SUCCEEDED(hr))
+        {
+            hr = slot.pBuffer->Lock(&pDest, NULL, NULL);
+        }
+        if(SUCCEEDED(hr))
+        {
+            CopyMemory(pDest, pSrc, cbSrc);
+            slot.pBuffer->Unlock();
+            slot.pBuffer->SetCurrentLength(cbSrc);
+
+            slot.frameNumber = ++m_frameCount;
+            slot.timeStamp = timeStamp;
+
+            if(m_triggerPending)
+            {
+                m_triggerPending = false;
+
+                if(!m_eventActive)
+                {
+                    // Start with the oldest frame still in the ring that
+                    // is part of the pre-trigger window and has not been
+                    // written by the previous event.
+                    UINT64 first = m_frameCount > m_preFrames ? m_frameCount - m_preFrames + 1 : 1;
+                    if(first > m_nextToWrite)
+                        m_nextToWrite = first;
+
+                    m_eventActive = true;
+                    m_eventCount++;
+                }
+                m_eventEnd = m_frameCount + m_postFrames;
+            }
+            wake = m_eventActive;
+        }
+        else
+        {
+            slot.frameNumber = 0;
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+    buf->Unlock();
+
+    if(wake)
+    {
+        WakeConditionVariable(&m_work);
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// Trigger
+//
+// Starts an event with the next sample, or extends the current one.
+// May be called from any thread.
+//-------------------------------------------------------------------
+
+void CFrameHistory::Trigger()
+{
+    EnterCriticalSection(&m_lock);
+    m_triggerPending = true;
+    LeaveCriticalSection(&m_lock);
+}
+
+bool CFrameHistory::IsEventActive()
+{
+    EnterCriticalSection(&m_lock);
+    bool active = m_eventActive || m_triggerPending;
+    LeaveCriticalSection(&m_lock);
+    return active;
+}
+
+//-------------------------------------------------------------------
+// Shutdown
+//
+// Stops the writer thread after it has written the frames of the
+// current event that were captured so far.
+//-------------------------------------------------------------------
+
+void CFrameHistory::Shutdown()
+{
+    if(m_hWriterThread)
+    {
+        EnterCriticalSection(&m_lock);
+        m_stop = true;
+        LeaveCriticalSection(&m_lock);
+        WakeConditionVariable(&m_work);
+
+        WaitForSingleObject(m_hWriterThread, INFINITE);
+        CloseHandle(m_hWriterThread);
+        m_hWriterThread = NULL;
+    }
+}
+
+//-------------------------------------------------------------------
+// Writer thread
+//-------------------------------------------------------------------
+
+DWORD WINAPI CFrameHistory::WriterThreadProc(LPVOID pParam)
+{
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    ((CFrameHistory*)pParam)->WriterLoop();
+    CoUninitialize();
+    return 0;
+}
+
+// Finds the next frame of the event that is still in the ring and
+// marks its slot busy. Called with m_lock held.
+bool CFrameHistory::GetNextFrame(Slot **ppSlot)
+{
+    while(m_eventActive)
+    {
+        if(m_nextToWrite > m_eventEnd)
+        {
+            m_eventActive = false;
+            break;
+        }
+        if(m_nextToWrite > m_frameCount)
+        {
+            break;
+        }
+
+        // Frame n is stored in slot (n - 1) % m_slotCount.
+        Slot &slot = m_pSlots[(m_nextToWrite - 1) % m_slotCount];
+        UINT64 frame = m_nextToWrite++;
+
+        if(slot.frameNumber == frame)
+        {
+            slot.busy = true;
+            *ppSlot = &slot;
+            return true;
+        }
+        m_lost++;
+    }
+    return false;
+}
+
+void CFrameHistory::WriterLoop()
+{
+    EnterCriticalSection(&m_lock);
+
+    for(;;)
+    {
+        Slot *pSlot = NULL;
+
+        if(GetNextFrame(&pSlot))
+        {
+            LeaveCriticalSection(&m_lock);
+            HRESULT hr = m_pSink->WriteHistoryFrame(pSlot->pBuffer, pSlot->timeStamp, pSlot->frameNumber);
+            EnterCriticalSection(&m_lock);
+
+            pSlot->busy = false;
+            if(SUCCEEDED(hr))
+                m_written++;
+            else
+                m_lost++;
+        }
+        else if(m_stop)
+        {
+            break;
+        }
+        else
+        {
+            SleepConditionVariableCS(&m_work, &m_lock, INFINITE);
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
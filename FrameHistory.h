@@ -0,0 +1,86 @@
+#pragma once
+
+#include <Windows.h>
+#include <mfapi.h>
+#include <mfidl.h>
+
+//-------------------------------------------------------------------
+//  IHistorySink
+//
+//  Receives the frames of a trigger event from the writer thread of
+//  CFrameHistory, in capture order and in the native format. The
+//  buffer is only valid during the call.
+//-------------------------------------------------------------------
+
+struct IHistorySink
+{
+    virtual HRESULT WriteHistoryFrame(IMFMediaBuffer *buf, LONGLONG timeStamp, UINT64 frameNumber) = 0;
+};
+
+//-------------------------------------------------------------------
+//  CFrameHistory class
+//
+//  Pre-trigger recording: keeps the last preFrames native samples in
+//  a fixed ring of preFrames + postFrames memory buffers. Each sample
+//  is copied into its slot once on arrival and nothing is converted
+//  until Trigger is called. The event then covers the preFrames
+//  before the trigger and the postFrames after it, and a writer
+//  thread hands them to the sink while capture goes on. The ring is
+//  large enough to hold a whole event, so frames are only lost if the
+//  sink falls behind by more than that; a trigger during an event
+//  extends it.
+//
+//-------------------------------------------------------------------
+
+class CFrameHistory
+{
+public:
+    CFrameHistory();
+    ~CFrameHistory();
+
+    HRESULT Initialize(UINT preFrames, UINT postFrames, IHistorySink *pSink);
+    HRESULT AddSample(IMFMediaBuffer *buf, LONGLONG timeStamp);
+    void Trigger();
+    void Shutdown();
+
+    bool IsEventActive();
+    UINT GetEventCount() const { return m_eventCount; }
+    UINT64 GetWrittenCount() const { return m_written; }
+    UINT64 GetLostCount() const { return m_lost; }
+    UINT64 GetDroppedCount() const { return m_dropped; }
+
+protected:
+    struct Slot
+    {
+        IMFMediaBuffer  *pBuffer;
+        LONGLONG        timeStamp;
+        UINT64          frameNumber;    // 0 while empty.
+        bool            busy;           // Being written by the sink.
+    };
+
+    Slot                    *m_pSlots;
+    UINT                    m_slotCount;
+    UINT                    m_preFrames;
+    UINT                    m_postFrames;
+    IHistorySink            *m_pSink;
+
+    CRITICAL_SECTION        m_lock;
+    CONDITION_VARIABLE      m_work;
+    HANDLE                  m_hWriterThread;
+    bool                    m_stop;
+    bool                    m_triggerPending;
+
+    // All guarded by m_lock.
+    UINT64                  m_frameCount;       // Frames stored so far.
+    bool                    m_eventActive;
+    UINT64                  m_nextToWrite;
+    UINT64                  m_eventEnd;         // Last frame of the event.
+    UINT                    m_eventCount;
+    UINT64                  m_written;
+    UINT64                  m_lost;             // Overwritten before they were written.
+    UINT64                  m_dropped;          // Arrived while their slot was being written.
+
+    static DWORD WINAPI WriterThreadProc(LPVOID pParam);
+    void WriterLoop();
+    bool GetNextFrame(Slot **ppSlot);
+};
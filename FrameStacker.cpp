@@ -0,0 +1,340 @@
+#include "FrameStacker.h"
+
+#include <emmintrin.h>
+
+template <class T> static void SafeRelease(T **ppT)
+{
+    if(*ppT)
+    {
+        (*ppT)->Release();
+        *ppT = NULL;
+    }
+}
+
+CFrameStacker::CFrameStacker()
+{
+    m_pAccumulator = NULL;
+    m_cbFrame = 0;
+    m_bytesPerSample = 1;
+    m_threshold = 0;
+    m_count = 0;
+}
+
+CFrameStacker::~CFrameStacker()
+{
+    SafeRelease(&m_pAccumulator);
+}
+
+//-------------------------------------------------------------------
+// GetMaxCount
+//
+// Frames the accumulator can sum without overflowing: 257 x 255 fits
+// in 16 bits, and 32768 x 65535 in the signed 32 bits the float
+// conversions of Add16 and Average16 read.
+//-------------------------------------------------------------------
+
+UINT CFrameStacker::GetMaxCount() const
+{
+    return m_bytesPerSample == 2 ? 32768 : 257;
+}
+
+//-------------------------------------------------------------------
+// Begin
+//
+// Starts a new stack of frames of cbFrame bytes. bytesPerSample is 2
+// for the 16-bit formats (P010, P016, Y210, 16-bit Bayer) and 1 for
+// all others. Either way the accumulator is twice the frame size.
+//-------------------------------------------------------------------
+
+HRESULT CFrameStacker::Begin(DWORD cbFrame, UINT bytesPerSample, UINT outlierThreshold)
+{
+    SafeRelease(&m_pAccumulator);
+    m_count = 0;
+
+    if(cbFrame == 0 || (bytesPerSample != 1 && bytesPerSample != 2))
+    {
+        return E_INVALIDARG;
+    }
+
+    m_cbFrame = cbFrame;
+    m_bytesPerSample = bytesPerSample;
+    m_threshold = outlierThreshold;
+
+    HRESULT hr = MFCreateMemoryBuffer(cbFrame * 2, &m_pAccumulator);
+
+    BYTE *pAcc = NULL;
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pAccumulator->Lock(&pAcc, NULL, NULL);
+    }
+    if(SUCCEEDED(hr))
+    {
+        ZeroMemory(pAcc, cbFrame * 2);
+        m_pAccumulator->Unlock();
+    }
+    else
+    {
+        SafeRelease(&m_pAccumulator);
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// Add
+//
+// Adds one native sample of the size given to Begin. Returns S_FALSE
+// without adding it once GetMaxCount frames are in the stack.
+//-------------------------------------------------------------------
+
+HRESULT CFrameStacker::Add(IMFMediaBuffer *buf)
+{
+    BYTE *pSrc = NULL;
+    BYTE *pAcc = NULL;
+    DWORD cbSrc = 0;
+
+    if(!m_pAccumulator)
+    {
+        return E_UNEXPECTED;
+    }
+    if(m_count >= GetMaxCount())
+    {
+        return S_FALSE;
+    }
+
+    HRESULT hr = buf->Lock(&pSrc, NULL, &cbSrc);
+    if(FAILED(hr))
+    {
+        return hr;
+    }
+
+    if(cbSrc < m_cbFrame)
+    {
+        hr = E_INVALIDARG;
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pAccumulator->Lock(&pAcc, NULL, NULL);
+    }
+    if(SUCCEEDED(hr))
+    {
+        if(m_bytesPerSample == 2)
+            Add16((DWORD*)pAcc, (const WORD*)pSrc, m_cbFrame / 2, m_count, m_threshold);
+        else
+            Add8((WORD*)pAcc, pSrc, m_cbFrame, m_count, m_threshold);
+
+        m_pAccumulator->Unlock();
+        m_count++;
+    }
+
+    buf->Unlock();
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// End
+//
+// Turns the accumulator into the averaged native sample and passes
+// it to the caller, who releases it. Begin starts the next stack.
+//-------------------------------------------------------------------
+
+HRESULT CFrameStacker::End(IMFMediaBuffer **ppResult)
+{
+    BYTE *pAcc = NULL;
+
+    *ppResult = NULL;
+    if(!m_pAccumulator || m_count == 0)
+    {
+        return E_UNEXPECTED;
+    }
+
+    HRESULT hr = m_pAccumulator->Lock(&pAcc, NULL, NULL);
+    if(SUCCEEDED(hr))
+    {
+        if(m_bytesPerSample == 2)
+            Average16(pAcc, m_cbFrame / 2, m_count);
+        else
+            Average8(pAcc, m_cbFrame, m_count);
+
+        m_pAccumulator->Unlock();
+        m_pAccumulator->SetCurrentLength(m_cbFrame);
+
+        *ppResult = m_pAccumulator;
+        m_pAccumulator = NULL;
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// Add8
+//
+// pAcc[i] += pSrc[i], 16 values per step. frames is the number of
+// frames already in pAcc. For the outlier clamp the mean is taken
+// with _mm_mulhi_epu16 and a rounded up reciprocal, which is exact
+// or one level high.
+//-------------------------------------------------------------------
+
+void CFrameStacker::Add8(WORD *pAcc, const BYTE *pSrc, DWORD count, UINT frames, UINT threshold)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const bool clamp = threshold && frames > 0;
+    const UINT reciprocal = frames > 1 ? (65536 + frames - 1) / frames : 0;
+    const __m128i recip = _mm_set1_epi16((short)reciprocal);
+    const __m128i range = _mm_set1_epi8((char)min(threshold, 255u));
+    DWORD i = 0;
+
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m128i acc0 = _mm_loadu_si128((const __m128i*)(pAcc + i));
+        __m128i acc1 = _mm_loadu_si128((const __m128i*)(pAcc + i + 8));
+
+        if(clamp)
+        {
+            __m128i mean0 = frames > 1 ? _mm_mulhi_epu16(acc0, recip) : acc0;
+            __m128i mean1 = frames > 1 ? _mm_mulhi_epu16(acc1, recip) : acc1;
+            __m128i mean = _mm_packus_epi16(mean0, mean1);
+
+            x = _mm_max_epu8(x, _mm_subs_epu8(mean, range));
+            x = _mm_min_epu8(x, _mm_adds_epu8(mean, range));
+        }
+
+        acc0 = _mm_add_epi16(acc0, _mm_unpacklo_epi8(x, zero));
+        acc1 = _mm_add_epi16(acc1, _mm_unpackhi_epi8(x, zero));
+        _mm_storeu_si128((__m128i*)(pAcc + i), acc0);
+        _mm_storeu_si128((__m128i*)(pAcc + i + 8), acc1);
+    }
+
+    for(; i < count; i++)
+    {
+        int x = pSrc[i];
+        if(clamp)
+        {
+            int mean = pAcc[i] / frames;
+            x = max(mean - (int)threshold, min(x, mean + (int)threshold));
+        }
+        pAcc[i] = (WORD)(pAcc[i] + x);
+    }
+}
+
+//-------------------------------------------------------------------
+// Add16
+//
+// pAcc[i] += pSrc[i] for 16-bit samples, 8 values per step. The
+// outlier clamp works in float, where the mean is a single multiply;
+// the threshold is scaled from 8-bit levels to the MSB-aligned
+// samples.
+//-------------------------------------------------------------------
+
+void CFrameStacker::Add16(DWORD *pAcc, const WORD *pSrc, DWORD count, UINT frames, UINT threshold)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const bool clamp = threshold && frames > 0;
+    const float inverse = frames ? 1.0f / frames : 0.0f;
+    const __m128 scale = _mm_set1_ps(inverse);
+    const __m128 range = _mm_set1_ps(threshold * 256.0f);
+    DWORD i = 0;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m128i x0 = _mm_unpacklo_epi16(x, zero);
+        __m128i x1 = _mm_unpackhi_epi16(x, zero);
+        __m128i acc0 = _mm_loadu_si128((const __m128i*)(pAcc + i));
+        __m128i acc1 = _mm_loadu_si128((const __m128i*)(pAcc + i + 4));
+
+        if(clamp)
+        {
+            __m128 mean0 = _mm_mul_ps(_mm_cvtepi32_ps(acc0), scale);
+            __m128 mean1 = _mm_mul_ps(_mm_cvtepi32_ps(acc1), scale);
+
+            __m128 f0 = _mm_max_ps(_mm_cvtepi32_ps(x0), _mm_sub_ps(mean0, range));
+            __m128 f1 = _mm_max_ps(_mm_cvtepi32_ps(x1), _mm_sub_ps(mean1, range));
+            x0 = _mm_cvtps_epi32(_mm_min_ps(f0, _mm_add_ps(mean0, range)));
+            x1 = _mm_cvtps_epi32(_mm_min_ps(f1, _mm_add_ps(mean1, range)));
+        }
+
+        _mm_storeu_si128((__m128i*)(pAcc + i), _mm_add_epi32(acc0, x0));
+        _mm_storeu_si128((__m128i*)(pAcc + i + 4), _mm_add_epi32(acc1, x1));
+    }
+
+    for(; i < count; i++)
+    {
+        float x = pSrc[i];
+        if(clamp)
+        {
+            float mean = pAcc[i] * inverse;
+            x = max(mean - threshold * 256.0f, min(x, mean + threshold * 256.0f));
+        }
+        pAcc[i] += (DWORD)(x + 0.5f);
+    }
+}
+
+//-------------------------------------------------------------------
+// Average8 / Average16
+//
+// Divide the accumulator by the frame count with rounding and store
+// the result over the front of the same buffer. Each step reads its
+// accumulator elements before writing, and the write position stays
+// behind the read position, so nothing is overwritten before it is
+// read.
+//-------------------------------------------------------------------
+
+void CFrameStacker::Average8(BYTE *pData, DWORD count, UINT frames)
+{
+    const WORD *pAcc = (const WORD*)pData;
+    const __m128i zero = _mm_setzero_si128();
+    const float inverse = 1.0f / frames;
+    const __m128 scale = _mm_set1_ps(inverse);
+    const __m128 half = _mm_set1_ps(0.5f);
+    DWORD i = 0;
+
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i acc0 = _mm_loadu_si128((const __m128i*)(pAcc + i));
+        __m128i acc1 = _mm_loadu_si128((const __m128i*)(pAcc + i + 8));
+
+        __m128i v0 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(acc0, zero)), scale), half));
+        __m128i v1 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(acc0, zero)), scale), half));
+        __m128i v2 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(acc1, zero)), scale), half));
+        __m128i v3 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(acc1, zero)), scale), half));
+
+        __m128i v = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+        _mm_storeu_si128((__m128i*)(pData + i), v);
+    }
+
+    for(; i < count; i++)
+    {
+        pData[i] = (BYTE)(pAcc[i] * inverse + 0.5f);
+    }
+}
+
+void CFrameStacker::Average16(BYTE *pData, DWORD count, UINT frames)
+{
+    const DWORD *pAcc = (const DWORD*)pData;
+    WORD *pDest = (WORD*)pData;
+    const float inverse = 1.0f / frames;
+    const __m128 scale = _mm_set1_ps(inverse);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    DWORD i = 0;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i acc0 = _mm_loadu_si128((const __m128i*)(pAcc + i));
+        __m128i acc1 = _mm_loadu_si128((const __m128i*)(pAcc + i + 4));
+
+        __m128i v0 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(acc0), scale), half));
+        __m128i v1 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(acc1), scale), half));
+
+        // No unsigned 32 to 16-bit pack in SSE2: pack with signed
+        // saturation around 0x8000 and flip the sign bit back.
+        __m128i v = _mm_packs_epi32(_mm_sub_epi32(v0, bias), _mm_sub_epi32(v1, bias));
+        _mm_storeu_si128((__m128i*)(pDest + i), _mm_xor_si128(v, flip));
+    }
+
+    for(; i < count; i++)
+    {
+        pDest[i] = (WORD)(pAcc[i] * inverse + 0.5f);
+    }
+}
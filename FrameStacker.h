@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Windows.h>
+#include <mfapi.h>
+#include <mfidl.h>
+
+//-------------------------------------------------------------------
+//  CFrameStacker class
+//
+//  Averages several native samples of a static scene to reduce
+//  sensor noise before the frame is converted. Every sample value of
+//  the frame is added to its own accumulator element, 16 bits wide
+//  for 8-bit formats and 32 bits for 16-bit formats, so the layout
+//  of the format (planes, packing, Bayer mosaic) does not matter and
+//  the result is again a native sample that converts like any other.
+//
+//  With an outlier threshold, each new value is first clamped to
+//  within threshold levels of the mean of the frames added so far,
+//  which keeps moving objects, flicker and hot pixels of a single
+//  frame from smearing into the result without keeping the frames.
+//
+//  The accumulator is the only frame sized buffer. End divides it in
+//  place, each element written over the front of the buffer, and
+//  hands it out as the result.
+//
+//-------------------------------------------------------------------
+
+class CFrameStacker
+{
+public:
+    CFrameStacker();
+    ~CFrameStacker();
+
+    HRESULT Begin(DWORD cbFrame, UINT bytesPerSample, UINT outlierThreshold);
+    HRESULT Add(IMFMediaBuffer *buf);
+    HRESULT End(IMFMediaBuffer **ppResult);
+
+    UINT GetCount() const { return m_count; }
+    UINT GetMaxCount() const;
+
+protected:
+    IMFMediaBuffer  *m_pAccumulator;
+    DWORD           m_cbFrame;
+    UINT            m_bytesPerSample;
+    UINT            m_threshold;        // In 8-bit levels.
+    UINT            m_count;
+
+    static void Add8(WORD *pAcc, const BYTE *pSrc, DWORD count, UINT frames, UINT threshold);
+    static void Add16(DWORD *pAcc, const WORD *pSrc, DWORD count, UINT frames, UINT threshold);
+    static void Average8(BYTE *pData, DWORD count, UINT frames);
+    static void Average16(BYTE *pData, DWORD count, UINT frames);
+};
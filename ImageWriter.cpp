@@ -0,0 +1,489 @@
+#include "ImageWriter.h"
+
+#pragma comment(lib, "windowscodecs.lib")
+
+template <class T> static void SafeRelease(T **ppT)
+{
+    if(*ppT)
+    {
+        (*ppT)->Release();
+        *ppT = NULL;
+    }
+}
+
+//-------------------------------------------------------------------
+// CWicStripWriter
+//-------------------------------------------------------------------
+
+CWicStripWriter::CWicStripWriter()
+{
+    m_pFactory = NULL;
+    m_pStream = NULL;
+    m_pEncoder = NULL;
+    m_pFrame = NULL;
+    m_width = 0;
+    m_toBgr24 = false;
+    m_pConverted = NULL;
+    m_convertedRows = 0;
+    m_fileName[0] = 0;
+}
+
+CWicStripWriter::~CWicStripWriter()
+{
+    if(m_pFrame)
+    {
+        Discard();
+    }
+    Close();
+}
+
+void CWicStripWriter::Close()
+{
+    SafeRelease(&m_pFrame);
+    SafeRelease(&m_pEncoder);
+    SafeRelease(&m_pStream);
+    SafeRelease(&m_pFactory);
+    delete[] m_pConverted;
+    m_pConverted = NULL;
+    m_convertedRows = 0;
+}
+
+//-------------------------------------------------------------------
+// Discard
+//
+// Closes the encoder without committing and deletes the incomplete
+// file, if the writer created one.
+//-------------------------------------------------------------------
+
+void CWicStripWriter::Discard()
+{
+    Close();
+    if(m_fileName[0])
+    {
+        DeleteFile(m_fileName);
+        m_fileName[0] = 0;
+    }
+}
+
+HRESULT CWicStripWriter::Open(LPCWSTR fileName, REFGUID containerFormat, REFGUID pixelFormat, UINT width, UINT height)
+{
+    IWICImagingFactory *pFactory = NULL;
+    IWICStream *pStream = NULL;
+
+    HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, (void**)&pFactory);
+
+    if(SUCCEEDED(hr))
+    {
+        hr = pFactory->CreateStream(&pStream);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = pStream->InitializeFromFilename(fileName, GENERIC_WRITE);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = Open(pStream, containerFormat, pixelFormat, width, height);
+
+        // The stream has created the file by now.
+        wcscpy_s(m_fileName, MAX_PATH, fileName);
+    }
+
+    SafeRelease(&pStream);
+    SafeRelease(&pFactory);
+
+    if(FAILED(hr))
+    {
+        Discard();
+    }
+    return hr;
+}
+
+HRESULT CWicStripWriter::Open(IStream *pStream, REFGUID containerFormat, REFGUID pixelFormat, UINT width, UINT height)
+{
+    if(m_pFrame)
+    {
+        Discard();
+    }
+    Close();
+    m_fileName[0] = 0;
+
+    WICPixelFormatGUID format = pixelFormat;
+    m_toBgr24 = false;
+
+    HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, (void**)&m_pFactory);
+
+    if(SUCCEEDED(hr))
+    {
+        m_pStream = pStream;
+        m_pStream->AddRef();
+
+        hr = m_pFactory->CreateEncoder(containerFormat, NULL, &m_pEncoder);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pEncoder->Initialize(m_pStream, WICBitmapEncoderNoCache);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pEncoder->CreateNewFrame(&m_pFrame, NULL);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pFrame->Initialize(NULL);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pFrame->SetSize(width, height);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pFrame->SetPixelFormat(&format);
+    }
+    if(SUCCEEDED(hr) && format != pixelFormat)
+    {
+        m_toBgr24 = format == GUID_WICPixelFormat24bppBGR &&
+            (pixelFormat == GUID_WICPixelFormat32bppBGR || pixelFormat == GUID_WICPixelFormat32bppBGRA);
+
+        // The encoder cannot store this layout without conversion.
+        if(!m_toBgr24)
+        {
+            hr = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+        }
+    }
+
+    if(FAILED(hr))
+    {
+        Close();
+    }
+    m_width = width;
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// WriteStrip
+//
+// Hands the next rowCount rows to the encoder. A negative stride
+// means the rows are stored bottom-up from pRows.
+//-------------------------------------------------------------------
+
+HRESULT CWicStripWriter::WriteStrip(const BYTE* pRows, LONG stride, UINT rowCount)
+{
+    if(!m_pFrame)
+    {
+        return E_UNEXPECTED;
+    }
+
+    HRESULT hr = S_OK;
+    UINT cbRow = (UINT)(stride < 0 ? -stride : stride);
+
+    if(m_toBgr24)
+    {
+        if(m_convertedRows < rowCount)
+        {
+            delete[] m_pConverted;
+            m_pConverted = new BYTE[m_width * 3 * rowCount];
+            m_convertedRows = rowCount;
+        }
+
+        for(UINT y = 0; y < rowCount; y++)
+        {
+            const BYTE *pSrc = pRows + (LONG)y * stride;
+            BYTE *pDest = m_pConverted + y * m_width * 3;
+
+            for(UINT x = 0; x < m_width; x++)
+            {
+                pDest[x * 3] = pSrc[x * 4];
+                pDest[x * 3 + 1] = pSrc[x * 4 + 1];
+                pDest[x * 3 + 2] = pSrc[x * 4 + 2];
+            }
+        }
+        hr = m_pFrame->WritePixels(rowCount, m_width * 3, m_width * 3 * rowCount, m_pConverted);
+    }
+    else if(stride > 0)
+    {
+        hr = m_pFrame->WritePixels(rowCount, cbRow, cbRow * rowCount, (BYTE*)pRows);
+    }
+    else
+    {
+        // WritePixels only takes top-down buffers, so feed the rows
+        // one by one.
+        for(UINT y = 0; y < rowCount && SUCCEEDED(hr); y++)
+        {
+            hr = m_pFrame->WritePixels(1, cbRow, cbRow, (BYTE*)(pRows + (LONG)y * stride));
+        }
+    }
+    return hr;
+}
+
+HRESULT CWicStripWriter::Commit()
+{
+    if(!m_pFrame)
+    {
+        return E_UNEXPECTED;
+    }
+
+    HRESULT hr = m_pFrame->Commit();
+    if(SUCCEEDED(hr))
+    {
+        hr = m_pEncoder->Commit();
+    }
+
+    if(FAILED(hr))
+    {
+        Discard();
+    }
+    Close();
+    m_fileName[0] = 0;
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// CBitmapStripWriter
+//-------------------------------------------------------------------
+
+CBitmapStripWriter::CBitmapStripWriter()
+{
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_width = 0;
+    m_height = 0;
+    m_nextRow = 0;
+    m_pStrip = NULL;
+    m_stripRows = 0;
+    m_fileName[0] = 0;
+}
+
+CBitmapStripWriter::~CBitmapStripWriter()
+{
+    Discard();
+    delete[] m_pStrip;
+}
+
+//-------------------------------------------------------------------
+// Discard
+//
+// Closes and deletes a file that was not committed.
+//-------------------------------------------------------------------
+
+void CBitmapStripWriter::Discard()
+{
+    if(m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        DeleteFile(m_fileName);
+    }
+}
+
+HRESULT CBitmapStripWriter::Open(LPCWSTR fileName, UINT width, UINT height)
+{
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER fileInfo;
+    DWORD written = 0;
+
+    Discard();
+
+    m_hFile = CreateFile(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    wcscpy_s(m_fileName, MAX_PATH, fileName);
+
+    ZeroMemory(&fileHeader, sizeof(fileHeader));
+    ZeroMemory(&fileInfo, sizeof(fileInfo));
+
+    fileHeader.bfType = 19778; // BM
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    fileHeader.bfSize = fileHeader.bfOffBits + width * height * 4;
+    fileInfo.biSize = sizeof(BITMAPINFOHEADER);
+    fileInfo.biWidth = width;
+    fileInfo.biHeight = height; // Bottom-up
+    fileInfo.biPlanes = 1;
+    fileInfo.biBitCount = 32;
+    fileInfo.biCompression = BI_RGB;
+    fileInfo.biSizeImage = width * height * 4;
+    fileInfo.biXPelsPerMeter = 2400;
+    fileInfo.biYPelsPerMeter = 2400;
+
+    // Allocate the whole file up front, the strips are written from
+    // its end backwards.
+    LARGE_INTEGER size;
+    size.QuadPart = fileHeader.bfSize;
+
+    HRESULT hr = S_OK;
+    if(!WriteFile(m_hFile, &fileHeader, sizeof(fileHeader), &written, NULL) ||
+        !WriteFile(m_hFile, &fileInfo, sizeof(fileInfo), &written, NULL) ||
+        !SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(m_hFile))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        Discard();
+        return hr;
+    }
+
+    m_width = width;
+    m_height = height;
+    m_nextRow = 0;
+    return S_OK;
+}
+
+HRESULT CBitmapStripWriter::WriteStrip(const BYTE* pRows, LONG stride, UINT rowCount)
+{
+    DWORD cbRow = m_width * 4;
+    DWORD written = 0;
+
+    if(m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return E_UNEXPECTED;
+    }
+    if(rowCount > m_height - m_nextRow)
+    {
+        return E_INVALIDARG;
+    }
+
+    if(m_stripRows < rowCount)
+    {
+        delete[] m_pStrip;
+        m_pStrip = new BYTE[cbRow * rowCount];
+        m_stripRows = rowCount;
+    }
+
+    // The last row of the strip is the first one in the file.
+    for(UINT y = 0; y < rowCount; y++)
+    {
+        CopyMemory(m_pStrip + (rowCount - 1 - y) * cbRow, pRows + (LONG)y * stride, cbRow);
+    }
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) +
+        (LONGLONG)(m_height - m_nextRow - rowCount) * cbRow;
+
+    if(!SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN) ||
+        !WriteFile(m_hFile, m_pStrip, cbRow * rowCount, &written, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if(written != cbRow * rowCount)
+    {
+        return HRESULT_FROM_WIN32(ERROR_HANDLE_DISK_FULL);
+    }
+
+    m_nextRow += rowCount;
+    return S_OK;
+}
+
+HRESULT CBitmapStripWriter::Commit()
+{
+    if(m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return E_UNEXPECTED;
+    }
+    if(m_nextRow != m_height)
+    {
+        Discard();
+        return E_UNEXPECTED;
+    }
+
+    HRESULT hr = S_OK;
+    if(!CloseHandle(m_hFile))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    m_hFile = INVALID_HANDLE_VALUE;
+
+    if(FAILED(hr))
+    {
+        DeleteFile(m_fileName);
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// Whole image helpers
+//-------------------------------------------------------------------
+
+HRESULT WriteImageFile(
+    LPCWSTR     fileName,
+    REFGUID     containerFormat,
+    REFGUID     pixelFormat,
+    UINT        width,
+    UINT        height,
+    const BYTE* pData,
+    LONG        stride
+    )
+{
+    CWicStripWriter writer;
+
+    HRESULT hr = writer.Open(fileName, containerFormat, pixelFormat, width, height);
+    if(SUCCEEDED(hr))
+    {
+        hr = writer.WriteStrip(pData, stride, height);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = writer.Commit();
+    }
+    return hr;
+}
+
+HRESULT EncodeImage(
+    REFGUID     containerFormat,
+    REFGUID     pixelFormat,
+    UINT        width,
+    UINT        height,
+    const BYTE* pData,
+    LONG        stride,
+    BYTE**      ppEncoded,
+    DWORD*      pcbEncoded
+    )
+{
+    CWicStripWriter writer;
+    IStream *pStream = NULL;
+    HGLOBAL hMemory = NULL;
+    STATSTG stat;
+
+    *ppEncoded = NULL;
+    *pcbEncoded = 0;
+
+    HRESULT hr = CreateStreamOnHGlobal(NULL, TRUE, &pStream);
+
+    if(SUCCEEDED(hr))
+    {
+        hr = writer.Open(pStream, containerFormat, pixelFormat, width, height);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = writer.WriteStrip(pData, stride, height);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = writer.Commit();
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = pStream->Stat(&stat, STATFLAG_NONAME);
+    }
+    if(SUCCEEDED(hr))
+    {
+        hr = GetHGlobalFromStream(pStream, &hMemory);
+    }
+    if(SUCCEEDED(hr))
+    {
+        const BYTE *pEncoded = (const BYTE*)GlobalLock(hMemory);
+        if(pEncoded)
+        {
+            *pcbEncoded = (DWORD)stat.cbSize.QuadPart;
+            *ppEncoded = new BYTE[*pcbEncoded];
+            CopyMemory(*ppEncoded, pEncoded, *pcbEncoded);
+            GlobalUnlock(hMemory);
+        }
+        else
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+
+    SafeRelease(&pStream);
+
+    return hr;
+}
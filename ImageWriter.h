@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Windows.h>
+#include <wincodec.h>
+#include "ColorConverter.h"
+
+//-------------------------------------------------------------------
+// CWicStripWriter
+//
+// Encodes an image with WIC (PNG, JPEG, TIFF, ...) from top-down
+// strips of rows, so the encoder can start before the whole image is
+// converted. containerFormat is one of the GUID_ContainerFormat*
+// values and pixelFormat the layout of the strips. 32-bit BGR input
+// is converted to 24 bits for encoders such as JPEG. COM must be
+// initialized. A file that is not committed is deleted again.
+//-------------------------------------------------------------------
+
+class CWicStripWriter : public IStripSink
+{
+public:
+    CWicStripWriter();
+    virtual ~CWicStripWriter();
+
+    HRESULT Open(LPCWSTR fileName, REFGUID containerFormat, REFGUID pixelFormat, UINT width, UINT height);
+    HRESULT Open(IStream *pStream, REFGUID containerFormat, REFGUID pixelFormat, UINT width, UINT height);
+    virtual HRESULT WriteStrip(const BYTE* pRows, LONG stride, UINT rowCount);
+    HRESULT Commit();
+
+protected:
+    IWICImagingFactory      *m_pFactory;
+    IStream                 *m_pStream;
+    IWICBitmapEncoder       *m_pEncoder;
+    IWICBitmapFrameEncode   *m_pFrame;
+    UINT                    m_width;
+    bool                    m_toBgr24;
+    BYTE                    *m_pConverted;
+    UINT                    m_convertedRows;
+    WCHAR                   m_fileName[MAX_PATH];   // Empty when writing to a caller's stream.
+
+    void Close();
+    void Discard();
+};
+
+//-------------------------------------------------------------------
+// CBitmapStripWriter
+//
+// Writes a 32-bit bmp from top-down strips of rows. The file is
+// stored bottom-up like the other bmp files of the application: Open
+// sizes the file, and each strip is written in reverse row order to
+// its place from the end. A file that is not committed is deleted
+// again.
+//-------------------------------------------------------------------
+
+class CBitmapStripWriter : public IStripSink
+{
+public:
+    CBitmapStripWriter();
+    virtual ~CBitmapStripWriter();
+
+    HRESULT Open(LPCWSTR fileName, UINT width, UINT height);
+    virtual HRESULT WriteStrip(const BYTE* pRows, LONG stride, UINT rowCount);
+    HRESULT Commit();
+
+protected:
+    HANDLE      m_hFile;
+    UINT        m_width;
+    UINT        m_height;
+    UINT        m_nextRow;          // Top-down index of the next row to arrive.
+    BYTE        *m_pStrip;          // Rows of the current strip, reversed.
+    UINT        m_stripRows;
+    WCHAR       m_fileName[MAX_PATH];
+
+    void Discard();
+};
+
+//-------------------------------------------------------------------
+// WriteImageFile
+//
+// Encodes a whole image with CWicStripWriter, for formats the bmp
+// writer cannot hold such as 16 bits per channel. A negative stride
+// writes a bottom-up buffer.
+//-------------------------------------------------------------------
+
+HRESULT WriteImageFile(
+    LPCWSTR     fileName,
+    REFGUID     containerFormat,
+    REFGUID     pixelFormat,
+    UINT        width,
+    UINT        height,
+    const BYTE* pData,
+    LONG        stride
+    );
+
+//-------------------------------------------------------------------
+// EncodeImage
+//
+// Same as WriteImageFile, but returns the encoded image in a new[]
+// buffer that the caller deletes. 32-bit BGR input can be encoded as
+// JPEG.
+//-------------------------------------------------------------------
+
+HRESULT EncodeImage(
+    REFGUID     containerFormat,
+    REFGUID     pixelFormat,
+    UINT        width,
+    UINT        height,
+    const BYTE* pData,
+    LONG        stride,
+    BYTE**      ppEncoded,
+    DWORD*      pcbEncoded
+    );
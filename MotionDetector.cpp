@@ -0,0 +1,180 @@
+#include "MotionDetector.h"
+
+#include <emmintrin.h>
+#include <malloc.h>
+
+CMotionDetector::CMotionDetector()
+{
+    m_step = 0;
+    m_cols = m_rows = m_size = 0;
+    m_pSample = m_pReference = m_pMask = NULL;
+    m_maskedCells = 0;
+    m_hasRegions = false;
+    m_hasReference = false;
+    m_threshold = 4.0;
+    m_lastDifference = 0.0;
+}
+
+
+CMotionDetector::~CMotionDetector()
+{
+    Release();
+}
+
+void CMotionDetector::Release()
+{
+    _aligned_free(m_pSample);
+    _aligned_free(m_pReference);
+    _aligned_free(m_pMask);
+    m_pSample = m_pReference = m_pMask = NULL;
+}
+
+//-------------------------------------------------------------------
+// Initialize
+//
+// Allocates the sample, reference and mask buffers for a frame of
+// the given size sampled every step pixels. Buffers are padded to a
+// multiple of 16 bytes with mask bytes of zero, so the SAD loop needs
+// no tail handling.
+//-------------------------------------------------------------------
+
+HRESULT CMotionDetector::Initialize(UINT frameWidth, UINT frameHeight, UINT step)
+{
+    Release();
+
+    if(step == 0 || frameWidth < step || frameHeight < step)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_step = step;
+    m_cols = frameWidth / step;
+    m_rows = frameHeight / step;
+    m_size = (m_cols * m_rows + 15) & ~15;
+
+    m_pSample = (BYTE*)_aligned_malloc(m_size, 16);
+    m_pReference = (BYTE*)_aligned_malloc(m_size, 16);
+    m_pMask = (BYTE*)_aligned_malloc(m_size, 16);
+
+    if(!m_pSample || !m_pReference || !m_pMask)
+    {
+        Release();
+        return E_OUTOFMEMORY;
+    }
+
+    ZeroMemory(m_pSample, m_size);
+    ZeroMemory(m_pReference, m_size);
+    m_hasReference = false;
+    ClearRegions();
+
+    return S_OK;
+}
+
+void CMotionDetector::SetThreshold(double meanDifference)
+{
+    m_threshold = meanDifference;
+}
+
+//-------------------------------------------------------------------
+// AddRegion
+//
+// Adds a rectangle, in frame pixels, to the region mask. Without any
+// regions the whole frame is compared.
+//-------------------------------------------------------------------
+
+HRESULT CMotionDetector::AddRegion(const RECT *prc)
+{
+    if(!m_pMask)
+    {
+        return E_UNEXPECTED;
+    }
+
+    if(!m_hasRegions)
+    {
+        ZeroMemory(m_pMask, m_size);
+        m_maskedCells = 0;
+        m_hasRegions = true;
+    }
+
+    UINT left = max(prc->left, 0L) / m_step;
+    UINT top = max(prc->top, 0L) / m_step;
+    UINT right = min((UINT)max(prc->right, 0L) / m_step, m_cols);
+    UINT bottom = min((UINT)max(prc->bottom, 0L) / m_step, m_rows);
+
+    for(UINT y = top; y < bottom; y++)
+    {
+        for(UINT x = left; x < right; x++)
+        {
+            BYTE &cell = m_pMask[y * m_cols + x];
+            if(!cell)
+            {
+                cell = 0xFF;
+                m_maskedCells++;
+            }
+        }
+    }
+
+    return S_OK;
+}
+
+void CMotionDetector::ClearRegions()
+{
+    if(m_pMask)
+    {
+        ZeroMemory(m_pMask, m_size);
+        FillMemory(m_pMask, m_cols * m_rows, 0xFF);
+    }
+    m_maskedCells = m_cols * m_rows;
+    m_hasRegions = false;
+}
+
+//-------------------------------------------------------------------
+// Update
+//
+// Compares the sample buffer against the reference. Returns true if
+// the mean absolute difference over the masked cells exceeds the
+// threshold, in which case the sample becomes the new reference. The
+// first frame always triggers.
+//-------------------------------------------------------------------
+
+bool CMotionDetector::Update()
+{
+    bool triggered = true;
+
+    if(m_hasReference)
+    {
+        UINT64 sad = MaskedSAD(m_pSample, m_pReference, m_pMask, m_size);
+
+        m_lastDifference = m_maskedCells ? (double)sad / m_maskedCells : 0.0;
+        triggered = m_lastDifference > m_threshold;
+    }
+
+    if(triggered)
+    {
+        BYTE *tmp = m_pReference;
+        m_pReference = m_pSample;
+        m_pSample = tmp;
+        m_hasReference = true;
+    }
+
+    return triggered;
+}
+
+UINT64 CMotionDetector::MaskedSAD(const BYTE *pA, const BYTE *pB, const BYTE *pMask, UINT size)
+{
+    __m128i sum = _mm_setzero_si128();
+
+    for(UINT i = 0; i < size; i += 16)
+    {
+        __m128i mask = _mm_load_si128((const __m128i*)(pMask + i));
+        __m128i a = _mm_and_si128(_mm_load_si128((const __m128i*)(pA + i)), mask);
+        __m128i b = _mm_and_si128(_mm_load_si128((const __m128i*)(pB + i)), mask);
+
+        // Two 64-bit partial sums, one per 8-byte half.
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+    }
+
+    UINT64 lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    return lanes[0] + lanes[1];
+}
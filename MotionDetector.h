@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Windows.h>
+
+//-------------------------------------------------------------------
+//  CMotionDetector class
+//
+//  Compares subsampled luma frames against a reference frame and
+//  reports when the mean absolute difference inside the region mask
+//  exceeds a threshold.
+//
+//-------------------------------------------------------------------
+
+class CMotionDetector
+{
+public:
+    CMotionDetector();
+    ~CMotionDetector();
+
+    HRESULT Initialize(UINT frameWidth, UINT frameHeight, UINT step);
+    void SetThreshold(double meanDifference);
+    HRESULT AddRegion(const RECT *prc);
+    void ClearRegions();
+
+    UINT GetStep() const { return m_step; }
+    BYTE* GetSampleBuffer() { return m_pSample; }
+    bool Update();
+    double GetLastDifference() const { return m_lastDifference; }
+
+protected:
+    UINT        m_step;
+    UINT        m_cols;
+    UINT        m_rows;
+    UINT        m_size;         // m_cols * m_rows rounded up to 16 bytes.
+    BYTE        *m_pSample;
+    BYTE        *m_pReference;
+    BYTE        *m_pMask;
+    UINT        m_maskedCells;
+    bool        m_hasRegions;
+    bool        m_hasReference;
+    double      m_threshold;
+    double      m_lastDifference;
+
+    void Release();
+    static UINT64 MaskedSAD(const BYTE *pA, const BYTE *pB, const BYTE *pMask, UINT size);
+};
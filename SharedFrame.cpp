@@ -0,0 +1,407 @@
+#include "SharedFrame.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//-------------------------------------------------------------------
+// CSharedMemory
+//-------------------------------------------------------------------
+
+CSharedMemory::CSharedMemory()
+{
+    m_pData = NULL;
+    m_size = 0;
+    m_owner = false;
+#ifdef _WIN32
+    m_hMapping = NULL;
+#else
+    m_fd = -1;
+    m_name[0] = 0;
+#endif
+}
+
+CSharedMemory::~CSharedMemory()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool CSharedMemory::Create(const char *name, size_t size)
+{
+    Close();
+
+    char fullName[MAX_PATH];
+    _snprintf_s(fullName, sizeof(fullName), _TRUNCATE, "Local\\%s", name);
+
+    m_hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        (DWORD)((UINT64)size >> 32), (DWORD)size, fullName);
+    if(!m_hMapping)
+    {
+        return false;
+    }
+
+    m_pData = (uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, size);
+    if(!m_pData)
+    {
+        Close();
+        return false;
+    }
+
+    m_size = size;
+    m_owner = true;
+    return true;
+}
+
+bool CSharedMemory::Open(const char *name)
+{
+    Close();
+
+    char fullName[MAX_PATH];
+    _snprintf_s(fullName, sizeof(fullName), _TRUNCATE, "Local\\%s", name);
+
+    m_hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, fullName);
+    if(!m_hMapping)
+    {
+        return false;
+    }
+
+    m_pData = (uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if(!m_pData)
+    {
+        Close();
+        return false;
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+    m_size = VirtualQuery(m_pData, &info, sizeof(info)) ? info.RegionSize : 0;
+    return true;
+}
+
+void CSharedMemory::Close()
+{
+    if(m_pData)
+    {
+        UnmapViewOfFile(m_pData);
+        m_pData = NULL;
+    }
+    if(m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    m_size = 0;
+    m_owner = false;
+}
+
+#else
+
+bool CSharedMemory::Create(const char *name, size_t size)
+{
+    Close();
+
+    snprintf(m_name, sizeof(m_name), "/%s", name);
+
+    m_fd = shm_open(m_name, O_RDWR | O_CREAT, 0644);
+    if(m_fd < 0 || ftruncate(m_fd, (off_t)size) != 0)
+    {
+        Close();
+        return false;
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(p == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+
+    m_pData = (uint8_t*)p;
+    m_size = size;
+    m_owner = true;
+    return true;
+}
+
+bool CSharedMemory::Open(const char *name)
+{
+    Close();
+
+    snprintf(m_name, sizeof(m_name), "/%s", name);
+
+    struct stat st;
+    m_fd = shm_open(m_name, O_RDONLY, 0);
+    if(m_fd < 0 || fstat(m_fd, &st) != 0 || st.st_size == 0)
+    {
+        Close();
+        return false;
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if(p == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+
+    m_pData = (uint8_t*)p;
+    m_size = (size_t)st.st_size;
+    return true;
+}
+
+void CSharedMemory::Close()
+{
+    if(m_pData)
+    {
+        munmap(m_pData, m_size);
+        m_pData = NULL;
+    }
+    if(m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+    // The name lives on until the writer that created it goes away.
+    if(m_owner)
+    {
+        shm_unlink(m_name);
+    }
+    m_size = 0;
+    m_owner = false;
+}
+
+#endif
+
+//-------------------------------------------------------------------
+// Layout helpers
+//-------------------------------------------------------------------
+
+static size_t AlignUp(size_t value)
+{
+    return (value + 63) & ~(size_t)63;
+}
+
+static size_t GetHeaderSize(uint32_t slotCount)
+{
+    return AlignUp(offsetof(SharedFrameHeader, slots) + slotCount * sizeof(SharedFrameSlot));
+}
+
+//-------------------------------------------------------------------
+// CSharedFrameWriter
+//-------------------------------------------------------------------
+
+CSharedFrameWriter::CSharedFrameWriter()
+{
+    m_pHeader = NULL;
+    m_slot = 0;
+    m_dataSize = 0;
+    m_frameNumber = 0;
+    m_writing = false;
+}
+
+//-------------------------------------------------------------------
+// Create
+//
+// Creates the ring with slotCount slots of maxFrameBytes each. Use at
+// least three slots so readers can work on the newest frame while the
+// writer fills the next one.
+//-------------------------------------------------------------------
+
+bool CSharedFrameWriter::Create(const char *name, uint32_t maxFrameBytes, uint32_t slotCount)
+{
+    Close();
+
+    if(slotCount < 2 || maxFrameBytes == 0)
+    {
+        return false;
+    }
+
+    size_t slotDataSize = AlignUp(maxFrameBytes);
+    size_t headerSize = GetHeaderSize(slotCount);
+
+    if(!m_memory.Create(name, headerSize + slotDataSize * slotCount))
+    {
+        return false;
+    }
+
+    m_pHeader = (SharedFrameHeader*)m_memory.GetData();
+
+    memset((void*)m_pHeader, 0, headerSize);
+    m_pHeader->version = SHARED_FRAME_VERSION;
+    m_pHeader->slotCount = slotCount;
+    m_pHeader->slotDataSize = (uint32_t)slotDataSize;
+    m_pHeader->latest.store(-1, std::memory_order_relaxed);
+
+    for(uint32_t i = 0; i < slotCount; i++)
+    {
+        m_pHeader->slots[i].sequence.store(0, std::memory_order_relaxed);
+        m_pHeader->slots[i].dataOffset = headerSize + slotDataSize * i;
+    }
+
+    // Readers check the magic last.
+    std::atomic_thread_fence(std::memory_order_release);
+    m_pHeader->magic = SHARED_FRAME_MAGIC;
+
+    m_slot = slotCount - 1;
+    m_frameNumber = 0;
+    m_writing = false;
+    return true;
+}
+
+void CSharedFrameWriter::Close()
+{
+    m_memory.Close();
+    m_pHeader = NULL;
+}
+
+//-------------------------------------------------------------------
+// BeginFrame
+//
+// Marks the slot after the newest one as being written and returns
+// its pixel memory, or NULL if dataSize does not fit.
+//-------------------------------------------------------------------
+
+uint8_t* CSharedFrameWriter::BeginFrame(uint32_t dataSize)
+{
+    if(!m_pHeader || dataSize > m_pHeader->slotDataSize)
+    {
+        return NULL;
+    }
+
+    if(!m_writing)
+    {
+        m_slot = (m_slot + 1) % m_pHeader->slotCount;
+
+        SharedFrameSlot &slot = m_pHeader->slots[m_slot];
+        slot.sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_writing = true;
+    }
+
+    m_dataSize = dataSize;
+    return m_memory.GetData() + m_pHeader->slots[m_slot].dataOffset;
+}
+
+void CSharedFrameWriter::CommitFrame(uint32_t format, uint32_t width, uint32_t height, int32_t stride, int64_t timestamp)
+{
+    if(!m_writing)
+    {
+        return;
+    }
+
+    SharedFrameSlot &slot = m_pHeader->slots[m_slot];
+    slot.format = format;
+    slot.frameNumber = m_frameNumber++;
+    slot.timestamp = timestamp;
+    slot.width = width;
+    slot.height = height;
+    slot.stride = stride;
+    slot.dataSize = m_dataSize;
+
+    // Even again: the slot is complete.
+    slot.sequence.fetch_add(1, std::memory_order_release);
+    m_pHeader->latest.store((int32_t)m_slot, std::memory_order_release);
+    m_writing = false;
+}
+
+//-------------------------------------------------------------------
+// CSharedFrameReader
+//-------------------------------------------------------------------
+
+CSharedFrameReader::CSharedFrameReader()
+{
+    m_pHeader = NULL;
+}
+
+bool CSharedFrameReader::Open(const char *name)
+{
+    Close();
+
+    if(!m_memory.Open(name) || m_memory.GetSize() < sizeof(SharedFrameHeader))
+    {
+        m_memory.Close();
+        return false;
+    }
+
+    const SharedFrameHeader *pHeader = (const SharedFrameHeader*)m_memory.GetData();
+    bool valid = pHeader->magic == SHARED_FRAME_MAGIC;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if(!valid || pHeader->version != SHARED_FRAME_VERSION ||
+        m_memory.GetSize() < GetHeaderSize(pHeader->slotCount) + (size_t)pHeader->slotDataSize * pHeader->slotCount)
+    {
+        m_memory.Close();
+        return false;
+    }
+
+    m_pHeader = pHeader;
+    return true;
+}
+
+void CSharedFrameReader::Close()
+{
+    m_memory.Close();
+    m_pHeader = NULL;
+}
+
+//-------------------------------------------------------------------
+// GetLatestFrame
+//
+// Fills pView with the newest complete frame. The pixels stay in the
+// shared memory; call ValidateFrame after using them. Returns false if
+// no frame has been published yet or the writer is overtaking us.
+//-------------------------------------------------------------------
+
+bool CSharedFrameReader::GetLatestFrame(SharedFrameView *pView) const
+{
+    if(!m_pHeader)
+    {
+        return false;
+    }
+
+    for(int attempt = 0; attempt < 4; attempt++)
+    {
+        int32_t latest = m_pHeader->latest.load(std::memory_order_acquire);
+        if(latest < 0 || (uint32_t)latest >= m_pHeader->slotCount)
+        {
+            return false;
+        }
+
+        const SharedFrameSlot &slot = m_pHeader->slots[latest];
+        uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if(sequence & 1)
+        {
+            continue;
+        }
+
+        pView->format = slot.format;
+        pView->frameNumber = slot.frameNumber;
+        pView->timestamp = slot.timestamp;
+        pView->width = slot.width;
+        pView->height = slot.height;
+        pView->stride = slot.stride;
+        pView->dataSize = slot.dataSize;
+        pView->pData = m_memory.GetData() + slot.dataOffset;
+        pView->slot = (uint32_t)latest;
+        pView->sequence = sequence;
+
+        if(ValidateFrame(*pView))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool CSharedFrameReader::ValidateFrame(const SharedFrameView &view) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return m_pHeader->slots[view.slot].sequence.load(std::memory_order_relaxed) == view.sequence;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+//-------------------------------------------------------------------
+//  Shared-memory latest-frame ring
+//
+//  The writer publishes converted frames into a named shared-memory
+//  ring of slots. Each slot is guarded by a sequence counter that is
+//  odd while the slot is written (a seqlock), and the header holds
+//  the index of the newest complete slot. Readers map the ring read
+//  only, take the newest slot without any lock and use the pixels in
+//  place; after using them, ValidateFrame tells whether the writer
+//  came around and reused the slot in the meantime.
+//
+//  This header and SharedFrame.cpp do not depend on the rest of the
+//  application, so other processes can use the reader on Windows
+//  (named file mapping) or POSIX systems (shm_open).
+//
+//-------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#define SHARED_FRAME_MAGIC      0x46534357  // 'WCSF'
+#define SHARED_FRAME_VERSION    1
+
+// Pixel formats, as FOURCC codes.
+#define SHARED_FRAME_FORMAT_BGRA 0x41524742 // 'BGRA', 8 bits per channel
+#define SHARED_FRAME_FORMAT_RGBA64 0x34366152 // 'Ra64', 16 bits per channel, R G B A order
+
+struct SharedFrameSlot
+{
+    std::atomic<uint32_t>   sequence;       // Odd while the slot is being written.
+    uint32_t                format;
+    uint64_t                frameNumber;
+    int64_t                 timestamp;      // 100 ns units, from the capture device.
+    uint32_t                width;
+    uint32_t                height;
+    int32_t                 stride;         // Always positive, rows are top-down.
+    uint32_t                dataSize;
+    uint64_t                dataOffset;     // From the start of the mapping.
+};
+
+struct SharedFrameHeader
+{
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                slotCount;
+    uint32_t                slotDataSize;   // Capacity of each slot's pixel data.
+    std::atomic<int32_t>    latest;         // Newest complete slot, -1 before the first frame.
+    uint32_t                reserved[3];
+    SharedFrameSlot         slots[1];       // slotCount entries.
+};
+
+struct SharedFrameView
+{
+    const uint8_t           *pData;
+    uint32_t                format;
+    uint64_t                frameNumber;
+    int64_t                 timestamp;
+    uint32_t                width;
+    uint32_t                height;
+    int32_t                 stride;
+    uint32_t                dataSize;
+
+    // Used by ValidateFrame.
+    uint32_t                slot;
+    uint32_t                sequence;
+};
+
+//-------------------------------------------------------------------
+//  CSharedMemory
+//
+//  Platform-specific part: a named, mapped block of shared memory.
+//-------------------------------------------------------------------
+
+class CSharedMemory
+{
+public:
+    CSharedMemory();
+    ~CSharedMemory();
+
+    bool Create(const char *name, size_t size);
+    bool Open(const char *name);
+    void Close();
+
+    uint8_t* GetData() const { return m_pData; }
+    size_t GetSize() const { return m_size; }
+
+protected:
+    uint8_t     *m_pData;
+    size_t      m_size;
+    bool        m_owner;
+#ifdef _WIN32
+    HANDLE      m_hMapping;
+#else
+    int         m_fd;
+    char        m_name[256];
+#endif
+};
+
+//-------------------------------------------------------------------
+//  CSharedFrameWriter
+//
+//  BeginFrame returns the pixel memory of the next slot, which the
+//  converter writes directly; CommitFrame publishes it.
+//-------------------------------------------------------------------
+
+class CSharedFrameWriter
+{
+public:
+    CSharedFrameWriter();
+
+    bool Create(const char *name, uint32_t maxFrameBytes, uint32_t slotCount);
+    void Close();
+    bool IsOpen() const { return m_pHeader != NULL; }
+
+    uint8_t* BeginFrame(uint32_t dataSize);
+    void CommitFrame(uint32_t format, uint32_t width, uint32_t height, int32_t stride, int64_t timestamp);
+
+protected:
+    CSharedMemory       m_memory;
+    SharedFrameHeader   *m_pHeader;
+    uint32_t            m_slot;
+    uint32_t            m_dataSize;
+    uint64_t            m_frameNumber;
+    bool                m_writing;
+};
+
+//-------------------------------------------------------------------
+//  CSharedFrameReader
+//-------------------------------------------------------------------
+
+class CSharedFrameReader
+{
+public:
+    CSharedFrameReader();
+
+    bool Open(const char *name);
+    void Close();
+
+    bool GetLatestFrame(SharedFrameView *pView) const;
+    bool ValidateFrame(const SharedFrameView &view) const;
+
+protected:
+    CSharedMemory       m_memory;
+    const SharedFrameHeader *m_pHeader;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+//-------------------------------------------------------------------
+//  Snapshot control channel protocol
+//
+//  A resident server keeps the capture device streaming and answers
+//  snapshot requests over a local byte stream (a named pipe). Each
+//  exchange is one SnapshotRequest from the client followed by one
+//  SnapshotResponse and, for snapshots, dataSize bytes of top-down
+//  BGRA pixels. All fields are little endian.
+//
+//  The header only uses fixed-width types so clients and tests can be
+//  built on any platform.
+//
+//-------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SNAPSHOT_PROTOCOL_MAGIC     0x52534357  // 'WCSR'
+#define SNAPSHOT_PROTOCOL_VERSION   1
+#define SNAPSHOT_DEFAULT_CHANNEL    "WebcamImage"
+
+enum SnapshotCommand
+{
+    SnapshotCommand_Ping = 1,       // Status only, no frame.
+    SnapshotCommand_Snapshot = 2,   // Convert and return a frame.
+    SnapshotCommand_Quit = 3        // Stop the server.
+};
+
+// Wait for a frame that was captured after the request arrived,
+// instead of returning the newest frame already captured.
+#define SNAPSHOT_FLAG_NEXT_FRAME    0x00000001
+
+#pragma pack(push, 4)
+
+struct SnapshotRequest
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    command;        // SnapshotCommand
+    uint32_t    flags;          // SNAPSHOT_FLAG_*
+    uint32_t    timeoutMs;      // Longest wait for a frame, 0 for the server default.
+};
+
+struct SnapshotResponse
+{
+    uint32_t    magic;
+    uint32_t    version;
+    int32_t     status;         // HRESULT
+    uint32_t    format;         // FOURCC, 'BGRA' for 8-bit BGRA.
+    uint64_t    frameNumber;    // Frames captured since the server started.
+    int64_t     timestamp;      // 100 ns units, from the capture device.
+    uint32_t    width;
+    uint32_t    height;
+    int32_t     stride;
+    uint32_t    dataSize;       // Pixel bytes following this header.
+    uint32_t    latencyUs;      // Server time from request to response.
+};
+
+#pragma pack(pop)
+
+inline void InitSnapshotRequest(SnapshotRequest *pRequest, uint32_t command, uint32_t flags)
+{
+    memset(pRequest, 0, sizeof(*pRequest));
+    pRequest->magic = SNAPSHOT_PROTOCOL_MAGIC;
+    pRequest->version = SNAPSHOT_PROTOCOL_VERSION;
+    pRequest->command = command;
+    pRequest->flags = flags;
+}
+
+inline bool IsValidSnapshotRequest(const SnapshotRequest &request)
+{
+    return request.magic == SNAPSHOT_PROTOCOL_MAGIC &&
+        request.version == SNAPSHOT_PROTOCOL_VERSION &&
+        request.command >= SnapshotCommand_Ping &&
+        request.command <= SnapshotCommand_Quit;
+}
+
+inline void InitSnapshotResponse(SnapshotResponse *pResponse, int32_t status)
+{
+    memset(pResponse, 0, sizeof(*pResponse));
+    pResponse->magic = SNAPSHOT_PROTOCOL_MAGIC;
+    pResponse->version = SNAPSHOT_PROTOCOL_VERSION;
+    pResponse->status = status;
+}
+
+//-------------------------------------------------------------------
+// IsValidSnapshotResponse
+//
+// Checks the header and that the announced pixel data is consistent
+// with the frame size, so clients can size their buffer from it.
+//-------------------------------------------------------------------
+
+inline bool IsValidSnapshotResponse(const SnapshotResponse &response)
+{
+    if(response.magic != SNAPSHOT_PROTOCOL_MAGIC || response.version != SNAPSHOT_PROTOCOL_VERSION)
+    {
+        return false;
+    }
+    if(response.dataSize == 0)
+    {
+        return true;
+    }
+    return response.stride > 0 &&
+        (uint64_t)response.stride >= (uint64_t)response.width * 4 &&
+        (uint64_t)response.dataSize == (uint64_t)response.stride * response.height;
+}
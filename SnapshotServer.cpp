@@ -0,0 +1,358 @@
+#include "SnapshotServer.h"
+
+#include <strsafe.h>
+
+//-------------------------------------------------------------------
+// Pipe helpers
+//
+// The server pipe is opened for overlapped I/O so that waiting for a
+// client can be interrupted; transfers wait for their completion.
+//-------------------------------------------------------------------
+
+static void GetPipeName(LPCWSTR channel, WCHAR *name, size_t cchName)
+{
+    StringCchPrintf(name, cchName, L"\\\\.\\pipe\\%s", channel);
+}
+
+static bool TransferAll(HANDLE hPipe, BYTE *pData, DWORD size, bool write, OVERLAPPED *pOverlapped)
+{
+    while(size > 0)
+    {
+        DWORD done = 0;
+        BOOL ok;
+
+        if(pOverlapped)
+        {
+            ResetEvent(pOverlapped->hEvent);
+        }
+
+        if(write)
+            ok = WriteFile(hPipe, pData, size, &done, pOverlapped);
+        else
+            ok = ReadFile(hPipe, pData, size, &done, pOverlapped);
+
+        if(!ok && pOverlapped && GetLastError() == ERROR_IO_PENDING)
+        {
+            ok = GetOverlappedResult(hPipe, pOverlapped, &done, TRUE);
+        }
+        if(!ok || done == 0)
+        {
+            return false;
+        }
+
+        pData += done;
+        size -= done;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------
+// CPipeStream
+//
+// ISnapshotStream over a connected pipe handle.
+//-------------------------------------------------------------------
+
+class CPipeStream : public ISnapshotStream
+{
+public:
+    CPipeStream(HANDLE hPipe, OVERLAPPED *pOverlapped) : m_hPipe(hPipe), m_pOverlapped(pOverlapped)
+    {
+    }
+
+    virtual bool Read(void *pData, uint32_t size)
+    {
+        return TransferAll(m_hPipe, (BYTE*)pData, size, false, m_pOverlapped);
+    }
+
+    virtual bool Write(const void *pData, uint32_t size)
+    {
+        return TransferAll(m_hPipe, (BYTE*)pData, size, true, m_pOverlapped);
+    }
+
+protected:
+    HANDLE      m_hPipe;
+    OVERLAPPED  *m_pOverlapped;
+};
+
+CSnapshotServer::CSnapshotServer(CWebcamAccess &wa) : m_wa(wa)
+{
+    m_hCaptureThread = NULL;
+    m_stopCapture = false;
+    m_captureResult = S_OK;
+    m_pLatest = NULL;
+    m_latestTime = 0;
+    m_frameCount = 0;
+    m_pFrame = NULL;
+    m_width = m_height = 0;
+    m_bpp = 4;
+
+    InitializeCriticalSection(&m_lock);
+    InitializeConditionVariable(&m_frameArrived);
+}
+
+
+CSnapshotServer::~CSnapshotServer()
+{
+    StopCapture();
+    SafeRelease(&m_pLatest);
+    DeleteCriticalSection(&m_lock);
+    delete[] m_pFrame;
+}
+
+//-------------------------------------------------------------------
+// Run
+//
+// Starts streaming and serves clients on \\.\pipe\<channel>, one at a
+// time, until a quit request arrives or *pStop becomes true.
+//-------------------------------------------------------------------
+
+HRESULT CSnapshotServer::Run(LPCWSTR channel, volatile bool *pStop)
+{
+    WCHAR pipeName[MAX_PATH];
+    GetPipeName(channel, pipeName, ARRAYSIZE(pipeName));
+
+    m_wa.GetImageSizes(m_width, m_height);
+    if(m_width == 0 || m_height == 0)
+    {
+        return MF_E_NOT_INITIALIZED;
+    }
+
+    m_bpp = m_wa.GetBytesPerPixel();
+
+    delete[] m_pFrame;
+    m_pFrame = new BYTE[m_width * m_height * m_bpp];
+
+    m_stopCapture = false;
+    m_hCaptureThread = CreateThread(NULL, 0, CaptureThreadProc, this, 0, NULL);
+    if(!m_hCaptureThread)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    HRESULT hr = S_OK;
+    bool quit = false;
+
+    while(!quit && !*pStop)
+    {
+        HANDLE hPipe = CreateNamedPipe(pipeName,
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            1, 64 * 1024, 64 * 1024, 0, NULL);
+
+        if(hPipe == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        ResetEvent(overlapped.hEvent);
+        bool connected = ConnectNamedPipe(hPipe, &overlapped) != FALSE;
+        if(!connected)
+        {
+            DWORD err = GetLastError();
+            if(err == ERROR_PIPE_CONNECTED)
+            {
+                connected = true;
+            }
+            else if(err == ERROR_IO_PENDING)
+            {
+                // Poll so Ctrl+C is noticed while nobody connects.
+                while(!*pStop)
+                {
+                    if(WaitForSingleObject(overlapped.hEvent, 200) == WAIT_OBJECT_0)
+                    {
+                        DWORD dummy;
+                        connected = GetOverlappedResult(hPipe, &overlapped, &dummy, FALSE) != FALSE;
+                        break;
+                    }
+                }
+                if(!connected)
+                {
+                    CancelIo(hPipe);
+                }
+            }
+        }
+
+        if(connected)
+        {
+            CPipeStream stream(hPipe, &overlapped);
+            quit = ServeSnapshotRequest(&stream, this);
+            FlushFileBuffers(hPipe);
+            DisconnectNamedPipe(hPipe);
+        }
+
+        CloseHandle(hPipe);
+    }
+
+    CloseHandle(overlapped.hEvent);
+    StopCapture();
+
+    if(SUCCEEDED(hr) && FAILED(m_captureResult))
+    {
+        hr = m_captureResult;
+    }
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// GetSnapshot
+//
+// ISnapshotSource: converts the newest sample, or waits for the next
+// one, for ServeSnapshotRequest.
+//-------------------------------------------------------------------
+
+int32_t CSnapshotServer::GetSnapshot(bool nextFrame, uint32_t timeoutMs, SnapshotFrame *pFrame)
+{
+    IMFMediaBuffer *pSample = AcquireFrame(nextFrame, timeoutMs, &pFrame->frameNumber, &pFrame->timestamp);
+    if(!pSample)
+    {
+        return FAILED(m_captureResult) ? m_captureResult : HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+
+    HRESULT hr = m_wa.ConvertSample(pSample, m_pFrame, m_width * m_bpp, pFrame->timestamp);
+    pSample->Release();
+    if(FAILED(hr))
+    {
+        return hr;
+    }
+
+    pFrame->pData = m_pFrame;
+    pFrame->format = m_wa.GetPixelFormat();
+    pFrame->width = m_width;
+    pFrame->height = m_height;
+    pFrame->stride = m_width * m_bpp;
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Capture thread
+//
+// Reads samples continuously so the device, the source reader and
+// any decoder stay warm, and keeps only the newest native sample.
+// Nothing is converted here.
+//-------------------------------------------------------------------
+
+DWORD WINAPI CSnapshotServer::CaptureThreadProc(LPVOID pParam)
+{
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    ((CSnapshotServer*)pParam)->CaptureLoop();
+    CoUninitialize();
+    return 0;
+}
+
+void CSnapshotServer::CaptureLoop()
+{
+    while(!m_stopCapture)
+    {
+        IMFMediaBuffer *pSample = NULL;
+        LONGLONG llTimeStamp = 0;
+
+        HRESULT hr = m_wa.ReadSample(&pSample, &llTimeStamp);
+        if(FAILED(hr) || !pSample)
+        {
+            m_captureResult = FAILED(hr) ? hr : MF_E_NOT_INITIALIZED;
+            break;
+        }
+
+        EnterCriticalSection(&m_lock);
+        SafeRelease(&m_pLatest);
+        m_pLatest = pSample;
+        m_latestTime = llTimeStamp;
+        m_frameCount++;
+        LeaveCriticalSection(&m_lock);
+
+        WakeAllConditionVariable(&m_frameArrived);
+    }
+
+    WakeAllConditionVariable(&m_frameArrived);
+}
+
+void CSnapshotServer::StopCapture()
+{
+    if(m_hCaptureThread)
+    {
+        m_stopCapture = true;
+        WaitForSingleObject(m_hCaptureThread, INFINITE);
+        CloseHandle(m_hCaptureThread);
+        m_hCaptureThread = NULL;
+    }
+}
+
+//-------------------------------------------------------------------
+// AcquireFrame
+//
+// Returns the newest sample with a reference added, or NULL on
+// timeout. With nextFrame, waits for a sample captured after the call.
+//-------------------------------------------------------------------
+
+IMFMediaBuffer* CSnapshotServer::AcquireFrame(bool nextFrame, DWORD timeoutMs, UINT64 *pFrameNumber, LONGLONG *pTimeStamp)
+{
+    IMFMediaBuffer *pSample = NULL;
+    ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+    EnterCriticalSection(&m_lock);
+
+    UINT64 minFrame = nextFrame ? m_frameCount + 1 : 1;
+
+    while(m_frameCount < minFrame && !m_stopCapture && SUCCEEDED(m_captureResult))
+    {
+        ULONGLONG now = GetTickCount64();
+        if(now >= deadline ||
+            !SleepConditionVariableCS(&m_frameArrived, &m_lock, (DWORD)(deadline - now)))
+        {
+            break;
+        }
+    }
+
+    if(m_frameCount >= minFrame && m_pLatest)
+    {
+        pSample = m_pLatest;
+        pSample->AddRef();
+        *pFrameNumber = m_frameCount;
+        *pTimeStamp = m_latestTime;
+    }
+
+    LeaveCriticalSection(&m_lock);
+    return pSample;
+}
+
+//-------------------------------------------------------------------
+// RequestSnapshot
+//
+// Client side: sends one request to the server on channel and reads
+// the response. For snapshots *ppData receives the pixels, allocated
+// with new[].
+//-------------------------------------------------------------------
+
+HRESULT RequestSnapshot(LPCWSTR channel, uint32_t command, uint32_t flags, SnapshotResponse *pResponse, BYTE **ppData)
+{
+    WCHAR pipeName[MAX_PATH];
+    GetPipeName(channel, pipeName, ARRAYSIZE(pipeName));
+
+    *ppData = NULL;
+
+    HANDLE hPipe = INVALID_HANDLE_VALUE;
+    for(int attempt = 0; attempt < 2; attempt++)
+    {
+        hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if(hPipe != INVALID_HANDLE_VALUE || GetLastError() != ERROR_PIPE_BUSY)
+        {
+            break;
+        }
+        WaitNamedPipe(pipeName, 5000);
+    }
+    if(hPipe == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    CPipeStream stream(hPipe, NULL);
+    HRESULT hr = ExchangeSnapshot(&stream, command, flags, pResponse, ppData);
+
+    CloseHandle(hPipe);
+    return hr;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "WebcamAccess.h"
+#include "SnapshotSession.h"
+
+//-------------------------------------------------------------------
+//  CSnapshotServer class
+//
+//  Resident mode: keeps the prepared device streaming on a capture
+//  thread that holds on to the newest native sample, and serves
+//  snapshot requests over a named pipe. A snapshot only has to
+//  convert the newest sample, so its latency is at most one frame
+//  interval instead of the whole device setup. The protocol itself
+//  is handled by ServeSnapshotRequest, with the server as the frame
+//  source.
+//
+//-------------------------------------------------------------------
+
+class CSnapshotServer : public ISnapshotSource
+{
+public:
+    CSnapshotServer(CWebcamAccess &wa);
+    ~CSnapshotServer();
+
+    HRESULT Run(LPCWSTR channel, volatile bool *pStop);
+
+    virtual int32_t GetSnapshot(bool nextFrame, uint32_t timeoutMs, SnapshotFrame *pFrame);
+
+protected:
+    CWebcamAccess           &m_wa;
+    HANDLE                  m_hCaptureThread;
+    volatile bool           m_stopCapture;
+    HRESULT                 m_captureResult;
+
+    CRITICAL_SECTION        m_lock;
+    CONDITION_VARIABLE      m_frameArrived;
+    IMFMediaBuffer          *m_pLatest;         // Guarded by m_lock.
+    LONGLONG                m_latestTime;
+    UINT64                  m_frameCount;
+
+    BYTE                    *m_pFrame;
+    unsigned int            m_width;
+    unsigned int            m_height;
+    UINT                    m_bpp;
+
+    static DWORD WINAPI CaptureThreadProc(LPVOID pParam);
+    void CaptureLoop();
+    void StopCapture();
+    IMFMediaBuffer* AcquireFrame(bool nextFrame, DWORD timeoutMs, UINT64 *pFrameNumber, LONGLONG *pTimeStamp);
+};
+
+HRESULT RequestSnapshot(LPCWSTR channel, uint32_t command, uint32_t flags, SnapshotResponse *pResponse, BYTE **ppData);
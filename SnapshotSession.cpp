@@ -0,0 +1,273 @@
+#include "SnapshotSession.h"
+
+#include <chrono>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+//-------------------------------------------------------------------
+// ServeSnapshotRequest
+//
+// Server side: reads one request and answers it. Invalid requests
+// get an error response and no data. Returns true for a quit request.
+//-------------------------------------------------------------------
+
+bool ServeSnapshotRequest(ISnapshotStream *pStream, ISnapshotSource *pSource)
+{
+    SnapshotRequest request;
+    SnapshotResponse response;
+    const uint8_t *pData = NULL;
+
+    if(!pStream->Read(&request, sizeof(request)))
+    {
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if(!IsValidSnapshotRequest(request))
+    {
+        InitSnapshotResponse(&response, SNAPSHOT_STATUS_INVALID_REQUEST);
+        pStream->Write(&response, sizeof(response));
+        return false;
+    }
+
+    InitSnapshotResponse(&response, SNAPSHOT_STATUS_OK);
+
+    if(request.command == SnapshotCommand_Snapshot)
+    {
+        uint32_t timeoutMs = request.timeoutMs ? request.timeoutMs : SNAPSHOT_DEFAULT_TIMEOUT_MS;
+        bool nextFrame = (request.flags & SNAPSHOT_FLAG_NEXT_FRAME) != 0;
+        SnapshotFrame frame;
+
+        memset(&frame, 0, sizeof(frame));
+        response.status = pSource->GetSnapshot(nextFrame, timeoutMs, &frame);
+        if(response.status >= 0)
+        {
+            pData = frame.pData;
+            response.format = frame.format;
+            response.frameNumber = frame.frameNumber;
+            response.timestamp = frame.timestamp;
+            response.width = frame.width;
+            response.height = frame.height;
+            response.stride = frame.stride;
+            response.dataSize = (uint32_t)frame.stride * frame.height;
+        }
+    }
+
+    response.latencyUs = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    if(pStream->Write(&response, sizeof(response)) && response.dataSize)
+    {
+        pStream->Write(pData, response.dataSize);
+    }
+
+    return request.command == SnapshotCommand_Quit;
+}
+
+//-------------------------------------------------------------------
+// ExchangeSnapshot
+//
+// Client side: sends one request and reads the response. For
+// snapshots *ppData receives the pixels, allocated with new[].
+// Returns the status of the response, or SNAPSHOT_STATUS_FAIL if the
+// exchange failed or the response is malformed.
+//-------------------------------------------------------------------
+
+int32_t ExchangeSnapshot(ISnapshotStream *pStream, uint32_t command, uint32_t flags,
+    SnapshotResponse *pResponse, uint8_t **ppData)
+{
+    SnapshotRequest request;
+    InitSnapshotRequest(&request, command, flags);
+
+    *ppData = NULL;
+
+    if(!pStream->Write(&request, sizeof(request)) ||
+        !pStream->Read(pResponse, sizeof(*pResponse)) ||
+        !IsValidSnapshotResponse(*pResponse))
+    {
+        return SNAPSHOT_STATUS_FAIL;
+    }
+
+    int32_t status = pResponse->status;
+
+    if(status >= 0 && pResponse->dataSize)
+    {
+        *ppData = new uint8_t[pResponse->dataSize];
+        if(!pStream->Read(*ppData, pResponse->dataSize))
+        {
+            delete[] *ppData;
+            *ppData = NULL;
+            status = SNAPSHOT_STATUS_FAIL;
+        }
+    }
+    return status;
+}
+
+#ifndef _WIN32
+
+//-------------------------------------------------------------------
+// CSnapshotSocket
+//-------------------------------------------------------------------
+
+CSnapshotSocket::CSnapshotSocket()
+{
+    m_fd = -1;
+    m_path[0] = 0;
+}
+
+CSnapshotSocket::~CSnapshotSocket()
+{
+    Close();
+}
+
+static bool GetSocketAddress(const char *path, sockaddr_un *pAddress)
+{
+    if(strlen(path) >= sizeof(pAddress->sun_path))
+    {
+        return false;
+    }
+
+    memset(pAddress, 0, sizeof(*pAddress));
+    pAddress->sun_family = AF_UNIX;
+    strcpy(pAddress->sun_path, path);
+    return true;
+}
+
+bool CSnapshotSocket::Listen(const char *path)
+{
+    sockaddr_un address;
+
+    Close();
+    if(!GetSocketAddress(path, &address))
+    {
+        return false;
+    }
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(m_fd < 0)
+    {
+        return false;
+    }
+
+    // A socket file left behind by a server that died is reused.
+    unlink(path);
+    if(bind(m_fd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(m_fd, 4) != 0)
+    {
+        Close();
+        return false;
+    }
+
+    strcpy(m_path, path);
+    return true;
+}
+
+//-------------------------------------------------------------------
+// Accept
+//
+// Waits up to timeoutMs (-1: no limit) for a client. Returns false on
+// timeout, so callers can poll for a stop request in between.
+//-------------------------------------------------------------------
+
+bool CSnapshotSocket::Accept(CSnapshotSocket *pConnection, int timeoutMs)
+{
+    pollfd pfd = { m_fd, POLLIN, 0 };
+
+    if(m_fd < 0 || poll(&pfd, 1, timeoutMs) <= 0)
+    {
+        return false;
+    }
+
+    int fd = accept(m_fd, NULL, NULL);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    pConnection->Close();
+    pConnection->m_fd = fd;
+    return true;
+}
+
+bool CSnapshotSocket::Connect(const char *path)
+{
+    sockaddr_un address;
+
+    Close();
+    if(!GetSocketAddress(path, &address))
+    {
+        return false;
+    }
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(m_fd < 0)
+    {
+        return false;
+    }
+
+    if(connect(m_fd, (const sockaddr*)&address, sizeof(address)) != 0)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CSnapshotSocket::Close()
+{
+    if(m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if(m_path[0])
+    {
+        unlink(m_path);
+        m_path[0] = 0;
+    }
+}
+
+bool CSnapshotSocket::Read(void *pData, uint32_t size)
+{
+    uint8_t *p = (uint8_t*)pData;
+
+    while(size > 0)
+    {
+        ssize_t done = recv(m_fd, p, size, 0);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+
+        p += done;
+        size -= (uint32_t)done;
+    }
+    return true;
+}
+
+bool CSnapshotSocket::Write(const void *pData, uint32_t size)
+{
+    const uint8_t *p = (const uint8_t*)pData;
+
+    while(size > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away is an error, not SIGPIPE.
+        ssize_t done = send(m_fd, p, size, MSG_NOSIGNAL);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+
+        p += done;
+        size -= (uint32_t)done;
+    }
+    return true;
+}
+
+#endif
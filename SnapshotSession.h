@@ -0,0 +1,104 @@
+#pragma once
+
+//-------------------------------------------------------------------
+//  Snapshot protocol sessions
+//
+//  The request and response handling of the snapshot channel (see
+//  SnapshotProtocol.h), independent of the transport and of the
+//  capture device: the server side reads a request from an
+//  ISnapshotStream and answers it with a frame from an
+//  ISnapshotSource, the client side sends a request and reads the
+//  response and pixels back.
+//
+//  CSnapshotServer serves the protocol over a named pipe with the
+//  newest frame of the camera. On POSIX systems CSnapshotSocket
+//  carries it over a Unix domain socket, so the protocol can be
+//  served and tested there against a synthetic source.
+//
+//  This header and SnapshotSession.cpp only use the C library (and
+//  sockets on POSIX systems).
+//
+//-------------------------------------------------------------------
+
+#include "SnapshotProtocol.h"
+
+// Statuses of SnapshotResponse, the HRESULT values of the server.
+#define SNAPSHOT_STATUS_OK              0
+#define SNAPSHOT_STATUS_FAIL            ((int32_t)0x80004005)  // E_FAIL
+#define SNAPSHOT_STATUS_INVALID_REQUEST ((int32_t)0x80070057)  // E_INVALIDARG
+#define SNAPSHOT_STATUS_TIMEOUT         ((int32_t)0x800705B4)  // HRESULT_FROM_WIN32(ERROR_TIMEOUT)
+
+// Wait for a frame when the request does not give a timeout.
+#define SNAPSHOT_DEFAULT_TIMEOUT_MS     2000
+
+//-------------------------------------------------------------------
+//  ISnapshotStream
+//
+//  A connected byte stream. Read and Write transfer all size bytes,
+//  or return false if the connection fails.
+//-------------------------------------------------------------------
+
+struct ISnapshotStream
+{
+    virtual bool Read(void *pData, uint32_t size) = 0;
+    virtual bool Write(const void *pData, uint32_t size) = 0;
+};
+
+//-------------------------------------------------------------------
+//  ISnapshotSource
+//
+//  Provides the frame of a snapshot request, as top-down rows. The
+//  pixels only have to stay valid until the next call. Returns a
+//  negative status if no frame is available within timeoutMs.
+//-------------------------------------------------------------------
+
+struct SnapshotFrame
+{
+    const uint8_t   *pData;
+    uint32_t        format;         // FOURCC, see SnapshotResponse.
+    uint64_t        frameNumber;
+    int64_t         timestamp;
+    uint32_t        width;
+    uint32_t        height;
+    int32_t         stride;         // Positive, at least width * 4.
+};
+
+struct ISnapshotSource
+{
+    virtual int32_t GetSnapshot(bool nextFrame, uint32_t timeoutMs, SnapshotFrame *pFrame) = 0;
+};
+
+bool ServeSnapshotRequest(ISnapshotStream *pStream, ISnapshotSource *pSource);
+int32_t ExchangeSnapshot(ISnapshotStream *pStream, uint32_t command, uint32_t flags,
+    SnapshotResponse *pResponse, uint8_t **ppData);
+
+#ifndef _WIN32
+
+//-------------------------------------------------------------------
+//  CSnapshotSocket
+//
+//  Unix domain socket transport. A listening socket is bound to
+//  path, which is removed again by Close; Accept returns the next
+//  client as a connected CSnapshotSocket.
+//-------------------------------------------------------------------
+
+class CSnapshotSocket : public ISnapshotStream
+{
+public:
+    CSnapshotSocket();
+    ~CSnapshotSocket();
+
+    bool Listen(const char *path);
+    bool Accept(CSnapshotSocket *pConnection, int timeoutMs);
+    bool Connect(const char *path);
+    void Close();
+
+    virtual bool Read(void *pData, uint32_t size);
+    virtual bool Write(const void *pData, uint32_t size);
+
+protected:
+    int         m_fd;
+    char        m_path[108];    // Bound path of a listening socket.
+};
+
+#endif
@@ -0,0 +1,458 @@
+#include "TimelapseFile.h"
+
+#include <string.h>
+
+//-------------------------------------------------------------------
+// Layout
+//
+// The headers have a fixed size, so the fields that change with every
+// frame are updated in place:
+//
+//    0  RIFF <size> AVI
+//   12    LIST <size> hdrl
+//   24      avih <56>
+//   88      LIST <size> strl
+//  100        strh <56>
+//  164        strf <40>  (BITMAPINFOHEADER)
+//  212    LIST <size> movi
+//  224      00dc|00db <size> <frame> ...
+//           idx1 <size> <16 bytes per frame>
+//-------------------------------------------------------------------
+
+static const uint32_t kRiffSizeOffset = 4;
+static const uint32_t kTotalFramesOffset = 48;
+static const uint32_t kMainBufferSizeOffset = 60;
+static const uint32_t kStreamLengthOffset = 140;
+static const uint32_t kStreamBufferSizeOffset = 144;
+static const uint32_t kMoviSizeOffset = 216;
+static const uint32_t kMoviOffset = 220;       // The 'movi' FOURCC, base of idx1 offsets.
+static const uint32_t kHeaderSize = 224;
+
+static const uint32_t kAviKeyFrame = 0x10;     // AVIIF_KEYFRAME
+static const uint32_t kAviHasIndex = 0x10;     // AVIF_HASINDEX
+
+static void PutU16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void PutU32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t GetU32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void PutFourCC(uint8_t *p, const char *fourcc)
+{
+    memcpy(p, fourcc, 4);
+}
+
+static bool IsFourCC(const uint8_t *p, const char *fourcc)
+{
+    return memcmp(p, fourcc, 4) == 0;
+}
+
+static const char* GetChunkId(uint32_t codec)
+{
+    return codec == TIMELAPSE_CODEC_RAW ? "00db" : "00dc";
+}
+
+static bool WriteAt(FILE *file, uint32_t offset, const void *pData, size_t size)
+{
+    return fseek(file, (long)offset, SEEK_SET) == 0 && fwrite(pData, 1, size, file) == size;
+}
+
+static bool WriteU32At(FILE *file, uint32_t offset, uint32_t value)
+{
+    uint8_t buf[4];
+    PutU32(buf, value);
+    return WriteAt(file, offset, buf, sizeof(buf));
+}
+
+//-------------------------------------------------------------------
+// CTimelapseReader
+//-------------------------------------------------------------------
+
+CTimelapseReader::CTimelapseReader()
+{
+    m_file = NULL;
+    memset(&m_format, 0, sizeof(m_format));
+    m_recovered = false;
+}
+
+CTimelapseReader::~CTimelapseReader()
+{
+    Close();
+}
+
+//-------------------------------------------------------------------
+// Open
+//
+// Reads the format and builds the frame index by walking the frame
+// chunks. The walk stops at the first chunk that is not a complete
+// frame, which skips a frame cut short by a crash.
+//-------------------------------------------------------------------
+
+bool CTimelapseReader::Open(const char *path)
+{
+    Close();
+
+    m_file = fopen(path, "rb");
+    if(!m_file)
+    {
+        return false;
+    }
+
+    uint8_t header[kHeaderSize];
+    if(fread(header, 1, sizeof(header), m_file) != sizeof(header) ||
+        !IsFourCC(header, "RIFF") || !IsFourCC(header + 8, "AVI ") ||
+        !IsFourCC(header + 20, "hdrl") || !IsFourCC(header + 24, "avih") ||
+        !IsFourCC(header + 100, "strh") || !IsFourCC(header + 108, "vids") ||
+        !IsFourCC(header + 164, "strf") || !IsFourCC(header + kMoviOffset, "movi"))
+    {
+        Close();
+        return false;
+    }
+
+    uint32_t scale = GetU32(header + 128);
+    uint32_t rate = GetU32(header + 132);
+
+    m_format.width = GetU32(header + 64);
+    m_format.height = GetU32(header + 68);
+    m_format.codec = GetU32(header + 188);
+    // Rounded to whole frames per second, and at least one: files of
+    // other writers may use fractional or very slow rates, and the
+    // writer divides by the rate when it appends to them.
+    m_format.framesPerSecond = scale ? (rate + scale / 2) / scale : 0;
+    if(m_format.framesPerSecond == 0)
+        m_format.framesPerSecond = 1;
+
+    fseek(m_file, 0, SEEK_END);
+    long fileSize = ftell(m_file);
+
+    const char *chunkId = GetChunkId(m_format.codec);
+    uint32_t pos = kHeaderSize;
+
+    while((long)pos + 8 <= fileSize)
+    {
+        uint8_t chunk[8];
+        if(fseek(m_file, (long)pos, SEEK_SET) != 0 || fread(chunk, 1, sizeof(chunk), m_file) != sizeof(chunk))
+        {
+            break;
+        }
+
+        uint32_t size = GetU32(chunk + 4);
+        if(!IsFourCC(chunk, chunkId) || size > (uint32_t)(fileSize - pos - 8))
+        {
+            break;
+        }
+
+        TimelapseIndexEntry entry = { pos + 8, size };
+        m_index.push_back(entry);
+        pos += 8 + ((size + 1) & ~1u);
+    }
+
+    m_recovered = m_index.size() != GetU32(header + kTotalFramesOffset);
+    return true;
+}
+
+void CTimelapseReader::Close()
+{
+    if(m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+    m_index.clear();
+    m_recovered = false;
+}
+
+uint32_t CTimelapseReader::GetFrameSize(uint32_t frame) const
+{
+    return frame < m_index.size() ? m_index[frame].size : 0;
+}
+
+bool CTimelapseReader::ReadFrame(uint32_t frame, void *pData, uint32_t size)
+{
+    if(!m_file || frame >= m_index.size() || size < m_index[frame].size)
+    {
+        return false;
+    }
+
+    const TimelapseIndexEntry &entry = m_index[frame];
+    return fseek(m_file, (long)entry.offset, SEEK_SET) == 0 &&
+        fread(pData, 1, entry.size, m_file) == entry.size;
+}
+
+//-------------------------------------------------------------------
+// CTimelapseWriter
+//-------------------------------------------------------------------
+
+CTimelapseWriter::CTimelapseWriter()
+{
+    m_file = NULL;
+    memset(&m_format, 0, sizeof(m_format));
+    m_moviEnd = kHeaderSize;
+    m_maxFrameSize = 0;
+}
+
+CTimelapseWriter::~CTimelapseWriter()
+{
+    Close();
+}
+
+//-------------------------------------------------------------------
+// Open
+//
+// Creates the file, or appends to an existing time-lapse with the same
+// size and codec (the playback rate of the existing file is kept).
+// An existing file that cannot be read or does not match is left
+// alone and Open fails.
+//-------------------------------------------------------------------
+
+bool CTimelapseWriter::Open(const char *path, const TimelapseFormat &format)
+{
+    Close();
+
+    if(format.width == 0 || format.height == 0)
+    {
+        return false;
+    }
+
+    FILE *existing = fopen(path, "rb");
+    if(existing)
+    {
+        fclose(existing);
+
+        CTimelapseReader reader;
+        if(!reader.Open(path))
+        {
+            return false;
+        }
+
+        const TimelapseFormat &current = reader.GetFormat();
+        if(current.width != format.width || current.height != format.height || current.codec != format.codec)
+        {
+            return false;
+        }
+
+        m_format = current;
+        m_index.swap(reader.m_index);
+        reader.Close();
+
+        m_moviEnd = kHeaderSize;
+        m_maxFrameSize = 0;
+        for(size_t i = 0; i < m_index.size(); i++)
+        {
+            m_moviEnd = m_index[i].offset + ((m_index[i].size + 1) & ~1u);
+            if(m_index[i].size > m_maxFrameSize)
+                m_maxFrameSize = m_index[i].size;
+        }
+
+        m_file = fopen(path, "r+b");
+    }
+    else
+    {
+        m_format = format;
+        if(m_format.framesPerSecond == 0)
+            m_format.framesPerSecond = 25;
+
+        m_file = fopen(path, "w+b");
+    }
+
+    if(!m_file)
+    {
+        return false;
+    }
+
+    // Rebuild idx1 from the frames, which also repairs a file whose
+    // last update was interrupted.
+    m_indexChunk.resize(8 + m_index.size() * 16);
+    PutFourCC(&m_indexChunk[0], "idx1");
+    PutU32(&m_indexChunk[4], (uint32_t)m_index.size() * 16);
+    for(size_t i = 0; i < m_index.size(); i++)
+    {
+        uint8_t *pEntry = &m_indexChunk[8 + i * 16];
+        PutFourCC(pEntry, GetChunkId(m_format.codec));
+        PutU32(pEntry + 4, kAviKeyFrame);
+        PutU32(pEntry + 8, m_index[i].offset - 8 - kMoviOffset);
+        PutU32(pEntry + 12, m_index[i].size);
+    }
+
+    if(!WriteHeaders() ||
+        !WriteAt(m_file, m_moviEnd, &m_indexChunk[0], m_indexChunk.size()) ||
+        !UpdateHeaders() ||
+        fflush(m_file) != 0)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CTimelapseWriter::Close()
+{
+    if(m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+    m_index.clear();
+    m_indexChunk.clear();
+    m_moviEnd = kHeaderSize;
+    m_maxFrameSize = 0;
+}
+
+//-------------------------------------------------------------------
+// IsFull
+//
+// True if a frame of frameSize bytes would take the file past the
+// AVI 1.0 size limit.
+//-------------------------------------------------------------------
+
+bool CTimelapseWriter::IsFull(uint32_t frameSize) const
+{
+    uint64_t end = (uint64_t)m_moviEnd + 8 + frameSize + 1 + m_indexChunk.size() + 16;
+    return end > TIMELAPSE_MAX_FILE_SIZE;
+}
+
+//-------------------------------------------------------------------
+// AddFrame
+//
+// Appends one frame: a JPEG for TIMELAPSE_CODEC_MJPG, or width *
+// height * 4 bytes of bottom-up pixels for TIMELAPSE_CODEC_RAW.
+// The frame data and the new index go behind the last frame first;
+// the chunk header that makes the frame visible to the reader is
+// written last, followed by the counts in the file headers.
+//-------------------------------------------------------------------
+
+bool CTimelapseWriter::AddFrame(const void *pData, uint32_t size)
+{
+    if(!m_file || size == 0 || IsFull(size))
+    {
+        return false;
+    }
+
+    uint32_t chunkPos = m_moviEnd;
+    uint32_t paddedSize = (size + 1) & ~1u;
+    uint8_t pad = 0;
+
+    // Index entry for the new frame.
+    size_t entryPos = m_indexChunk.size();
+    m_indexChunk.resize(entryPos + 16);
+    uint8_t *pEntry = &m_indexChunk[entryPos];
+    PutFourCC(pEntry, GetChunkId(m_format.codec));
+    PutU32(pEntry + 4, kAviKeyFrame);
+    PutU32(pEntry + 8, chunkPos - kMoviOffset);
+    PutU32(pEntry + 12, size);
+    PutU32(&m_indexChunk[4], (uint32_t)(m_indexChunk.size() - 8));
+
+    uint8_t chunk[8];
+    PutFourCC(chunk, GetChunkId(m_format.codec));
+    PutU32(chunk + 4, size);
+
+    bool ok = WriteAt(m_file, chunkPos + 8, pData, size) &&
+        (paddedSize == size || fwrite(&pad, 1, 1, m_file) == 1) &&
+        fwrite(&m_indexChunk[0], 1, m_indexChunk.size(), m_file) == m_indexChunk.size() &&
+        fflush(m_file) == 0 &&
+        WriteAt(m_file, chunkPos, chunk, sizeof(chunk));
+
+    if(!ok)
+    {
+        m_indexChunk.resize(entryPos);
+        PutU32(&m_indexChunk[4], (uint32_t)(m_indexChunk.size() - 8));
+        return false;
+    }
+
+    TimelapseIndexEntry entry = { chunkPos + 8, size };
+    m_index.push_back(entry);
+    m_moviEnd = chunkPos + 8 + paddedSize;
+    if(size > m_maxFrameSize)
+        m_maxFrameSize = size;
+
+    return UpdateHeaders() && fflush(m_file) == 0;
+}
+
+//-------------------------------------------------------------------
+// WriteHeaders
+//
+// Writes the fixed headers; the counts and sizes are filled in by
+// UpdateHeaders.
+//-------------------------------------------------------------------
+
+bool CTimelapseWriter::WriteHeaders()
+{
+    uint8_t h[kHeaderSize];
+    memset(h, 0, sizeof(h));
+
+    bool raw = m_format.codec == TIMELAPSE_CODEC_RAW;
+    uint32_t imageSize = m_format.width * m_format.height * (raw ? 4 : 3);
+
+    PutFourCC(h, "RIFF");
+    PutFourCC(h + 8, "AVI ");
+
+    PutFourCC(h + 12, "LIST");
+    PutU32(h + 16, 212 - 20);
+    PutFourCC(h + 20, "hdrl");
+
+    PutFourCC(h + 24, "avih");
+    PutU32(h + 28, 56);
+    PutU32(h + 32, 1000000 / m_format.framesPerSecond);    // dwMicroSecPerFrame
+    PutU32(h + 44, kAviHasIndex);                           // dwFlags
+    PutU32(h + 56, 1);                                      // dwStreams
+    PutU32(h + 64, m_format.width);
+    PutU32(h + 68, m_format.height);
+
+    PutFourCC(h + 88, "LIST");
+    PutU32(h + 92, 212 - 96);
+    PutFourCC(h + 96, "strl");
+
+    PutFourCC(h + 100, "strh");
+    PutU32(h + 104, 56);
+    PutFourCC(h + 108, "vids");
+    if(raw)
+        PutFourCC(h + 112, "DIB ");
+    else
+        PutU32(h + 112, TIMELAPSE_CODEC_MJPG);
+    PutU32(h + 128, 1);                                     // dwScale
+    PutU32(h + 132, m_format.framesPerSecond);              // dwRate
+    PutU32(h + 148, 0xFFFFFFFF);                            // dwQuality
+    PutU16(h + 160, (uint16_t)m_format.width);              // rcFrame
+    PutU16(h + 162, (uint16_t)m_format.height);
+
+    PutFourCC(h + 164, "strf");
+    PutU32(h + 168, 40);
+    PutU32(h + 172, 40);                                    // biSize
+    PutU32(h + 176, m_format.width);
+    PutU32(h + 180, m_format.height);                       // Bottom-up for raw frames.
+    PutU16(h + 184, 1);                                     // biPlanes
+    PutU16(h + 186, raw ? 32 : 24);                         // biBitCount
+    PutU32(h + 188, m_format.codec);                        // biCompression
+    PutU32(h + 192, imageSize);
+
+    PutFourCC(h + 212, "LIST");
+    PutFourCC(h + kMoviOffset, "movi");
+
+    return WriteAt(m_file, 0, h, sizeof(h));
+}
+
+bool CTimelapseWriter::UpdateHeaders()
+{
+    uint32_t frames = (uint32_t)m_index.size();
+    uint32_t fileEnd = m_moviEnd + (uint32_t)m_indexChunk.size();
+
+    return WriteU32At(m_file, kMoviSizeOffset, m_moviEnd - kMoviOffset) &&
+        WriteU32At(m_file, kTotalFramesOffset, frames) &&
+        WriteU32At(m_file, kStreamLengthOffset, frames) &&
+        WriteU32At(m_file, kMainBufferSizeOffset, m_maxFrameSize) &&
+        WriteU32At(m_file, kStreamBufferSizeOffset, m_maxFrameSize) &&
+        WriteU32At(m_file, kRiffSizeOffset, fileEnd - 8);
+}
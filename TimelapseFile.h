@@ -0,0 +1,107 @@
+#pragma once
+
+//-------------------------------------------------------------------
+//  Time-lapse AVI file
+//
+//  All captures of a time-lapse go into one AVI 1.0 file with a
+//  single video stream, either MJPEG or uncompressed 32-bit frames.
+//  Every AddFrame appends the frame chunk, rewrites the idx1 index
+//  behind it and then updates the frame counts and chunk sizes in
+//  the headers, so the file is complete and playable after each
+//  frame. If the process dies in between, the reader (and appending
+//  to the file later) rebuilds the index by walking the frame chunks,
+//  which loses at most the frame that was being written.
+//
+//  This header and TimelapseFile.cpp only use the C library, so
+//  time-lapse files can be written and read on POSIX systems too.
+//
+//-------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Frame codecs.
+#define TIMELAPSE_CODEC_RAW     0           // Bottom-up 32-bit BGRX, BI_RGB.
+#define TIMELAPSE_CODEC_MJPG    0x47504A4D  // 'MJPG', one JPEG per frame.
+
+// AVI 1.0 readers use signed 32-bit offsets.
+#define TIMELAPSE_MAX_FILE_SIZE 0x7F000000u
+
+struct TimelapseFormat
+{
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    codec;
+    uint32_t    framesPerSecond;    // Playback rate.
+};
+
+struct TimelapseIndexEntry
+{
+    uint32_t    offset;             // Of the frame data in the file.
+    uint32_t    size;
+};
+
+//-------------------------------------------------------------------
+//  CTimelapseReader
+//
+//  Reads files written by CTimelapseWriter.
+//-------------------------------------------------------------------
+
+class CTimelapseReader
+{
+public:
+    CTimelapseReader();
+    ~CTimelapseReader();
+
+    bool Open(const char *path);
+    void Close();
+
+    const TimelapseFormat& GetFormat() const { return m_format; }
+    uint32_t GetFrameCount() const { return (uint32_t)m_index.size(); }
+    uint32_t GetFrameSize(uint32_t frame) const;
+    bool ReadFrame(uint32_t frame, void *pData, uint32_t size);
+
+    // True if the index had to be rebuilt from the frame chunks.
+    bool WasRecovered() const { return m_recovered; }
+
+protected:
+    FILE                *m_file;
+    TimelapseFormat     m_format;
+    std::vector<TimelapseIndexEntry> m_index;
+    bool                m_recovered;
+
+    friend class CTimelapseWriter;
+};
+
+//-------------------------------------------------------------------
+//  CTimelapseWriter
+//-------------------------------------------------------------------
+
+class CTimelapseWriter
+{
+public:
+    CTimelapseWriter();
+    ~CTimelapseWriter();
+
+    bool Open(const char *path, const TimelapseFormat &format);
+    void Close();
+    bool IsOpen() const { return m_file != NULL; }
+    const TimelapseFormat& GetFormat() const { return m_format; }
+
+    bool AddFrame(const void *pData, uint32_t size);
+    bool IsFull(uint32_t frameSize) const;
+    uint32_t GetFrameCount() const { return (uint32_t)m_index.size(); }
+
+protected:
+    FILE                *m_file;
+    TimelapseFormat     m_format;
+    std::vector<TimelapseIndexEntry> m_index;
+    uint32_t            m_moviEnd;          // End of the last frame chunk.
+    uint32_t            m_maxFrameSize;
+    std::vector<uint8_t> m_indexChunk;
+
+    bool WriteHeaders();
+    bool UpdateHeaders();
+};
@@ -30,6 +30,12 @@ CWebcamAccess::CWebcamAccess()
 {
     ZeroMemory(&m_cam_devices, sizeof(m_cam_devices));
     m_pReader = NULL;
+    m_ready = false;
+    m_llTimeStamp = 0;
+    m_burstCount = 1;
+    m_lastSharpness = -1.0;
+    m_stackCount = 1;
+    m_stackThreshold = 0;
 }
 
 
@@ -157,9 +163,13 @@ HRESULT CWebcamAccess::PrepareDevice()
             );
     }
 
-    // Try to find a suitable output type.
+    // Try to find a suitable output type. Types whose frames do not
+    // contain the region of interest are skipped, and if that leaves
+    // none, the region is reported rather than the end of the types.
     if(SUCCEEDED(hr))
     {
+        HRESULT hrRegion = S_OK;
+
         for(DWORD i = 0;; i++)
         {
             hr = m_pReader->GetNativeMediaType(
@@ -168,7 +178,14 @@ HRESULT CWebcamAccess::PrepareDevice()
                 &pType
                 );
 
-            if(FAILED(hr)) { break; }
+            if(FAILED(hr))
+            {
+                if(FAILED(hrRegion))
+                {
+                    hr = hrRegion;
+                }
+                break;
+            }
 
             hr = TryMediaType(pType);
 
@@ -179,6 +196,10 @@ HRESULT CWebcamAccess::PrepareDevice()
                 // Found an output type.
                 break;
             }
+            if(hr == E_INVALIDARG)
+            {
+                hrRegion = hr;
+            }
         }
     }
 
@@ -257,14 +278,187 @@ HRESULT CWebcamAccess::TryMediaType(IMFMediaType *pType)
     return hr;
 }
 
+HRESULT CWebcamAccess::SetRegionOfInterest(const RECT *prc)
+{
+    return m_color_converter.SetRegionOfInterest(prc);
+}
+
+void CWebcamAccess::SetDeinterlaceMode(DeinterlaceMode mode)
+{
+    m_color_converter.SetDeinterlaceMode(mode);
+}
+
+void CWebcamAccess::SetAspectCorrection(bool enable)
+{
+    m_color_converter.SetAspectCorrection(enable);
+}
+
+void CWebcamAccess::SetColorCorrection(ColorCorrection mode, bool continuous)
+{
+    m_color_converter.SetColorCorrection(mode, continuous);
+}
+
+void CWebcamAccess::SetOrientation(Rotation rotation, bool mirror)
+{
+    m_color_converter.SetOrientation(rotation, mirror);
+}
+
+void CWebcamAccess::SetDemosaicMode(DemosaicMode mode)
+{
+    m_color_converter.SetDemosaicMode(mode);
+}
+
+//-------------------------------------------------------------------
+// SetBurstCount
+//
+// With a count above 1, GetImageData, GetTensorData and
+// GetImageStrips read that many samples and convert only the
+// sharpest one, see ReadSharpestSample.
+//-------------------------------------------------------------------
+
+void CWebcamAccess::SetBurstCount(UINT count)
+{
+    m_burstCount = count ? count : 1;
+}
+
+//-------------------------------------------------------------------
+// SetStackCount
+//
+// With a count above 1, GetImageData, GetTensorData and
+// GetImageStrips average that many samples into one before the
+// conversion, see ReadStackedSample. Takes precedence over bursts.
+//-------------------------------------------------------------------
+
+void CWebcamAccess::SetStackCount(UINT count, UINT outlierThreshold)
+{
+    m_stackCount = count ? count : 1;
+    m_stackThreshold = outlierThreshold;
+}
+
+//-------------------------------------------------------------------
+// SetOutputDepth
+//
+// 16 selects 16-bit RGBA output for high bit depth devices, see
+// CColorConverter::SetOutputDepth. Call before PrepareDevice.
+//-------------------------------------------------------------------
+
+void CWebcamAccess::SetOutputDepth(UINT bitsPerChannel)
+{
+    m_color_converter.SetOutputDepth(bitsPerChannel);
+}
+
 void CWebcamAccess::GetImageSizes(unsigned int &width, unsigned int&height)
+{
+    m_color_converter.GetOutputSize(width, height);
+}
+
+void CWebcamAccess::GetFrameSize(unsigned int &width, unsigned int&height)
 {
     width = m_color_converter.m_width;
     height = m_color_converter.m_height;
 }
 
+UINT CWebcamAccess::GetBytesPerPixel() const
+{
+    return m_color_converter.GetOutputBytesPerPixel();
+}
+
+UINT32 CWebcamAccess::GetPixelFormat() const
+{
+    return GetBytesPerPixel() == 8 ? SHARED_FRAME_FORMAT_RGBA64 : SHARED_FRAME_FORMAT_BGRA;
+}
+
+//-------------------------------------------------------------------
+// GetFrameRate
+//
+// Nominal frames per second of the prepared device, 0 if the media
+// type does not say.
+//-------------------------------------------------------------------
+
+double CWebcamAccess::GetFrameRate()
+{
+    IMFMediaType *pType = NULL;
+    UINT32 numerator = 0, denominator = 0;
+
+    if(m_ready && m_pReader && SUCCEEDED(m_pReader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, &pType)))
+    {
+        MFGetAttributeRatio(pType, MF_MT_FRAME_RATE, &numerator, &denominator);
+        SafeRelease(&pType);
+    }
+
+    return denominator ? (double)numerator / denominator : 0.0;
+}
+
 HRESULT CWebcamAccess::GetImageData(BYTE *buffer, LONG stride)
 {
+    IMFMediaBuffer *buf = NULL;
+
+    HRESULT hr = ReadCaptureSample(&buf);
+    if(buf)
+    {
+        hr = ConvertSample(buf, buffer, stride, m_llTimeStamp);
+        buf->Release();
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// GetTensorData
+//
+// Reads the next sample (see ReadCaptureSample) and converts it
+// straight into a caller provided tensor of
+// CColorConverter::GetTensorSize(format) bytes.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::GetTensorData(void *pTensor, const TensorFormat &format)
+{
+    IMFMediaBuffer *buf = NULL;
+
+    HRESULT hr = ReadCaptureSample(&buf);
+    if(buf)
+    {
+        hr = m_color_converter.ConvertImageToTensor(pTensor, format, buf);
+        buf->Release();
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// GetImageStrips
+//
+// Reads the next sample (see ReadCaptureSample) and passes it to
+// pSink in top-down strips of rows as they are converted, see
+// CColorConverter::ConvertImageStrips.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::GetImageStrips(IStripSink *pSink)
+{
+    IMFMediaBuffer *buf = NULL;
+
+    HRESULT hr = ReadCaptureSample(&buf);
+    if(buf)
+    {
+        hr = m_color_converter.ConvertImageStrips(pSink, buf);
+        buf->Release();
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// ReadSample
+//
+// Blocks until the next video sample arrives and returns its data as
+// a contiguous buffer in the native format. The caller releases the
+// buffer. Returns S_FALSE without a buffer if no device is prepared.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::ReadSample(IMFMediaBuffer **ppBuffer, LONGLONG *pllTimeStamp)
+{
+    *ppBuffer = NULL;
+
     if(!m_ready)
         return S_FALSE;
 
@@ -302,14 +496,12 @@ HRESULT CWebcamAccess::GetImageData(BYTE *buffer, LONG stride)
                     hr = videoSample->GetSampleDuration(&llSampleDuration);
                     if(SUCCEEDED(hr))
                     {
-                        IMFMediaBuffer *buf = NULL;
-                        hr = videoSample->ConvertToContiguousBuffer(&buf);
+                        hr = videoSample->ConvertToContiguousBuffer(ppBuffer);
                         if(SUCCEEDED(hr))
                         {
-                            m_color_converter.ConvertImageToRGB32(buffer, stride, buf);
-
-                            buf->Unlock();
-                            buf->Release();
+                            m_llTimeStamp = llVideoTimeStamp;
+                            if(pllTimeStamp)
+                                *pllTimeStamp = llVideoTimeStamp;
                         }
                     }
                 }
@@ -325,3 +517,212 @@ HRESULT CWebcamAccess::GetImageData(BYTE *buffer, LONG stride)
 
     return hr;
 }
+
+//-------------------------------------------------------------------
+// ReadCaptureSample
+//
+// Reads the sample a single capture converts: a stack of samples
+// averaged into one, the sharpest of a burst or just the next one.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::ReadCaptureSample(IMFMediaBuffer **ppBuffer)
+{
+    if(m_stackCount > 1)
+    {
+        return ReadStackedSample(ppBuffer);
+    }
+    return ReadSharpestSample(ppBuffer);
+}
+
+//-------------------------------------------------------------------
+// ReadSharpestSample
+//
+// Reads m_burstCount samples and returns the one whose native luma
+// has the highest focus score, holding a reference to the best one
+// so far. Scoring only touches a quarter of the luma samples and
+// nothing is converted, so a burst costs little more than reading
+// the frames.
+//-------------------------------------------------------------------
+
+static const UINT kFocusStep = 2;
+
+HRESULT CWebcamAccess::ReadSharpestSample(IMFMediaBuffer **ppBuffer)
+{
+    HRESULT hr = ReadSample(ppBuffer);
+    if(m_burstCount <= 1 || !*ppBuffer)
+    {
+        return hr;
+    }
+
+    unsigned int width, height;
+    GetFrameSize(width, height);
+
+    if(FAILED(m_focusMeter.Initialize(width, height, kFocusStep)))
+    {
+        // Too small to score, keep the first frame.
+        return S_OK;
+    }
+
+    double best = -1.0;
+    LONGLONG bestTime = m_llTimeStamp;
+
+    if(SUCCEEDED(SampleLuma(*ppBuffer, m_focusMeter.GetSampleBuffer(), kFocusStep)))
+    {
+        best = m_focusMeter.Measure();
+    }
+
+    for(UINT i = 1; i < m_burstCount; i++)
+    {
+        IMFMediaBuffer *buf = NULL;
+
+        hr = ReadSample(&buf);
+        if(FAILED(hr) || !buf)
+        {
+            break;
+        }
+
+        if(SUCCEEDED(SampleLuma(buf, m_focusMeter.GetSampleBuffer(), kFocusStep)))
+        {
+            double score = m_focusMeter.Measure();
+            if(score > best)
+            {
+                best = score;
+                bestTime = m_llTimeStamp;
+                SafeRelease(ppBuffer);
+                *ppBuffer = buf;
+                buf = NULL;
+            }
+        }
+        SafeRelease(&buf);
+    }
+
+    // Published frames carry the time stamp of the selected sample.
+    m_llTimeStamp = bestTime;
+    m_lastSharpness = best;
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// ReadStackedSample
+//
+// Adds m_stackCount samples to the stacker as they arrive and returns
+// their average as a native sample, so only the result is converted.
+// Every sample is released again once it is added.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::ReadStackedSample(IMFMediaBuffer **ppBuffer)
+{
+    IMFMediaBuffer *buf = NULL;
+    DWORD cbFrame = 0;
+
+    *ppBuffer = NULL;
+
+    HRESULT hr = ReadSample(&buf);
+    if(FAILED(hr) || !buf)
+    {
+        return hr;
+    }
+
+    hr = buf->GetCurrentLength(&cbFrame);
+    if(SUCCEEDED(hr))
+    {
+        hr = m_stacker.Begin(cbFrame, m_color_converter.GetInputBytesPerSample(), m_stackThreshold);
+    }
+    if(SUCCEEDED(hr))
+    {
+        UINT count = min(m_stackCount, m_stacker.GetMaxCount());
+
+        hr = m_stacker.Add(buf);
+        for(UINT i = 1; i < count && SUCCEEDED(hr); i++)
+        {
+            SafeRelease(&buf);
+
+            hr = ReadSample(&buf);
+            if(SUCCEEDED(hr) && buf)
+            {
+                hr = m_stacker.Add(buf);
+            }
+        }
+    }
+    SafeRelease(&buf);
+
+    // Keep what was stacked before a failed read.
+    if(m_stacker.GetCount() > 0)
+    {
+        hr = m_stacker.End(ppBuffer);
+    }
+    return hr;
+}
+
+HRESULT CWebcamAccess::ConvertSample(IMFMediaBuffer *buf, BYTE *buffer, LONG stride, LONGLONG timeStamp)
+{
+    HRESULT hr = m_color_converter.ConvertImageToRGB32(buffer, stride, buf);
+
+    // Frames converted for the caller are published as well.
+    if(SUCCEEDED(hr) && m_publisher.IsOpen())
+    {
+        unsigned int width, height;
+        GetImageSizes(width, height);
+        UINT bpp = GetBytesPerPixel();
+
+        BYTE *pSlot = m_publisher.BeginFrame(width * height * bpp);
+        if(pSlot)
+        {
+            MFCopyImage(pSlot, width * bpp, buffer, stride, width * bpp, height);
+            m_publisher.CommitFrame(GetPixelFormat(), width, height, width * bpp, timeStamp);
+        }
+    }
+    return hr;
+}
+
+HRESULT CWebcamAccess::SampleLuma(IMFMediaBuffer *buf, BYTE *pDest, UINT step)
+{
+    return m_color_converter.SampleLuma(pDest, step, buf);
+}
+
+//-------------------------------------------------------------------
+// EnablePublishing
+//
+// Creates the shared-memory ring that converted frames are published
+// to, see SharedFrame.h. Call after PrepareDevice, since the slots
+// are sized for the output image.
+//-------------------------------------------------------------------
+
+bool CWebcamAccess::EnablePublishing(const char *name, UINT slotCount)
+{
+    unsigned int width, height;
+    GetImageSizes(width, height);
+
+    if(!m_ready || width == 0 || height == 0)
+    {
+        return false;
+    }
+    return m_publisher.Create(name, width * height * GetBytesPerPixel(), slotCount);
+}
+
+//-------------------------------------------------------------------
+// PublishSample
+//
+// Converts a sample straight into the next shared-memory slot.
+//-------------------------------------------------------------------
+
+HRESULT CWebcamAccess::PublishSample(IMFMediaBuffer *buf, LONGLONG timeStamp)
+{
+    unsigned int width, height;
+    GetImageSizes(width, height);
+    UINT bpp = GetBytesPerPixel();
+
+    BYTE *pSlot = m_publisher.BeginFrame(width * height * bpp);
+    if(!pSlot)
+    {
+        return E_UNEXPECTED;
+    }
+
+    // A slot that is not committed is filled again by the next frame.
+    HRESULT hr = m_color_converter.ConvertImageToRGB32(pSlot, width * bpp, buf);
+    if(SUCCEEDED(hr))
+    {
+        m_publisher.CommitFrame(GetPixelFormat(), width, height, width * bpp, timeStamp);
+    }
+    return hr;
+}
@@ -5,6 +5,9 @@
 #include <mfreadwrite.h>
 #include <mferror.h>
 #include "ColorConverter.h"
+#include "SharedFrame.h"
+#include "FocusMeter.h"
+#include "FrameStacker.h"
 
 template <class T> void SafeRelease(T **ppT)
 {
@@ -31,19 +34,54 @@ public:
     HRESULT Initialize();
     bool SetDeviceIndex(unsigned int index);
     HRESULT PrepareDevice();
+    HRESULT SetRegionOfInterest(const RECT *prc);
+    void SetDeinterlaceMode(DeinterlaceMode mode);
+    void SetAspectCorrection(bool enable);
+    void SetOutputDepth(UINT bitsPerChannel);
+    void SetColorCorrection(ColorCorrection mode, bool continuous);
+    void SetOrientation(Rotation rotation, bool mirror);
+    void SetDemosaicMode(DemosaicMode mode);
+    void SetBurstCount(UINT count);
+    void SetStackCount(UINT count, UINT outlierThreshold);
 
     void GetImageSizes(unsigned int &width, unsigned int&height);
+    void GetFrameSize(unsigned int &width, unsigned int&height);
+    UINT GetBytesPerPixel() const;
+    UINT32 GetPixelFormat() const;
+    double GetFrameRate();
     HRESULT GetImageData(BYTE *buffer, LONG stride);
+    HRESULT GetTensorData(void *pTensor, const TensorFormat &format);
+    HRESULT GetImageStrips(IStripSink *pSink);
+    double GetLastSharpness() const { return m_lastSharpness; }  // Of the last burst, -1 if none.
+    UINT GetLastStackCount() const { return m_stacker.GetCount(); }
+
+    HRESULT ReadSample(IMFMediaBuffer **ppBuffer, LONGLONG *pllTimeStamp = NULL);
+    HRESULT ConvertSample(IMFMediaBuffer *buf, BYTE *buffer, LONG stride, LONGLONG timeStamp);
+    HRESULT SampleLuma(IMFMediaBuffer *buf, BYTE *pDest, UINT step);
+
+    bool EnablePublishing(const char *name, UINT slotCount);
+    HRESULT PublishSample(IMFMediaBuffer *buf, LONGLONG timeStamp);
 
 protected:
     ChooseDeviceParam       m_cam_devices;
     IMFSourceReader         *m_pReader;
     CColorConverter         m_color_converter;
     bool                    m_ready;
+    CSharedFrameWriter      m_publisher;
+    LONGLONG                m_llTimeStamp;
+    UINT                    m_burstCount;
+    CFocusMeter             m_focusMeter;
+    double                  m_lastSharpness;
+    UINT                    m_stackCount;
+    UINT                    m_stackThreshold;
+    CFrameStacker           m_stacker;
 
     void ShowErrorMessage(PCWSTR format, HRESULT hrErr);
     HRESULT BuildListOfDevices();
     void CloseDevice();
     HRESULT TryMediaType(IMFMediaType *pType);
+    HRESULT ReadCaptureSample(IMFMediaBuffer **ppBuffer);
+    HRESULT ReadSharpestSample(IMFMediaBuffer **ppBuffer);
+    HRESULT ReadStackedSample(IMFMediaBuffer **ppBuffer);
 };
 
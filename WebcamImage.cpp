@@ -2,7 +2,15 @@
 //
 #include <Windows.h>
 #include <tchar.h>
+#include <stdio.h>
 #include "WebcamAccess.h"
+#include "MotionDetector.h"
+#include "SnapshotServer.h"
+#include "ImageWriter.h"
+#include "TimelapseFile.h"
+#include "FrameHistory.h"
+#include "CapturePipeline.h"
+#include "WriteQueue.h"
 
 void CreateBitmapFile(LPCWSTR fileName, long width, long height, WORD bitsPerPixel, BYTE * bitmapData, DWORD bitmapDataLength)
 {
@@ -51,34 +59,996 @@ int fileExists(TCHAR * file)
     return found;
 }
 
+//-------------------------------------------------------------------
+// GetNextFileName
+//
+// Finds the first of sample.ext, sample0.ext, sample1.ext, ... that does
+// not exist yet. The index is kept between calls so continuous capture
+// does not probe every existing file again for each frame.
+//-------------------------------------------------------------------
+
+void GetNextFileName(TCHAR *filename, LPCTSTR ext)
+{
+    static int i = -1;
+
+    if(i < 0)
+    {
+        _stprintf(filename, L"sample.%s", ext);
+        i = 0;
+        if(!fileExists(filename))
+            return;
+    }
+
+    do
+    {
+        _stprintf(filename, L"sample%d.%s", i++, ext);
+    } while(fileExists(filename));
+}
+
+static CTimelapseWriter g_timelapse;
+
+// Write-behind output of continuous modes, see -writequeue.
+static CWriteBehindQueue g_writeQueue;
+
+// File type of single captures, see -format.
+enum ImageFileType
+{
+    ImageFile_Bmp,
+    ImageFile_Png,
+    ImageFile_Jpeg
+};
+
+static ImageFileType g_imageFileType = ImageFile_Bmp;
+
+//-------------------------------------------------------------------
+// WriteDataFile
+//-------------------------------------------------------------------
+
+HRESULT WriteDataFile(LPCTSTR filename, const void *data, DWORD size)
+{
+    HANDLE file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    DWORD written = 0;
+    HRESULT hr = S_OK;
+    if(!WriteFile(file, data, size, &written, NULL))
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    CloseHandle(file);
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// EncodeOutputImage / WriteOutputImage
+//
+// The two halves of SaveImage, so that continuous capture can encode
+// one frame while the previous one is written. buf holds bottom-up
+// rows of bpp bytes per pixel. 8-bit BGRA goes to the time-lapse file
+// if one is open, otherwise to a file of the -format type. 16-bit
+// RGBA always goes to a png since the others cannot hold it.
+//
+// EncodeOutputImage returns the compressed image in a new[] buffer,
+// or NULL if the output stores the pixels as they are (bmp files and
+// raw time-lapse frames).
+//
+// While the write-behind queue runs, WriteOutputImage hands files to
+// it instead of writing them: it takes over the encoded buffer and
+// sets *ppEncoded to NULL, and a bmp is built with its headers in
+// front of a copy of the pixels so that it is written in one piece.
+//-------------------------------------------------------------------
+
+static bool IsJpegOutput(unsigned int bpp)
+{
+    return bpp == 4 && (g_timelapse.IsOpen() ? g_timelapse.GetFormat().codec == TIMELAPSE_CODEC_MJPG :
+        g_imageFileType == ImageFile_Jpeg);
+}
+
+HRESULT EncodeOutputImage(const BYTE *buf, unsigned int width, unsigned int height, unsigned int bpp,
+    BYTE **ppEncoded, DWORD *pcbEncoded)
+{
+    *ppEncoded = NULL;
+    *pcbEncoded = 0;
+
+    if(bpp == 4 && (g_timelapse.IsOpen() ? !IsJpegOutput(bpp) : g_imageFileType == ImageFile_Bmp))
+        return S_OK;
+
+    return EncodeImage(IsJpegOutput(bpp) ? GUID_ContainerFormatJpeg : GUID_ContainerFormatPng,
+        bpp == 8 ? GUID_WICPixelFormat64bppRGBA : GUID_WICPixelFormat32bppBGR,
+        width, height, buf + (height - 1) * width * bpp, width * -(LONG)bpp, ppEncoded, pcbEncoded);
+}
+
+static DWORD BuildBitmapFile(BYTE *pFile, long width, long height, const BYTE *bitmapData)
+{
+    BITMAPFILEHEADER *pFileHeader = (BITMAPFILEHEADER*)pFile;
+    BITMAPINFOHEADER *pInfo = (BITMAPINFOHEADER*)(pFile + sizeof(BITMAPFILEHEADER));
+    DWORD cbHeaders = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    DWORD cbPixels = width * height * 4;
+
+    ZeroMemory(pFile, cbHeaders);
+    pFileHeader->bfType = 19778;
+    pFileHeader->bfSize = cbHeaders + cbPixels;
+    pFileHeader->bfOffBits = cbHeaders;
+    pInfo->biSize = sizeof(BITMAPINFOHEADER);
+    pInfo->biWidth = width;
+    pInfo->biHeight = height;
+    pInfo->biPlanes = 1;
+    pInfo->biBitCount = 32;
+    pInfo->biCompression = BI_RGB;
+    pInfo->biSizeImage = cbPixels;
+    pInfo->biXPelsPerMeter = 2400;
+    pInfo->biYPelsPerMeter = 2400;
+
+    memcpy(pFile + cbHeaders, bitmapData, cbPixels);
+    return cbHeaders + cbPixels;
+}
+
+HRESULT WriteOutputImage(BYTE *buf, unsigned int width, unsigned int height, unsigned int bpp,
+    BYTE **ppEncoded, DWORD cbEncoded)
+{
+    TCHAR filename[100];
+    BYTE *pEncoded = *ppEncoded;
+
+    if(bpp == 4 && g_timelapse.IsOpen())
+    {
+        bool added = pEncoded ? g_timelapse.AddFrame(pEncoded, cbEncoded) :
+            g_timelapse.AddFrame(buf, width * height * 4);
+        if(!added)
+        {
+            _tprintf(L"Cannot add frame %u to the time-lapse file\n", g_timelapse.GetFrameCount());
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+    if(pEncoded)
+    {
+        GetNextFileName(filename, IsJpegOutput(bpp) ? L"jpg" : L"png");
+
+        if(g_writeQueue.IsRunning())
+        {
+            *ppEncoded = NULL;
+            return g_writeQueue.Enqueue(filename, pEncoded, cbEncoded);
+        }
+
+        HRESULT hr = WriteDataFile(filename, pEncoded, cbEncoded);
+        if(FAILED(hr))
+            _tprintf(L"Cannot write %s (hr=0x%X)\n", filename, hr);
+        return hr;
+    }
+
+    GetNextFileName(filename, L"bmp");
+
+    if(g_writeQueue.IsRunning())
+    {
+        BYTE *pFile = g_writeQueue.AllocateBuffer(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + width * height * 4);
+        DWORD cbFile = BuildBitmapFile(pFile, width, height, buf);
+        return g_writeQueue.Enqueue(filename, pFile, cbFile);
+    }
+
+    CreateBitmapFile(filename, width, height, 32, buf, width * height * 4);
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// SaveImage
+//
+// Encodes and writes one image, see EncodeOutputImage.
+//-------------------------------------------------------------------
+
+void SaveImage(BYTE *buf, unsigned int width, unsigned int height, unsigned int bpp)
+{
+    BYTE *encoded = NULL;
+    DWORD size = 0;
+
+    HRESULT hr = EncodeOutputImage(buf, width, height, bpp, &encoded, &size);
+    if(SUCCEEDED(hr))
+        WriteOutputImage(buf, width, height, bpp, &encoded, size);
+    else
+        _tprintf(L"Cannot encode the image (hr=0x%X)\n", hr);
+
+    delete[] encoded;
+}
+
+//-------------------------------------------------------------------
+// CaptureImageFile
+//
+// Captures one frame into a file of the -format type, the same file
+// SaveImage would write. The frame is converted in strips that go
+// straight to the encoder, so no full size image buffer is needed.
+//-------------------------------------------------------------------
+
+HRESULT CaptureImageFile(CWebcamAccess &wa, unsigned int width, unsigned int height, unsigned int bpp)
+{
+    TCHAR filename[100];
+    HRESULT hr;
+
+    if(bpp == 4 && g_imageFileType == ImageFile_Bmp)
+    {
+        CBitmapStripWriter writer;
+
+        GetNextFileName(filename, L"bmp");
+        hr = writer.Open(filename, width, height);
+        if(SUCCEEDED(hr))
+            hr = wa.GetImageStrips(&writer);
+        if(SUCCEEDED(hr))
+            hr = writer.Commit();
+    }
+    else
+    {
+        CWicStripWriter writer;
+        bool jpeg = bpp == 4 && g_imageFileType == ImageFile_Jpeg;
+
+        GetNextFileName(filename, jpeg ? L"jpg" : L"png");
+        hr = writer.Open(filename, jpeg ? GUID_ContainerFormatJpeg : GUID_ContainerFormatPng,
+            bpp == 8 ? GUID_WICPixelFormat64bppRGBA : GUID_WICPixelFormat32bppBGR, width, height);
+        if(SUCCEEDED(hr))
+            hr = wa.GetImageStrips(&writer);
+        if(SUCCEEDED(hr))
+            hr = writer.Commit();
+    }
+
+    if(FAILED(hr))
+        _tprintf(L"Cannot write %s (hr=0x%X)\n", filename, hr);
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// SaveTensor
+//
+// Writes a raw tensor (see -tensor) to the next sampleN.tensor file.
+//-------------------------------------------------------------------
+
+void SaveTensor(const void *data, DWORD size)
+{
+    TCHAR filename[100];
+    GetNextFileName(filename, L"tensor");
+
+    WriteDataFile(filename, data, size);
+}
+
+static volatile bool g_stop = false;
+
+BOOL WINAPI ConsoleCtrlHandler(DWORD ctrlType)
+{
+    g_stop = true;
+    return TRUE;
+}
+
+//-------------------------------------------------------------------
+// CFileOutput
+//
+// The encode and write stages of the capture pipeline, the same files
+// SaveImage writes.
+//-------------------------------------------------------------------
+
+class CFileOutput : public IPipelineOutput
+{
+public:
+    virtual HRESULT EncodeFrame(PipelineFrame *pFrame)
+    {
+        return EncodeOutputImage(pFrame->pPixels, pFrame->width, pFrame->height, pFrame->bpp,
+            &pFrame->pEncoded, &pFrame->cbEncoded);
+    }
+
+    virtual HRESULT WriteFrame(PipelineFrame *pFrame)
+    {
+        return WriteOutputImage(pFrame->pPixels, pFrame->width, pFrame->height, pFrame->bpp,
+            &pFrame->pEncoded, pFrame->cbEncoded);
+    }
+};
+
+// Frames in flight between capture and disk in continuous modes.
+static const UINT kPipelineFrames = 4;
+
+void PrintPipelineStats(const CCapturePipeline &pipeline)
+{
+    for(int i = 0; i < PipelineStage_Count; i++)
+    {
+        PipelineStageStats stats;
+        pipeline.GetStats((PipelineStage)i, &stats);
+
+        UINT64 count = stats.frames + stats.failures;
+        _tprintf(L"%-8s %6I64u frames, %6.2f ms per frame, %8.1f ms waiting, queue %.2f average, %u max",
+            CCapturePipeline::GetStageName((PipelineStage)i), stats.frames,
+            count ? stats.busyMs / count : 0.0, stats.waitMs, stats.averageDepth, stats.maxDepth);
+        if(stats.failures)
+            _tprintf(L", %I64u failed", stats.failures);
+        _tprintf(L"\n");
+    }
+}
+
+void PrintWriteQueueStats()
+{
+    WriteQueueStats stats;
+    g_writeQueue.GetStats(&stats);
+
+    _tprintf(L"write queue %I64u files, %.1f MB, queue %.2f average, %u max, latency %.1f/%.1f/%.1f ms (50/90/99%%), %.1f ms max\n",
+        stats.files, stats.bytes / 1048576.0, stats.averageDepth, stats.maxDepth,
+        stats.latency50Ms, stats.latency90Ms, stats.latency99Ms, stats.latencyMaxMs);
+    if(stats.blockedCount)
+        _tprintf(L"capture waited %I64u times for a full write queue, %.1f ms\n", stats.blockedCount, stats.blockedMs);
+    if(stats.syncCount)
+        _tprintf(L"%I64u flushes, %.1f ms per flush\n", stats.syncCount, stats.syncMs / stats.syncCount);
+    if(stats.failures)
+        _tprintf(L"%I64u files could not be written\n", stats.failures);
+}
+
+//-------------------------------------------------------------------
+// RunMotionCapture
+//
+// Continuous mode: compares the subsampled native luma of every frame
+// against the reference and only passes frames that exceed the motion
+// threshold on to the pipeline, which converts and saves them on its
+// own threads. Runs until Ctrl+C and reports how much time was spent
+// on frames that were rejected.
+//-------------------------------------------------------------------
+
+void RunMotionCapture(CWebcamAccess &wa, CMotionDetector &detector, CCapturePipeline &pipeline, bool publish)
+{
+    LARGE_INTEGER freq, start, end;
+    LONGLONG rejectedTicks = 0;
+    unsigned int rejected = 0;
+    unsigned int saved = 0;
+
+    QueryPerformanceFrequency(&freq);
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+    while(!g_stop)
+    {
+        IMFMediaBuffer *sample = NULL;
+        LONGLONG timeStamp = 0;
+
+        HRESULT hr = wa.ReadSample(&sample, &timeStamp);
+        if(FAILED(hr) || !sample)
+            break;
+
+        QueryPerformanceCounter(&start);
+
+        hr = wa.SampleLuma(sample, detector.GetSampleBuffer(), detector.GetStep());
+        if(SUCCEEDED(hr) && detector.Update())
+        {
+            pipeline.Submit(sample, timeStamp);
+            saved++;
+
+            _tprintf(L"Motion %.2f, saved frame %u\n", detector.GetLastDifference(), saved);
+        }
+        else
+        {
+            QueryPerformanceCounter(&end);
+            rejectedTicks += end.QuadPart - start.QuadPart;
+            rejected++;
+
+            // Published by the convert stage, which may be converting a
+            // saved frame right now.
+            if(publish)
+                pipeline.Publish(sample, timeStamp);
+
+            if(rejected % 100 == 0)
+            {
+                _tprintf(L"%u frames rejected, %.1f us per rejected frame\n",
+                    rejected, rejectedTicks * 1e6 / freq.QuadPart / rejected);
+            }
+        }
+
+        sample->Release();
+    }
+
+    pipeline.Stop();
+
+    _tprintf(L"%u frames saved, %u frames rejected", saved, rejected);
+    if(rejected)
+    {
+        _tprintf(L", %.1f us per rejected frame", rejectedTicks * 1e6 / freq.QuadPart / rejected);
+    }
+    _tprintf(L"\n");
+    PrintPipelineStats(pipeline);
+}
+
+//-------------------------------------------------------------------
+// RunPublishing
+//
+// Continuous mode: converts every frame into the shared-memory ring
+// for local consumers, without writing files, until Ctrl+C.
+//-------------------------------------------------------------------
+
+void RunPublishing(CWebcamAccess &wa)
+{
+    unsigned int published = 0;
+
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+    while(!g_stop)
+    {
+        IMFMediaBuffer *sample = NULL;
+        LONGLONG timeStamp = 0;
+
+        HRESULT hr = wa.ReadSample(&sample, &timeStamp);
+        if(FAILED(hr) || !sample)
+            break;
+
+        if(SUCCEEDED(wa.PublishSample(sample, timeStamp)))
+            published++;
+
+        sample->Release();
+    }
+
+    _tprintf(L"%u frames published\n", published);
+}
+
+//-------------------------------------------------------------------
+// CHistoryFileSink
+//
+// Saves the frames of a pre-trigger event like any other capture.
+// Runs on the writer thread of CFrameHistory, so the conversion and
+// the file writes overlap with the capture loop.
+//-------------------------------------------------------------------
+
+class CHistoryFileSink : public IHistorySink
+{
+public:
+    CHistoryFileSink(CWebcamAccess &wa, BYTE *buf, unsigned int width, unsigned int height, unsigned int bpp)
+        : m_wa(wa), m_buf(buf), m_width(width), m_height(height), m_bpp(bpp)
+    {
+    }
+
+    virtual HRESULT WriteHistoryFrame(IMFMediaBuffer *sample, LONGLONG timeStamp, UINT64 frameNumber)
+    {
+        HRESULT hr = m_wa.ConvertSample(sample, m_buf + (m_height - 1) * m_width * m_bpp, m_width * -(LONG)m_bpp, timeStamp);
+        if(SUCCEEDED(hr))
+        {
+            SaveImage(m_buf, m_width, m_height, m_bpp);
+        }
+        return hr;
+    }
+
+protected:
+    CWebcamAccess   &m_wa;
+    BYTE            *m_buf;
+    unsigned int    m_width;
+    unsigned int    m_height;
+    unsigned int    m_bpp;
+};
+
+static void GetTriggerEventName(LPCWSTR name, TCHAR *eventName, size_t cchEventName)
+{
+    _sntprintf(eventName, cchEventName, L"Local\\WebcamImageTrigger.%s", name);
+    eventName[cchEventName - 1] = 0;
+}
+
+static bool GetLastWriteTime(LPCWSTR path, FILETIME *pTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    if(!GetFileAttributesEx(path, GetFileExInfoStandard, &data))
+        return false;
+    *pTime = data.ftLastWriteTime;
+    return true;
+}
+
+//-------------------------------------------------------------------
+// RunPreTrigger
+//
+// Continuous mode: keeps the native samples of the last seconds in
+// the history ring until a trigger fires, then saves them and the
+// frames that follow while capture goes on. Triggers are the named
+// event (set by -firetrigger from another process) and, if given, a
+// change of the last write time of triggerFile. Runs until Ctrl+C.
+//-------------------------------------------------------------------
+
+void RunPreTrigger(CWebcamAccess &wa, CFrameHistory &history, HANDLE hTrigger, LPCWSTR triggerFile)
+{
+    FILETIME fileTime = { 0, 0 }, newFileTime;
+    bool haveFileTime = triggerFile && GetLastWriteTime(triggerFile, &fileTime);
+    ULONGLONG nextFileCheck = 0;
+    UINT64 frames = 0;
+
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+    while(!g_stop)
+    {
+        IMFMediaBuffer *sample = NULL;
+        LONGLONG timeStamp = 0;
+
+        HRESULT hr = wa.ReadSample(&sample, &timeStamp);
+        if(FAILED(hr) || !sample)
+            break;
+
+        history.AddSample(sample, timeStamp);
+        sample->Release();
+        frames++;
+
+        bool fire = hTrigger && WaitForSingleObject(hTrigger, 0) == WAIT_OBJECT_0;
+
+        // Touching the file fires too; its time stamp is checked a few
+        // times per second rather than for every frame.
+        if(triggerFile && GetTickCount64() >= nextFileCheck)
+        {
+            nextFileCheck = GetTickCount64() + 250;
+            if(GetLastWriteTime(triggerFile, &newFileTime))
+            {
+                if(haveFileTime && CompareFileTime(&newFileTime, &fileTime) != 0)
+                    fire = true;
+                fileTime = newFileTime;
+                haveFileTime = true;
+            }
+        }
+
+        if(fire)
+        {
+            _tprintf(L"Trigger at frame %I64u\n", frames);
+            history.Trigger();
+        }
+    }
+
+    history.Shutdown();
+
+    _tprintf(L"%u events, %I64u frames saved, %I64u lost, %I64u dropped\n", history.GetEventCount(),
+        history.GetWrittenCount(), history.GetLostCount(), history.GetDroppedCount());
+}
+
+//-------------------------------------------------------------------
+// FireTrigger
+//
+// Fires the trigger of a -pretrigger instance waiting on name.
+//-------------------------------------------------------------------
+
+int FireTrigger(LPCWSTR name)
+{
+    TCHAR eventName[MAX_PATH];
+    GetTriggerEventName(name, eventName, ARRAYSIZE(eventName));
+
+    HANDLE hTrigger = OpenEvent(EVENT_MODIFY_STATE, FALSE, eventName);
+    if(!hTrigger)
+    {
+        _tprintf(L"No -pretrigger instance is waiting on %s\n", name);
+        return 1;
+    }
+
+    SetEvent(hTrigger);
+    CloseHandle(hTrigger);
+    return 0;
+}
+
+//-------------------------------------------------------------------
+// RunSnapshotClient
+//
+// Asks a resident server (-serve) for a frame and saves it, or stops
+// the server. Does not touch the capture device itself.
+//-------------------------------------------------------------------
+
+int RunSnapshotClient(LPCWSTR channel, uint32_t command, uint32_t flags)
+{
+    SnapshotResponse response;
+    BYTE *data = NULL;
+
+    HRESULT hr = RequestSnapshot(channel, command, flags, &response, &data);
+    if(FAILED(hr))
+    {
+        _tprintf(L"Snapshot request failed (hr=0x%X)\n", hr);
+        return 1;
+    }
+
+    if(data)
+    {
+        unsigned int width = response.width;
+        unsigned int height = response.height;
+        unsigned int bpp = response.format == SHARED_FRAME_FORMAT_RGBA64 ? 8 : 4;
+        BYTE *buf = new BYTE[width * height * bpp];
+
+        // The server sends top-down rows, SaveImage takes bottom-up ones.
+        MFCopyImage(buf + (height - 1) * width * bpp, width * -(LONG)bpp, data, response.stride, width * bpp, height);
+        SaveImage(buf, width, height, bpp);
+
+        _tprintf(L"Frame %I64u, server latency %u us\n", response.frameNumber, response.latencyUs);
+
+        delete[] buf;
+        delete[] data;
+    }
+
+    return 0;
+}
+
 int _tmain(int argc, _TCHAR* argv[])
 {
+    RECT roi;
+    bool useRoi = false;
+    double motionThreshold = -1.0;
+    UINT motionStep = 8;
+    RECT motionRegions[16];
+    int numMotionRegions = 0;
+    DeinterlaceMode deinterlace = Deinterlace_Auto;
+    bool aspectCorrection = true;
+    UINT outputDepth = 8;
+    ColorCorrection colorCorrection = ColorCorrection_None;
+    Rotation rotation = Rotation_0;
+    char timelapsePath[MAX_PATH] = "";
+    TimelapseFormat timelapse = { 0, 0, TIMELAPSE_CODEC_MJPG, 25 };
+    bool mirror = false;
+    DemosaicMode demosaic = Demosaic_Bilinear;
+    TensorFormat tensor = { 0, 0, TensorLayout_CHW, TensorData_Float32, false, { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+    char publishName[MAX_PATH] = "";
+    LPCWSTR serveChannel = NULL;
+    LPCWSTR clientChannel = NULL;
+    uint32_t clientCommand = SnapshotCommand_Snapshot;
+    uint32_t clientFlags = 0;
+    double preTriggerSeconds = 0.0;
+    double postTriggerSeconds = -1.0;
+    LPCWSTR triggerName = L"WebcamImage";
+    LPCWSTR triggerFile = NULL;
+    LPCWSTR fireTriggerName = NULL;
+    UINT burst = 1;
+    UINT stack = 1;
+    UINT stackThreshold = 0;
+    UINT writeQueueLimit = 16;
+    UINT writeSyncEvery = 0;
+
+    for(int arg = 1; arg < argc; arg++)
+    {
+        LONG x, y, w, h;
+
+        if(_tcscmp(argv[arg], L"-roi") == 0 && arg + 1 < argc)
+        {
+            // -roi left,top,width,height
+            if(_stscanf(argv[++arg], L"%ld,%ld,%ld,%ld", &x, &y, &w, &h) == 4)
+            {
+                SetRect(&roi, x, y, x + w, y + h);
+                useRoi = true;
+            }
+            else
+            {
+                _tprintf(L"Invalid -roi %s, expected left,top,width,height\n", argv[arg]);
+                return 1;
+            }
+        }
+        else if(_tcscmp(argv[arg], L"-deinterlace") == 0 && arg + 1 < argc)
+        {
+            // -deinterlace auto|weave|bob|blend
+            arg++;
+            if(_tcscmp(argv[arg], L"weave") == 0 || _tcscmp(argv[arg], L"none") == 0)
+                deinterlace = Deinterlace_Weave;
+            else if(_tcscmp(argv[arg], L"bob") == 0)
+                deinterlace = Deinterlace_Bob;
+            else if(_tcscmp(argv[arg], L"blend") == 0)
+                deinterlace = Deinterlace_Blend;
+            else
+                deinterlace = Deinterlace_Auto;
+        }
+        else if(_tcscmp(argv[arg], L"-noaspect") == 0)
+        {
+            aspectCorrection = false;
+        }
+        else if(_tcscmp(argv[arg], L"-timelapse") == 0 && arg + 1 < argc)
+        {
+            WideCharToMultiByte(CP_ACP, 0, argv[++arg], -1, timelapsePath, sizeof(timelapsePath), NULL, NULL);
+        }
+        else if(_tcscmp(argv[arg], L"-timelapseraw") == 0)
+        {
+            timelapse.codec = TIMELAPSE_CODEC_RAW;
+        }
+        else if(_tcscmp(argv[arg], L"-timelapsefps") == 0 && arg + 1 < argc)
+        {
+            timelapse.framesPerSecond = _tstoi(argv[++arg]);
+        }
+        else if(_tcscmp(argv[arg], L"-rotate") == 0 && arg + 1 < argc)
+        {
+            // -rotate 0|90|180|270, clockwise
+            switch(_tstoi(argv[++arg]))
+            {
+            case 90: rotation = Rotation_90; break;
+            case 180: rotation = Rotation_180; break;
+            case 270: rotation = Rotation_270; break;
+            default: rotation = Rotation_0; break;
+            }
+        }
+        else if(_tcscmp(argv[arg], L"-demosaic") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(_tcscmp(argv[arg], L"edge") == 0)
+                demosaic = Demosaic_EdgeAware;
+            else if(_tcscmp(argv[arg], L"superpixel") == 0)
+                demosaic = Demosaic_Superpixel;
+            else
+                demosaic = Demosaic_Bilinear;
+        }
+        else if(_tcscmp(argv[arg], L"-mirror") == 0)
+        {
+            mirror = true;
+        }
+        else if(_tcscmp(argv[arg], L"-autocolor") == 0 && arg + 1 < argc)
+        {
+            // -autocolor levels|grayworld|whitepatch|none
+            arg++;
+            if(_tcscmp(argv[arg], L"levels") == 0)
+                colorCorrection = ColorCorrection_Levels;
+            else if(_tcscmp(argv[arg], L"grayworld") == 0)
+                colorCorrection = ColorCorrection_GrayWorld;
+            else if(_tcscmp(argv[arg], L"whitepatch") == 0)
+                colorCorrection = ColorCorrection_WhitePatch;
+            else
+                colorCorrection = ColorCorrection_None;
+        }
+        else if(_tcscmp(argv[arg], L"-format") == 0 && arg + 1 < argc)
+        {
+            // -format bmp|png|jpg
+            arg++;
+            if(_tcscmp(argv[arg], L"png") == 0)
+                g_imageFileType = ImageFile_Png;
+            else if(_tcscmp(argv[arg], L"jpg") == 0 || _tcscmp(argv[arg], L"jpeg") == 0)
+                g_imageFileType = ImageFile_Jpeg;
+            else
+                g_imageFileType = ImageFile_Bmp;
+        }
+        else if(_tcscmp(argv[arg], L"-burst") == 0 && arg + 1 < argc)
+        {
+            burst = _tstoi(argv[++arg]);
+        }
+        else if(_tcscmp(argv[arg], L"-stack") == 0 && arg + 1 < argc)
+        {
+            // -stack n[,threshold]
+            _stscanf(argv[++arg], L"%u,%u", &stack, &stackThreshold);
+        }
+        else if(_tcscmp(argv[arg], L"-writequeue") == 0 && arg + 1 < argc)
+        {
+            // -writequeue n[,syncevery]
+            writeSyncEvery = 0;
+            _stscanf(argv[++arg], L"%u,%u", &writeQueueLimit, &writeSyncEvery);
+        }
+        else if(_tcscmp(argv[arg], L"-16bit") == 0)
+        {
+            outputDepth = 16;
+        }
+        else if(_tcscmp(argv[arg], L"-tensor") == 0 && arg + 1 < argc)
+        {
+            // -tensor width,height[,hwc][,f16][,bgr]
+            arg++;
+            if(_stscanf(argv[arg], L"%u,%u", &tensor.width, &tensor.height) == 2)
+            {
+                if(_tcsstr(argv[arg], L"hwc"))
+                    tensor.layout = TensorLayout_HWC;
+                if(_tcsstr(argv[arg], L"f16"))
+                    tensor.dataType = TensorData_Float16;
+                if(_tcsstr(argv[arg], L"bgr"))
+                    tensor.bgrOrder = true;
+            }
+        }
+        else if(_tcscmp(argv[arg], L"-tensornorm") == 0 && arg + 1 < argc)
+        {
+            // -tensornorm mean0,mean1,mean2,std0,std1,std2
+            _stscanf(argv[++arg], L"%f,%f,%f,%f,%f,%f", &tensor.mean[0], &tensor.mean[1], &tensor.mean[2],
+                &tensor.std[0], &tensor.std[1], &tensor.std[2]);
+        }
+        else if(_tcscmp(argv[arg], L"-publish") == 0 && arg + 1 < argc)
+        {
+            WideCharToMultiByte(CP_ACP, 0, argv[++arg], -1, publishName, sizeof(publishName), NULL, NULL);
+        }
+        else if(_tcscmp(argv[arg], L"-serve") == 0 && arg + 1 < argc)
+        {
+            serveChannel = argv[++arg];
+        }
+        else if(_tcscmp(argv[arg], L"-snapshot") == 0 && arg + 1 < argc)
+        {
+            clientChannel = argv[++arg];
+            clientCommand = SnapshotCommand_Snapshot;
+        }
+        else if(_tcscmp(argv[arg], L"-stopserver") == 0 && arg + 1 < argc)
+        {
+            clientChannel = argv[++arg];
+            clientCommand = SnapshotCommand_Quit;
+        }
+        else if(_tcscmp(argv[arg], L"-next") == 0)
+        {
+            clientFlags |= SNAPSHOT_FLAG_NEXT_FRAME;
+        }
+        else if(_tcscmp(argv[arg], L"-pretrigger") == 0 && arg + 1 < argc)
+        {
+            // -pretrigger seconds[,postseconds]
+            _stscanf(argv[++arg], L"%lf,%lf", &preTriggerSeconds, &postTriggerSeconds);
+        }
+        else if(_tcscmp(argv[arg], L"-trigger") == 0 && arg + 1 < argc)
+        {
+            triggerName = argv[++arg];
+        }
+        else if(_tcscmp(argv[arg], L"-triggerfile") == 0 && arg + 1 < argc)
+        {
+            triggerFile = argv[++arg];
+        }
+        else if(_tcscmp(argv[arg], L"-firetrigger") == 0 && arg + 1 < argc)
+        {
+            fireTriggerName = argv[++arg];
+        }
+        else if(_tcscmp(argv[arg], L"-motion") == 0 && arg + 1 < argc)
+        {
+            motionThreshold = _tstof(argv[++arg]);
+        }
+        else if(_tcscmp(argv[arg], L"-motionstep") == 0 && arg + 1 < argc)
+        {
+            motionStep = _tstoi(argv[++arg]);
+        }
+        else if(_tcscmp(argv[arg], L"-motionregion") == 0 && arg + 1 < argc)
+        {
+            // -motionregion left,top,width,height, may be repeated
+            if(_stscanf(argv[++arg], L"%ld,%ld,%ld,%ld", &x, &y, &w, &h) == 4 && numMotionRegions < (int)ARRAYSIZE(motionRegions))
+            {
+                SetRect(&motionRegions[numMotionRegions++], x, y, x + w, y + h);
+            }
+        }
+    }
+
     CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
 
+    if(clientChannel)
+    {
+        return RunSnapshotClient(clientChannel, clientCommand, clientFlags);
+    }
+    if(fireTriggerName)
+    {
+        return FireTrigger(fireTriggerName);
+    }
+
     CWebcamAccess wa;
     wa.Initialize();
-    wa.PrepareDevice();
+    if(useRoi && FAILED(wa.SetRegionOfInterest(&roi)))
+    {
+        _tprintf(L"Invalid region of interest %ld,%ld %ldx%ld\n", roi.left, roi.top, roi.right - roi.left, roi.bottom - roi.top);
+        return 1;
+    }
+    wa.SetDeinterlaceMode(deinterlace);
+    wa.SetAspectCorrection(aspectCorrection);
+    wa.SetOutputDepth(outputDepth);
+    wa.SetOrientation(rotation, mirror);
+    wa.SetDemosaicMode(demosaic);
+    wa.SetBurstCount(burst);
+    wa.SetStackCount(stack, stackThreshold);
+    // Capture loops reuse the statistics of the previous frames.
+    wa.SetColorCorrection(colorCorrection, motionThreshold >= 0.0 || publishName[0] != 0 || serveChannel != NULL ||
+        preTriggerSeconds > 0.0);
+    if(wa.PrepareDevice() == E_INVALIDARG && useRoi)
+    {
+        _tprintf(L"The region of interest lies outside of the frames of the device\n");
+        return 1;
+    }
     unsigned int width, height;
     wa.GetImageSizes(width, height);
+    unsigned int bpp = wa.GetBytesPerPixel();
+
+    // Only pre-trigger events and time-lapses keep whole frames
+    // around; motion capture has its own pipeline frames.
+    BYTE *buf = NULL;
+    if(preTriggerSeconds > 0.0 || timelapsePath[0])
+        buf = new BYTE[width * height * bpp];
 
-    int buflen = width * height * 4;
-    BYTE *buf = new BYTE[buflen];
+    if(timelapsePath[0])
+    {
+        timelapse.width = width;
+        timelapse.height = height;
 
-    // bmps are stored bottom-up, GetImageData always retrieves top-down, so pass pointer to last line
-    // and set negative stride
-    wa.GetImageData(buf + (height - 1) * width * 4, width * -4);
+        if(bpp != 4 || !g_timelapse.Open(timelapsePath, timelapse))
+        {
+            _tprintf(L"Cannot open time-lapse file %S for %ux%u frames\n", timelapsePath, width, height);
+            delete[] buf;
+            return 1;
+        }
+    }
 
-    TCHAR filename[100] = L"sample.bmp";
-    int i = 0;
-    while(fileExists(filename))
+    bool publish = false;
+    if(publishName[0])
     {
-        _stprintf(filename, L"sample%d.bmp", i++);
+        publish = wa.EnablePublishing(publishName, 4);
+        if(!publish)
+            _tprintf(L"Cannot create shared memory %S\n", publishName);
     }
 
-    CreateBitmapFile(filename, width, height, 32, buf, buflen);
+    // Continuous modes write files behind the capture; the time-lapse
+    // file is appended to by the write stage itself.
+    if(!serveChannel && (preTriggerSeconds > 0.0 || motionThreshold >= 0.0) && writeQueueLimit > 0 &&
+        !g_timelapse.IsOpen())
+    {
+        HRESULT hr = g_writeQueue.Start(writeQueueLimit, writeSyncEvery);
+        if(FAILED(hr))
+            _tprintf(L"Cannot start the write queue (hr=0x%X), writing directly\n", hr);
+    }
 
+    if(serveChannel)
+    {
+        CSnapshotServer server(wa);
+
+        SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+        HRESULT hr = server.Run(serveChannel, &g_stop);
+        if(FAILED(hr))
+            _tprintf(L"Snapshot server stopped (hr=0x%X)\n", hr);
+    }
+    else if(preTriggerSeconds > 0.0)
+    {
+        double fps = wa.GetFrameRate();
+        if(fps <= 0.0)
+            fps = 30.0;
+        if(postTriggerSeconds < 0.0)
+            postTriggerSeconds = preTriggerSeconds;
+
+        TCHAR eventName[MAX_PATH];
+        GetTriggerEventName(triggerName, eventName, ARRAYSIZE(eventName));
+        HANDLE hTrigger = CreateEvent(NULL, FALSE, FALSE, eventName);
+        if(!hTrigger)
+            _tprintf(L"Cannot create trigger event %s\n", eventName);
+
+        CHistoryFileSink sink(wa, buf, width, height, bpp);
+        CFrameHistory history;
+        UINT preFrames = (UINT)(preTriggerSeconds * fps + 0.5);
+        UINT postFrames = (UINT)(postTriggerSeconds * fps + 0.5);
+
+        if(SUCCEEDED(history.Initialize(preFrames > 0 ? preFrames : 1, postFrames, &sink)))
+        {
+            _tprintf(L"Keeping %u frames before and %u frames after a trigger\n", preFrames, postFrames);
+            RunPreTrigger(wa, history, hTrigger, triggerFile);
+        }
+
+        if(hTrigger)
+            CloseHandle(hTrigger);
+    }
+    else if(motionThreshold >= 0.0)
+    {
+        CMotionDetector detector;
+        unsigned int frameWidth, frameHeight;
+        wa.GetFrameSize(frameWidth, frameHeight);
+
+        if(SUCCEEDED(detector.Initialize(frameWidth, frameHeight, motionStep)))
+        {
+            detector.SetThreshold(motionThreshold);
+            for(int i = 0; i < numMotionRegions; i++)
+            {
+                detector.AddRegion(&motionRegions[i]);
+            }
+
+            CFileOutput output;
+            CCapturePipeline pipeline(wa);
+
+            if(SUCCEEDED(pipeline.Start(kPipelineFrames, &output)))
+                RunMotionCapture(wa, detector, pipeline, publish);
+        }
+    }
+    else if(publish)
+    {
+        RunPublishing(wa);
+    }
+    else if(tensor.width && tensor.height)
+    {
+        DWORD size = CColorConverter::GetTensorSize(tensor);
+        BYTE *data = new BYTE[size];
+
+        HRESULT hr = wa.GetTensorData(data, tensor);
+        if(SUCCEEDED(hr))
+            SaveTensor(data, size);
+        else
+            _tprintf(L"Tensor conversion failed (hr=0x%X)\n", hr);
+
+        delete[] data;
+    }
+    else if(g_timelapse.IsOpen())
+    {
+        // bmps are stored bottom-up, GetImageData always retrieves top-down, so pass pointer to last line
+        // and set negative stride
+        wa.GetImageData(buf + (height - 1) * width * bpp, width * -(LONG)bpp);
+
+        SaveImage(buf, width, height, bpp);
+    }
+    else
+    {
+        CaptureImageFile(wa, width, height, bpp);
+    }
+
+    if(g_writeQueue.IsRunning())
+    {
+        g_writeQueue.Stop();
+        PrintWriteQueueStats();
+    }
+
+    if(wa.GetLastStackCount() > 1)
+        _tprintf(L"Averaged %u frames\n", wa.GetLastStackCount());
+    else if(wa.GetLastSharpness() >= 0.0)
+        _tprintf(L"Kept the sharpest of %u frames, focus score %.1f\n", burst, wa.GetLastSharpness());
+
+    g_timelapse.Close();
     delete[] buf;
 
 	return 0;
 }
-
@@ -0,0 +1,482 @@
+#include "WriteQueue.h"
+
+#include <math.h>
+
+CWriteBehindQueue::CWriteBehindQueue()
+{
+    m_maxQueued = 0;
+    m_syncEvery = 0;
+    m_hThread = NULL;
+    m_hWork = NULL;
+    m_pending = 0;
+    m_stop = false;
+    m_files = 0;
+    m_failures = 0;
+    m_bytes = 0;
+    m_enqueued = 0;
+    m_depthSum = 0;
+    m_maxDepth = 0;
+    m_blockedCount = 0;
+    m_blockedTicks = 0;
+    m_latencyMaxTicks = 0;
+    m_firstUnsyncedTime = 0;
+    m_syncCount = 0;
+    m_syncTicks = 0;
+
+    ZeroMemory(m_latencyCounts, sizeof(m_latencyCounts));
+    for(UINT i = 0; i < kMaxWritesInFlight; i++)
+    {
+        m_inFlight[i] = NULL;
+        m_hDone[i] = NULL;
+    }
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_frequency = freq.QuadPart;
+
+    InitializeCriticalSection(&m_lock);
+    InitializeConditionVariable(&m_spaceFree);
+}
+
+CWriteBehindQueue::~CWriteBehindQueue()
+{
+    Stop();
+
+    for(size_t i = 0; i < m_spare.size(); i++)
+    {
+        delete[] m_spare[i].pData;
+    }
+
+    for(UINT i = 0; i < kMaxWritesInFlight; i++)
+    {
+        if(m_hDone[i])
+            CloseHandle(m_hDone[i]);
+    }
+    if(m_hWork)
+        CloseHandle(m_hWork);
+
+    DeleteCriticalSection(&m_lock);
+}
+
+//-------------------------------------------------------------------
+// Start
+//
+// Starts the I/O thread. maxQueued is the number of files that may be
+// queued or in flight before Enqueue waits; syncEvery is the number
+// of files flushed together, 0 to leave flushing to the system.
+//-------------------------------------------------------------------
+
+HRESULT CWriteBehindQueue::Start(UINT maxQueued, UINT syncEvery)
+{
+    if(m_hWork || maxQueued == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_maxQueued = maxQueued;
+    m_syncEvery = syncEvery;
+
+    m_hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(!m_hWork)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // OVERLAPPED events have to be manual-reset; WriteFile resets them.
+    for(UINT i = 0; i < kMaxWritesInFlight; i++)
+    {
+        m_hDone[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if(!m_hDone[i])
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    m_hThread = CreateThread(NULL, 0, IoThreadProc, this, 0, NULL);
+    if(!m_hThread)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Stop
+//
+// Waits until every queued file is written and flushed, then ends the
+// I/O thread.
+//-------------------------------------------------------------------
+
+void CWriteBehindQueue::Stop()
+{
+    if(!m_hThread)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&m_lock);
+    m_stop = true;
+    LeaveCriticalSection(&m_lock);
+    SetEvent(m_hWork);
+
+    WaitForSingleObject(m_hThread, INFINITE);
+    CloseHandle(m_hThread);
+    m_hThread = NULL;
+}
+
+//-------------------------------------------------------------------
+// AllocateBuffer
+//
+// Returns a new[] buffer of at least cb bytes for Enqueue, reusing
+// the buffer of a completed write if one is large enough.
+//-------------------------------------------------------------------
+
+BYTE* CWriteBehindQueue::AllocateBuffer(DWORD cb)
+{
+    BYTE *pData = NULL;
+
+    EnterCriticalSection(&m_lock);
+    for(size_t i = 0; i < m_spare.size(); i++)
+    {
+        if(m_spare[i].cbData >= cb)
+        {
+            pData = m_spare[i].pData;
+            m_spare[i] = m_spare.back();
+            m_spare.pop_back();
+            break;
+        }
+    }
+    LeaveCriticalSection(&m_lock);
+
+    return pData ? pData : new BYTE[cb];
+}
+
+//-------------------------------------------------------------------
+// Enqueue
+//
+// Queues cbData bytes of pData to be written to fileName. The queue
+// owns pData from here on, also if the call fails. Only waits while
+// the queue is full.
+//-------------------------------------------------------------------
+
+HRESULT CWriteBehindQueue::Enqueue(LPCWSTR fileName, BYTE *pData, DWORD cbData)
+{
+    if(!m_hThread || wcslen(fileName) >= MAX_PATH)
+    {
+        delete[] pData;
+        return m_hThread ? E_INVALIDARG : E_UNEXPECTED;
+    }
+
+    WriteRequest *pRequest = new WriteRequest;
+    wcscpy_s(pRequest->fileName, MAX_PATH, fileName);
+    pRequest->pData = pData;
+    pRequest->cbData = cbData;
+    pRequest->hFile = INVALID_HANDLE_VALUE;
+
+    EnterCriticalSection(&m_lock);
+
+    UINT depth = m_pending;
+    m_enqueued++;
+    m_depthSum += depth;
+    if(depth > m_maxDepth)
+        m_maxDepth = depth;
+
+    if(m_pending >= m_maxQueued)
+    {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+
+        while(m_pending >= m_maxQueued)
+        {
+            SleepConditionVariableCS(&m_spaceFree, &m_lock, INFINITE);
+        }
+
+        QueryPerformanceCounter(&end);
+        m_blockedTicks += end.QuadPart - start.QuadPart;
+        m_blockedCount++;
+    }
+
+    // Latency counts from here, the time waited for space is reported
+    // separately.
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    pRequest->queuedTicks = now.QuadPart;
+
+    m_queue.push_back(pRequest);
+    m_pending++;
+
+    LeaveCriticalSection(&m_lock);
+
+    SetEvent(m_hWork);
+    return S_OK;
+}
+
+void CWriteBehindQueue::GetStats(WriteQueueStats *pStats)
+{
+    EnterCriticalSection(&m_lock);
+
+    pStats->files = m_files;
+    pStats->failures = m_failures;
+    pStats->bytes = m_bytes;
+    pStats->averageDepth = m_enqueued ? (double)m_depthSum / m_enqueued : 0.0;
+    pStats->maxDepth = m_maxDepth;
+    pStats->blockedCount = m_blockedCount;
+    pStats->blockedMs = m_blockedTicks * 1000.0 / m_frequency;
+    pStats->latency50Ms = GetLatencyPercentile(0.50);
+    pStats->latency90Ms = GetLatencyPercentile(0.90);
+    pStats->latency99Ms = GetLatencyPercentile(0.99);
+    pStats->latencyMaxMs = m_latencyMaxTicks * 1000.0 / m_frequency;
+
+    LeaveCriticalSection(&m_lock);
+
+    // Written by the I/O thread only, complete once it has stopped.
+    pStats->syncCount = m_syncCount;
+    pStats->syncMs = m_syncTicks * 1000.0 / m_frequency;
+}
+
+//-------------------------------------------------------------------
+// GetLatencyPercentile
+//
+// Latencies are counted in buckets of a quarter octave, so the upper
+// bound of the bucket returned is at most 19% above the exact value.
+// Called with m_lock held.
+//-------------------------------------------------------------------
+
+double CWriteBehindQueue::GetLatencyPercentile(double fraction) const
+{
+    UINT64 total = 0;
+    for(UINT i = 0; i < kLatencyBuckets; i++)
+    {
+        total += m_latencyCounts[i];
+    }
+    if(total == 0)
+    {
+        return 0.0;
+    }
+
+    UINT64 target = (UINT64)ceil(fraction * total);
+    UINT64 count = 0;
+    UINT i = 0;
+    for(; i < kLatencyBuckets - 1; i++)
+    {
+        count += m_latencyCounts[i];
+        if(count >= target)
+            break;
+    }
+
+    double upperMs = pow(2.0, (i + 1) / 4.0) / 1000.0;
+    double maxMs = m_latencyMaxTicks * 1000.0 / m_frequency;
+    return upperMs < maxMs ? upperMs : maxMs;
+}
+
+//-------------------------------------------------------------------
+// I/O thread
+//
+// Keeps up to kMaxWritesInFlight overlapped writes going and waits
+// for the next request, a completed write or the sync deadline.
+// Completion events are manual-reset and stay set until the slot is
+// reused, so a write that completes while another one is handled is
+// picked up by the next wait.
+//-------------------------------------------------------------------
+
+DWORD WINAPI CWriteBehindQueue::IoThreadProc(LPVOID pParam)
+{
+    ((CWriteBehindQueue*)pParam)->IoLoop();
+    return 0;
+}
+
+void CWriteBehindQueue::IoLoop()
+{
+    for(;;)
+    {
+        WriteRequest *pNext[kMaxWritesInFlight];
+        UINT freeSlots = 0, started = 0;
+
+        for(UINT i = 0; i < kMaxWritesInFlight; i++)
+        {
+            if(!m_inFlight[i])
+                freeSlots++;
+        }
+
+        EnterCriticalSection(&m_lock);
+        while(started < freeSlots && !m_queue.empty())
+        {
+            pNext[started++] = m_queue.front();
+            m_queue.pop_front();
+        }
+        bool stopping = m_stop && m_queue.empty();
+        LeaveCriticalSection(&m_lock);
+
+        for(UINT i = 0, slot = 0; i < started; i++, slot++)
+        {
+            while(m_inFlight[slot])
+            {
+                slot++;
+            }
+            StartWrite(slot, pNext[i]);
+        }
+
+        HANDLE handles[1 + kMaxWritesInFlight];
+        UINT slots[1 + kMaxWritesInFlight];
+        UINT count = 0;
+
+        handles[count++] = m_hWork;
+        for(UINT i = 0; i < kMaxWritesInFlight; i++)
+        {
+            if(m_inFlight[i])
+            {
+                slots[count] = i;
+                handles[count++] = m_hDone[i];
+            }
+        }
+
+        if(stopping && count == 1)
+        {
+            break;
+        }
+
+        DWORD timeout = INFINITE;
+        if(!m_unsynced.empty())
+        {
+            ULONGLONG elapsed = GetTickCount64() - m_firstUnsyncedTime;
+            timeout = elapsed >= kSyncIntervalMs ? 0 : (DWORD)(kSyncIntervalMs - elapsed);
+        }
+
+        DWORD result = WaitForMultipleObjects(count, handles, FALSE, timeout);
+        if(result > WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + count)
+        {
+            UINT slot = slots[result - WAIT_OBJECT_0];
+            WriteRequest *pRequest = m_inFlight[slot];
+            DWORD written = 0;
+
+            bool succeeded = GetOverlappedResult(pRequest->hFile, &pRequest->overlapped, &written, FALSE) &&
+                written == pRequest->cbData;
+            FinishWrite(slot, succeeded);
+        }
+
+        if(!m_unsynced.empty() && (m_unsynced.size() >= m_syncEvery ||
+            GetTickCount64() - m_firstUnsyncedTime >= kSyncIntervalMs))
+        {
+            SyncFiles();
+        }
+    }
+
+    SyncFiles();
+}
+
+//-------------------------------------------------------------------
+// StartWrite
+//
+// Creates the file and issues the write of the whole buffer. Its
+// completion, also an immediate one, is reported by the event of the
+// slot.
+//-------------------------------------------------------------------
+
+void CWriteBehindQueue::StartWrite(UINT slot, WriteRequest *pRequest)
+{
+    m_inFlight[slot] = pRequest;
+
+    pRequest->hFile = CreateFile(pRequest->fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+    if(pRequest->hFile == INVALID_HANDLE_VALUE)
+    {
+        FinishWrite(slot, false);
+        return;
+    }
+
+    ZeroMemory(&pRequest->overlapped, sizeof(pRequest->overlapped));
+    pRequest->overlapped.hEvent = m_hDone[slot];
+
+    if(!WriteFile(pRequest->hFile, pRequest->pData, pRequest->cbData, NULL, &pRequest->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        FinishWrite(slot, false);
+    }
+}
+
+void CWriteBehindQueue::FinishWrite(UINT slot, bool succeeded)
+{
+    WriteRequest *pRequest = m_inFlight[slot];
+    m_inFlight[slot] = NULL;
+
+    if(pRequest->hFile != INVALID_HANDLE_VALUE)
+    {
+        if(succeeded && m_syncEvery)
+        {
+            if(m_unsynced.empty())
+                m_firstUnsyncedTime = GetTickCount64();
+            m_unsynced.push_back(pRequest->hFile);
+        }
+        else
+        {
+            CloseHandle(pRequest->hFile);
+        }
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    LONGLONG latency = now.QuadPart - pRequest->queuedTicks;
+    double us = latency * 1e6 / m_frequency;
+    UINT bucket = us < 1.0 ? 0 : (UINT)(4.0 * log(us) / log(2.0));
+
+    EnterCriticalSection(&m_lock);
+
+    if(succeeded)
+    {
+        m_files++;
+        m_bytes += pRequest->cbData;
+    }
+    else
+    {
+        m_failures++;
+    }
+
+    m_latencyCounts[bucket < kLatencyBuckets ? bucket : kLatencyBuckets - 1]++;
+    if(latency > m_latencyMaxTicks)
+        m_latencyMaxTicks = latency;
+
+    if(m_spare.size() < m_maxQueued)
+    {
+        SpareBuffer spare = { pRequest->pData, pRequest->cbData };
+        m_spare.push_back(spare);
+    }
+    else
+    {
+        delete[] pRequest->pData;
+    }
+
+    m_pending--;
+    WakeAllConditionVariable(&m_spaceFree);
+
+    LeaveCriticalSection(&m_lock);
+
+    delete pRequest;
+}
+
+//-------------------------------------------------------------------
+// SyncFiles
+//
+// Flushes and closes the files written since the last batch.
+//-------------------------------------------------------------------
+
+void CWriteBehindQueue::SyncFiles()
+{
+    if(m_unsynced.empty())
+    {
+        return;
+    }
+
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    for(size_t i = 0; i < m_unsynced.size(); i++)
+    {
+        FlushFileBuffers(m_unsynced[i]);
+        CloseHandle(m_unsynced[i]);
+    }
+    m_unsynced.clear();
+
+    QueryPerformanceCounter(&end);
+    m_syncTicks += end.QuadPart - start.QuadPart;
+    m_syncCount++;
+}
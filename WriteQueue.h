@@ -0,0 +1,121 @@
+#pragma once
+
+#include <Windows.h>
+#include <deque>
+#include <vector>
+
+struct WriteQueueStats
+{
+    UINT64      files;              // Files written completely.
+    UINT64      failures;
+    UINT64      bytes;
+    double      averageDepth;       // Files queued or in flight seen by each Enqueue.
+    UINT        maxDepth;
+    UINT64      blockedCount;       // Enqueue calls that waited for a full queue.
+    double      blockedMs;
+    UINT64      syncCount;          // FlushFileBuffers batches.
+    double      syncMs;
+    double      latency50Ms;        // Enqueue to completed write, percentiles.
+    double      latency90Ms;
+    double      latency99Ms;
+    double      latencyMaxMs;
+};
+
+//-------------------------------------------------------------------
+//  CWriteBehindQueue class
+//
+//  Write-behind output for continuous capture. Enqueue takes over a
+//  finished file image, header and data in one buffer, and returns at
+//  once; a dedicated I/O thread creates the files and writes them
+//  with overlapped I/O, a few at a time, so a slow SD card or network
+//  share stalls this thread instead of the capture. Enqueue only
+//  waits when maxQueued files are queued or being written.
+//
+//  Each file is written with a single WriteFile of its buffer, which
+//  is why the caller puts the header in front of the data instead of
+//  writing them separately (WriteFileGather would need unbuffered,
+//  page aligned I/O). Completed buffers are kept for AllocateBuffer
+//  to reuse, so steady capture does not allocate.
+//
+//  With syncEvery, the handles of written files stay open and are
+//  flushed with FlushFileBuffers in batches of syncEvery files, or
+//  after a second at the latest, instead of one flush per file.
+//
+//-------------------------------------------------------------------
+
+class CWriteBehindQueue
+{
+public:
+    CWriteBehindQueue();
+    ~CWriteBehindQueue();
+
+    HRESULT Start(UINT maxQueued, UINT syncEvery);
+    void Stop();
+    bool IsRunning() const { return m_hThread != NULL; }
+
+    BYTE* AllocateBuffer(DWORD cb);
+    HRESULT Enqueue(LPCWSTR fileName, BYTE *pData, DWORD cbData);
+
+    void GetStats(WriteQueueStats *pStats);
+
+protected:
+    struct WriteRequest
+    {
+        WCHAR           fileName[MAX_PATH];
+        BYTE            *pData;         // new[], owned by the request.
+        DWORD           cbData;
+        LONGLONG        queuedTicks;
+        HANDLE          hFile;
+        OVERLAPPED      overlapped;
+    };
+
+    struct SpareBuffer
+    {
+        BYTE            *pData;
+        DWORD           cbData;
+    };
+
+    static const UINT kMaxWritesInFlight = 4;
+    static const DWORD kSyncIntervalMs = 1000;
+    static const UINT kLatencyBuckets = 128;   // Quarter octaves of microseconds.
+
+    UINT                        m_maxQueued;
+    UINT                        m_syncEvery;
+    HANDLE                      m_hThread;
+    HANDLE                      m_hWork;        // Auto-reset, set after each Enqueue.
+    LONGLONG                    m_frequency;
+
+    CRITICAL_SECTION            m_lock;
+    CONDITION_VARIABLE          m_spaceFree;
+
+    // Guarded by m_lock.
+    std::deque<WriteRequest*>   m_queue;
+    std::vector<SpareBuffer>    m_spare;
+    UINT                        m_pending;      // Queued and in flight.
+    bool                        m_stop;
+    UINT64                      m_files;
+    UINT64                      m_failures;
+    UINT64                      m_bytes;
+    UINT64                      m_enqueued;
+    UINT64                      m_depthSum;
+    UINT                        m_maxDepth;
+    UINT64                      m_blockedCount;
+    LONGLONG                    m_blockedTicks;
+    UINT64                      m_latencyCounts[kLatencyBuckets];
+    LONGLONG                    m_latencyMaxTicks;
+
+    // Used by the I/O thread only.
+    WriteRequest                *m_inFlight[kMaxWritesInFlight];
+    HANDLE                      m_hDone[kMaxWritesInFlight];
+    std::vector<HANDLE>         m_unsynced;
+    ULONGLONG                   m_firstUnsyncedTime;
+    UINT64                      m_syncCount;
+    LONGLONG                    m_syncTicks;
+
+    static DWORD WINAPI IoThreadProc(LPVOID pParam);
+    void IoLoop();
+    void StartWrite(UINT slot, WriteRequest *pRequest);
+    void FinishWrite(UINT slot, bool succeeded);
+    void SyncFiles();
+    double GetLatencyPercentile(double fraction) const;
+};
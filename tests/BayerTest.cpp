@@ -0,0 +1,428 @@
+//-------------------------------------------------------------------
+// BayerTest
+//
+// Demosaics synthetic raw Bayer frames with the SSE2 kernels and
+// compares every pixel with a scalar reference of the same filters:
+// all four patterns, 8-bit and 16-bit samples, bilinear, edge-aware
+// and superpixel demosaicing, 8-bit and 16-bit output, and regions of
+// interest at the frame edges, where the mirrored padding is used.
+//-------------------------------------------------------------------
+
+#include "ConvertKernels.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static const char* const kPatternNames[] = { "none", "RGGB", "GRBG", "GBRG", "BGGR" };
+static const char* const kModeNames[] = { "bilinear", "edge-aware", "superpixel" };
+
+enum SampleColor
+{
+    Color_Red,
+    Color_Green,
+    Color_Blue
+};
+
+enum FrameContent
+{
+    Content_Random,
+    Content_Flat,
+    Content_VerticalEdge,
+    Content_HorizontalEdge,
+    Content_DiagonalEdge
+};
+
+static const char* const kContentNames[] = { "random", "flat", "vertical edge", "horizontal edge", "diagonal edge" };
+
+// Intensities of the flat frames, chosen so the 8-bit samples keep them.
+static const WORD kFlatColor[3] = { 0xC000, 0x8000, 0x3000 };
+
+//-------------------------------------------------------------------
+// CRawFrame
+//
+// A raw frame of cbSample bytes per sample. Rows are padded, so a
+// kernel that ignores the stride fails.
+//-------------------------------------------------------------------
+
+class CRawFrame
+{
+public:
+    CRawFrame(BayerPattern pattern, DWORD cbSample, LONG width, LONG height, FrameContent content) :
+        m_cbSample(cbSample), m_width(width), m_height(height)
+    {
+        m_redX = (pattern == Bayer_GRBG || pattern == Bayer_BGGR) ? 1 : 0;
+        m_redY = (pattern == Bayer_GBRG || pattern == Bayer_BGGR) ? 1 : 0;
+        m_stride = (LONG)(width * cbSample + 12);
+        m_data.resize(m_stride * height);
+
+        uint32_t seed = width * 131 + height + pattern * 7 + cbSample;
+        for(LONG y = 0; y < height; y++)
+        {
+            for(LONG x = 0; x < width; x++)
+            {
+                seed = seed * 1664525 + 1013904223;
+                WORD v = (WORD)(seed >> 16);
+                bool bright = false;
+
+                switch(content)
+                {
+                case Content_Random:
+                    break;
+                case Content_Flat:
+                    v = kFlatColor[GetColor(x, y)];
+                    break;
+                case Content_VerticalEdge:
+                    bright = x > width / 2;
+                    break;
+                case Content_HorizontalEdge:
+                    bright = y > height / 2;
+                    break;
+                case Content_DiagonalEdge:
+                    bright = x + y > (width + height) / 2;
+                    break;
+                }
+                if(content > Content_Flat)
+                {
+                    // Saturated edges make the gradient corrections
+                    // overshoot, so the clamping is checked too.
+                    v = bright ? 0xFFFF : (GetColor(x, y) == Color_Green ? 0x0800 : 0);
+                }
+
+                if(cbSample == 1)
+                    m_data[y * m_stride + x] = (BYTE)(v >> 8);
+                else
+                    ((WORD*)&m_data[y * m_stride])[x] = v;
+            }
+        }
+    }
+
+    SampleColor GetColor(LONG x, LONG y) const
+    {
+        bool redRow = (y & 1) == m_redY;
+        bool redColumn = (x & 1) == m_redX;
+
+        if(redRow && redColumn)
+            return Color_Red;
+        if(!redRow && !redColumn)
+            return Color_Blue;
+        return Color_Green;
+    }
+
+    // 14-bit sample, with the rows and columns mirrored at the edges.
+    int Sample(LONG x, LONG y) const
+    {
+        x = Mirror(x, m_width);
+        y = Mirror(y, m_height);
+        if(m_cbSample == 1)
+            return m_data[y * m_stride + x] << 6;
+        return ((const WORD*)&m_data[y * m_stride])[x] >> 2;
+    }
+
+    static LONG Mirror(LONG i, LONG size)
+    {
+        if(i < 0)
+            i = -i;
+        if(i >= size)
+            i = 2 * size - 2 - i;
+        return i;
+    }
+
+    DWORD                   m_cbSample;
+    LONG                    m_width;
+    LONG                    m_height;
+    LONG                    m_stride;
+    LONG                    m_redX;
+    LONG                    m_redY;
+    std::vector<BYTE>       m_data;
+};
+
+//-------------------------------------------------------------------
+// Scalar reference
+//-------------------------------------------------------------------
+
+static int Average(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+static int Clamp14(int v)
+{
+    return v < 0 ? 0 : (v > 16383 ? 16383 : v);
+}
+
+static int Abs(int v)
+{
+    return v < 0 ? -v : v;
+}
+
+static void StorePixel(int r, int g, int b, bool wide, BYTE *pOut)
+{
+    if(wide)
+    {
+        WORD *pPel = (WORD*)pOut;
+        pPel[0] = (WORD)((r << 2) | (r >> 12));
+        pPel[1] = (WORD)((g << 2) | (g >> 12));
+        pPel[2] = (WORD)((b << 2) | (b >> 12));
+        pPel[3] = 0xFFFF;
+    }
+    else
+    {
+        pOut[0] = (BYTE)(((b + 32) >> 6) > 255 ? 255 : (b + 32) >> 6);
+        pOut[1] = (BYTE)(((g + 32) >> 6) > 255 ? 255 : (g + 32) >> 6);
+        pOut[2] = (BYTE)(((r + 32) >> 6) > 255 ? 255 : (r + 32) >> 6);
+        pOut[3] = 0;
+    }
+}
+
+static void ReferencePixel(const CRawFrame& frame, LONG x, LONG y, DemosaicMode mode, bool wide, BYTE *pOut)
+{
+    int c = frame.Sample(x, y);
+    int w = frame.Sample(x - 1, y);
+    int e = frame.Sample(x + 1, y);
+    int n = frame.Sample(x, y - 1);
+    int s = frame.Sample(x, y + 1);
+    int h = Average(w, e);
+    int v = Average(n, s);
+    int diag = Average(
+        Average(frame.Sample(x - 1, y - 1), frame.Sample(x + 1, y - 1)),
+        Average(frame.Sample(x - 1, y + 1), frame.Sample(x + 1, y + 1)));
+
+    int greenAtSite, otherAtSite, ownAtGreen, otherAtGreen;
+
+    if(mode == Demosaic_EdgeAware)
+    {
+        int h2 = Average(frame.Sample(x - 2, y), frame.Sample(x + 2, y));
+        int v2 = Average(frame.Sample(x, y - 2), frame.Sample(x, y + 2));
+        int dh2 = c - h2;
+        int dv2 = c - v2;
+        int dd = c - diag;
+
+        int gH = Clamp14(h + (dh2 >> 1));
+        int gV = Clamp14(v + (dv2 >> 1));
+        int gradH = (Abs(w - e) >> 1) + Abs(dh2);
+        int gradV = (Abs(n - s) >> 1) + Abs(dv2);
+        greenAtSite = gradH < gradV ? gH : (gradV < gradH ? gV : Average(gH, gV));
+
+        int d4 = c - Average(h2, v2);
+        otherAtSite = diag + (d4 >> 1) + (d4 >> 2);
+        ownAtGreen = h + (dd >> 1) + (dh2 >> 2) - (dv2 >> 3);
+        otherAtGreen = v + (dd >> 1) + (dv2 >> 2) - (dh2 >> 3);
+    }
+    else
+    {
+        greenAtSite = Average(h, v);
+        otherAtSite = diag;
+        ownAtGreen = h;
+        otherAtGreen = v;
+    }
+
+    SampleColor color = frame.GetColor(x, y);
+    bool site = color != Color_Green;
+    bool redRow = (y & 1) == frame.m_redY;
+
+    int g = Clamp14(site ? greenAtSite : c);
+    int own = Clamp14(site ? c : ownAtGreen);
+    int other = Clamp14(site ? otherAtSite : otherAtGreen);
+
+    StorePixel(redRow ? own : other, g, redRow ? other : own, wide, pOut);
+}
+
+static void ReferenceSuperpixel(const CRawFrame& frame, LONG x, LONG y, bool wide, BYTE *pOut)
+{
+    int cell[2][2];
+    for(LONG dy = 0; dy < 2; dy++)
+    {
+        for(LONG dx = 0; dx < 2; dx++)
+        {
+            cell[dy][dx] = frame.Sample(x + dx, y + dy);
+        }
+    }
+
+    LONG redX = frame.m_redX;
+    LONG redY = frame.m_redY;
+    int g = Average(cell[redY][1 - redX], cell[1 - redY][redX]);
+
+    StorePixel(cell[redY][redX], g, cell[1 - redY][1 - redX], wide, pOut);
+}
+
+static void ReferenceImage(const CRawFrame& frame, const TransformParams& params, BYTE *pDest, LONG destStride)
+{
+    const RECT &rc = params.rcSource;
+    const LONG shift = GetOutputShift(params);
+    const DWORD cbPixel = params.wideOutput ? 8 : 4;
+
+    for(LONG y = rc.top; y < rc.bottom; y += 1 << shift)
+    {
+        BYTE *pRow = pDest + ((y - rc.top) >> shift) * destStride;
+
+        for(LONG x = rc.left; x < rc.right; x += 1 << shift)
+        {
+            BYTE *pOut = pRow + ((x - rc.left) >> shift) * cbPixel;
+
+            if(shift)
+                ReferenceSuperpixel(frame, x, y, params.wideOutput, pOut);
+            else
+                ReferencePixel(frame, x, y, params.demosaic, params.wideOutput, pOut);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TestDemosaic
+//
+// Converts rc of a frame both ways and compares them. Returns the
+// kernel's output for further checks.
+//-------------------------------------------------------------------
+
+static std::vector<BYTE> TestDemosaic(const CRawFrame& frame, BayerPattern pattern, const RECT& rc,
+    DemosaicMode mode, bool wide, FrameContent content)
+{
+    TransformParams params;
+    memset(&params, 0, sizeof(params));
+    params.rcSource = rc;
+    params.deinterlace = Deinterlace_Weave;
+    params.wideOutput = wide;
+    params.bayer = pattern;
+    params.demosaic = mode;
+    params.cbScratchRow = (frame.m_width + kRowPadLeft + kRowPadRight) * 4;
+
+    std::vector<BYTE> scratch((kNumScratchRows + kNumRowBuffers) * params.cbScratchRow);
+    params.pScratch = &scratch[0];
+    params.pRowBuffer = params.pScratch + kNumScratchRows * params.cbScratchRow;
+
+    const LONG shift = GetOutputShift(params);
+    const DWORD outWidth = (rc.right - rc.left) >> shift;
+    const DWORD outHeight = (rc.bottom - rc.top) >> shift;
+    const LONG destStride = outWidth * (wide ? 8 : 4);
+
+    // One guard row past the image catches kernels writing too far.
+    std::vector<BYTE> actual(destStride * (outHeight + 1), 0xCD);
+    std::vector<BYTE> expected(destStride * (outHeight + 1), 0xCD);
+
+    if(frame.m_cbSample == 1)
+        TransformImage_Bayer8(&actual[0], destStride, &frame.m_data[0], frame.m_stride, frame.m_width, frame.m_height, params);
+    else
+        TransformImage_Bayer16(&actual[0], destStride, &frame.m_data[0], frame.m_stride, frame.m_width, frame.m_height, params);
+    ReferenceImage(frame, params, &expected[0], destStride);
+
+    if(actual != expected)
+    {
+        size_t i = 0;
+        while(actual[i] == expected[i])
+            i++;
+
+        printf("%s %u-bit %ux%u roi (%d,%d)-(%d,%d) %s %s, %s: byte %u is %u, expected %u\n",
+            kPatternNames[pattern], frame.m_cbSample * 8, frame.m_width, frame.m_height,
+            rc.left, rc.top, rc.right, rc.bottom, kModeNames[mode], wide ? "wide" : "8-bit",
+            kContentNames[content], (unsigned)i, actual[i], expected[i]);
+        g_failures++;
+    }
+
+    actual.resize(destStride * outHeight);
+    return actual;
+}
+
+//-------------------------------------------------------------------
+// TestPatterns
+//-------------------------------------------------------------------
+
+static void TestPatterns()
+{
+    static const BayerPattern kPatterns[] = { Bayer_RGGB, Bayer_GRBG, Bayer_GBRG, Bayer_BGGR };
+    static const DemosaicMode kModes[] = { Demosaic_Bilinear, Demosaic_EdgeAware, Demosaic_Superpixel };
+    const LONG width = 30, height = 12;
+
+    // The whole frame, each edge and corner, and the inside. All region
+    // widths leave a partial block of eight pixels.
+    static const RECT kRegions[] =
+    {
+        { 0, 0, 30, 12 },
+        { 0, 0, 10, 4 },
+        { 20, 8, 30, 12 },
+        { 2, 0, 12, 12 },
+        { 18, 2, 30, 6 },
+        { 4, 2, 26, 10 },
+    };
+
+    for(size_t p = 0; p < sizeof(kPatterns) / sizeof(kPatterns[0]); p++)
+    {
+        for(DWORD cbSample = 1; cbSample <= 2; cbSample++)
+        {
+            for(int content = Content_Random; content <= Content_DiagonalEdge; content++)
+            {
+                CRawFrame frame(kPatterns[p], cbSample, width, height, (FrameContent)content);
+
+                for(size_t r = 0; r < sizeof(kRegions) / sizeof(kRegions[0]); r++)
+                {
+                    for(size_t m = 0; m < sizeof(kModes) / sizeof(kModes[0]); m++)
+                    {
+                        TestDemosaic(frame, kPatterns[p], kRegions[r], kModes[m], false, (FrameContent)content);
+                        TestDemosaic(frame, kPatterns[p], kRegions[r], kModes[m], true, (FrameContent)content);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TestFlatColor
+//
+// Every mode must reproduce a flat color exactly, independently of
+// the reference.
+//-------------------------------------------------------------------
+
+static void TestFlatColor()
+{
+    static const BayerPattern kPatterns[] = { Bayer_RGGB, Bayer_GRBG, Bayer_GBRG, Bayer_BGGR };
+    static const DemosaicMode kModes[] = { Demosaic_Bilinear, Demosaic_EdgeAware, Demosaic_Superpixel };
+    RECT rc = { 0, 0, 22, 10 };
+
+    for(size_t p = 0; p < sizeof(kPatterns) / sizeof(kPatterns[0]); p++)
+    {
+        for(DWORD cbSample = 1; cbSample <= 2; cbSample++)
+        {
+            CRawFrame frame(kPatterns[p], cbSample, 22, 10, Content_Flat);
+
+            for(size_t m = 0; m < sizeof(kModes) / sizeof(kModes[0]); m++)
+            {
+                std::vector<BYTE> out = TestDemosaic(frame, kPatterns[p], rc, kModes[m], false, Content_Flat);
+                bool flat = true;
+                for(size_t i = 0; i < out.size(); i += 4)
+                {
+                    flat = flat && out[i] == (kFlatColor[Color_Blue] >> 8) &&
+                        out[i + 1] == (kFlatColor[Color_Green] >> 8) &&
+                        out[i + 2] == (kFlatColor[Color_Red] >> 8) && out[i + 3] == 0;
+                }
+                CHECK(flat);
+
+                out = TestDemosaic(frame, kPatterns[p], rc, kModes[m], true, Content_Flat);
+                flat = true;
+                for(size_t i = 0; i < out.size(); i += 8)
+                {
+                    const WORD *pPel = (const WORD*)&out[i];
+                    flat = flat && (pPel[0] & 0xFF00) == kFlatColor[Color_Red] &&
+                        (pPel[1] & 0xFF00) == kFlatColor[Color_Green] &&
+                        (pPel[2] & 0xFF00) == kFlatColor[Color_Blue] && pPel[3] == 0xFFFF;
+                }
+                CHECK(flat);
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestPatterns();
+    TestFlatColor();
+
+    if(g_failures)
+    {
+        printf("BayerTest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("BayerTest: passed\n");
+    return 0;
+}
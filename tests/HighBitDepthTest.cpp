@@ -0,0 +1,374 @@
+//-------------------------------------------------------------------
+// HighBitDepthTest
+//
+// Converts synthetic P010, P016 and Y210 frames with the SSE2 kernels
+// and compares every pixel with a scalar reference of the conversion,
+// for 8-bit and 16-bit output, all deinterlacing modes, regions of
+// interest at the frame edges and widths that leave scalar tails.
+//-------------------------------------------------------------------
+
+#include "ConvertKernels.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+enum SourceFormat
+{
+    Source_P010,
+    Source_P016,
+    Source_Y210
+};
+
+static const char* const kFormatNames[] = { "P010", "P016", "Y210" };
+static const char* const kDeinterlaceNames[] = { "auto", "weave", "bob", "blend" };
+
+//-------------------------------------------------------------------
+// CSyntheticFrame
+//
+// A frame of pseudo-random 16-bit samples, with the low six bits
+// cleared for P010 and Y210 like a 10-bit camera would deliver them.
+// Rows are padded, so a kernel that ignores the stride fails.
+//-------------------------------------------------------------------
+
+class CSyntheticFrame
+{
+public:
+    CSyntheticFrame(SourceFormat format, DWORD width, DWORD height, uint32_t seed) :
+        m_format(format), m_width(width), m_height(height)
+    {
+        DWORD samplesPerRow = format == Source_Y210 ? width * 2 : width;
+        DWORD rows = format == Source_Y210 ? height : height + height / 2;
+
+        m_stride = (LONG)(samplesPerRow * 2 + 24);
+        m_data.resize(m_stride * rows);
+
+        WORD mask = format == Source_P016 ? 0xFFFF : 0xFFC0;
+        for(DWORD y = 0; y < rows; y++)
+        {
+            WORD *pRow = (WORD*)&m_data[y * m_stride];
+            for(DWORD i = 0; i < (DWORD)m_stride / 2; i++)
+            {
+                seed = seed * 1664525 + 1013904223;
+                pRow[i] = (WORD)(seed >> 16) & mask;
+            }
+        }
+    }
+
+    // Sample i of row y of the luma plane (or the packed rows), and of
+    // the interleaved chroma plane of P010 and P016.
+    int Luma(LONG y, DWORD i) const { return ((const WORD*)&m_data[y * m_stride])[i]; }
+    int Chroma(LONG y, DWORD i) const { return ((const WORD*)&m_data[(m_height + y) * m_stride])[i]; }
+
+    SourceFormat            m_format;
+    DWORD                   m_width;
+    DWORD                   m_height;
+    LONG                    m_stride;
+    std::vector<BYTE>       m_data;
+};
+
+//-------------------------------------------------------------------
+// Scalar reference
+//-------------------------------------------------------------------
+
+static int Average(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+// Sample i of row y of a plane of rows rows after deinterlacing,
+// with getSample(y, i) reading the captured samples.
+template<class GetSample>
+static int DeinterlacedSample(GetSample getSample, LONG y, LONG rows, DWORD i, DeinterlaceMode mode, LONG dominantField)
+{
+    if(mode == Deinterlace_Weave || rows < 2)
+    {
+        return getSample(y, i);
+    }
+    if(mode == Deinterlace_Bob && (y & 1) == dominantField)
+    {
+        return getSample(y, i);
+    }
+
+    int above = getSample(y > 0 ? y - 1 : y + 1, i);
+    int below = getSample(y + 1 < rows ? y + 1 : y - 1, i);
+    int v = Average(above, below);
+
+    return mode == Deinterlace_Blend ? Average(v, getSample(y, i)) : v;
+}
+
+static int Clamp(int v, int low, int high)
+{
+    return v < low ? low : (v > high ? high : v);
+}
+
+// BT.601 studio range at 14 bits, written out independently of the
+// kernels: R = 1.164 (Y - 16) + 1.598 Cr', and so on.
+static void ReferencePixel(int y16, int cb16, int cr16, bool wide, BYTE *pOut)
+{
+    int c = (y16 >> 2) - (16 << 6);
+    int d = (cb16 >> 2) - (128 << 6);
+    int e = (cr16 >> 2) - (128 << 6);
+
+    int rgb[3] =
+    {
+        9536 * c + 13088 * e,
+        9536 * c - 3200 * d - 6656 * e,
+        9536 * c + 16512 * d
+    };
+
+    if(wide)
+    {
+        WORD *pPel = (WORD*)pOut;
+        for(int i = 0; i < 3; i++)
+        {
+            int v = Clamp((rgb[i] + (1 << 12)) >> 13, 0, 16383);
+            pPel[i] = (WORD)((v << 2) | (v >> 12));
+        }
+        pPel[3] = 0xFFFF;
+    }
+    else
+    {
+        pOut[0] = (BYTE)Clamp((rgb[2] + (1 << 18)) >> 19, 0, 255);
+        pOut[1] = (BYTE)Clamp((rgb[1] + (1 << 18)) >> 19, 0, 255);
+        pOut[2] = (BYTE)Clamp((rgb[0] + (1 << 18)) >> 19, 0, 255);
+        pOut[3] = 0;
+    }
+}
+
+struct LumaPlane
+{
+    const CSyntheticFrame *pFrame;
+    int operator()(LONG y, DWORD i) const { return pFrame->Luma(y, i); }
+};
+
+struct ChromaPlane
+{
+    const CSyntheticFrame *pFrame;
+    int operator()(LONG y, DWORD i) const { return pFrame->Chroma(y, i); }
+};
+
+static void ReferenceImage(const CSyntheticFrame& frame, const TransformParams& params, BYTE *pDest, LONG destStride)
+{
+    const RECT &rc = params.rcSource;
+    const DWORD cbPixel = params.wideOutput ? 8 : 4;
+    LumaPlane luma = { &frame };
+    ChromaPlane chroma = { &frame };
+
+    for(LONG y = rc.top; y < rc.bottom; y++)
+    {
+        BYTE *pRow = pDest + (y - rc.top) * destStride;
+
+        for(LONG x = rc.left; x < rc.right; x++)
+        {
+            LONG pair = x & ~1;
+            int Y, Cb, Cr;
+
+            if(frame.m_format == Source_Y210)
+            {
+                Y = DeinterlacedSample(luma, y, frame.m_height, x * 2, params.deinterlace, params.dominantField);
+                Cb = DeinterlacedSample(luma, y, frame.m_height, pair * 2 + 1, params.deinterlace, params.dominantField);
+                Cr = DeinterlacedSample(luma, y, frame.m_height, pair * 2 + 3, params.deinterlace, params.dominantField);
+            }
+            else
+            {
+                LONG rowsC = frame.m_height / 2;
+                Y = DeinterlacedSample(luma, y, frame.m_height, x, params.deinterlace, params.dominantField);
+                Cb = DeinterlacedSample(chroma, y / 2, rowsC, pair, params.deinterlace, params.dominantField);
+                Cr = DeinterlacedSample(chroma, y / 2, rowsC, pair + 1, params.deinterlace, params.dominantField);
+            }
+
+            ReferencePixel(Y, Cb, Cr, params.wideOutput, pRow + (x - rc.left) * cbPixel);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TestConversion
+//
+// Converts rc of a width x height frame both ways and compares them.
+//-------------------------------------------------------------------
+
+static void TestConversion(SourceFormat format, DWORD width, DWORD height, const RECT& rc,
+    DeinterlaceMode deinterlace, LONG dominantField, bool wide)
+{
+    CSyntheticFrame frame(format, width, height, width * 7919 + height * 31 + rc.left + rc.top);
+
+    TransformParams params;
+    memset(&params, 0, sizeof(params));
+    params.rcSource = rc;
+    params.deinterlace = deinterlace;
+    params.dominantField = dominantField;
+    params.wideOutput = wide;
+    params.cbScratchRow = (width + kRowPadLeft + kRowPadRight) * 4;
+
+    std::vector<BYTE> scratch((kNumScratchRows + kNumRowBuffers) * params.cbScratchRow);
+    params.pScratch = &scratch[0];
+    params.pRowBuffer = params.pScratch + kNumScratchRows * params.cbScratchRow;
+
+    const DWORD outWidth = rc.right - rc.left;
+    const DWORD outHeight = rc.bottom - rc.top;
+    const LONG destStride = outWidth * (wide ? 8 : 4);
+
+    // One guard row past the image catches kernels writing too far.
+    std::vector<BYTE> actual(destStride * (outHeight + 1), 0xCD);
+    std::vector<BYTE> expected(destStride * (outHeight + 1), 0xCD);
+
+    if(format == Source_Y210)
+    {
+        TransformImage_Y210(&actual[0], destStride, &frame.m_data[0], frame.m_stride, width, height, params);
+    }
+    else
+    {
+        TransformImage_P010(&actual[0], destStride, &frame.m_data[0], frame.m_stride, width, height, params);
+    }
+    ReferenceImage(frame, params, &expected[0], destStride);
+
+    if(actual != expected)
+    {
+        size_t i = 0;
+        while(actual[i] == expected[i])
+            i++;
+
+        printf("%s %ux%u roi (%d,%d)-(%d,%d) %s field %d %s: byte %u is %u, expected %u\n",
+            kFormatNames[format], width, height, rc.left, rc.top, rc.right, rc.bottom,
+            kDeinterlaceNames[deinterlace], dominantField, wide ? "wide" : "8-bit",
+            (unsigned)i, actual[i], expected[i]);
+        g_failures++;
+    }
+}
+
+static void TestFormats()
+{
+    // Widths with and without a scalar tail after the eight-pixel blocks.
+    static const DWORD kWidths[] = { 8, 16, 22, 30, 66 };
+    static const DeinterlaceMode kModes[] = { Deinterlace_Weave, Deinterlace_Bob, Deinterlace_Blend };
+
+    for(int format = Source_P010; format <= Source_Y210; format++)
+    {
+        for(size_t w = 0; w < sizeof(kWidths) / sizeof(kWidths[0]); w++)
+        {
+            DWORD width = kWidths[w];
+            DWORD height = 12;
+
+            // The whole frame, and regions at each edge and inside, so
+            // the mirrored rows at the top and bottom get converted.
+            RECT rcs[] =
+            {
+                { 0, 0, (LONG)width, (LONG)height },
+                { 2, 0, (LONG)width, 6 },
+                { 0, 6, (LONG)width - 2, (LONG)height },
+                { 2, 2, (LONG)width - 4, (LONG)height - 2 },
+            };
+
+            for(size_t r = 0; r < sizeof(rcs) / sizeof(rcs[0]); r++)
+            {
+                for(size_t m = 0; m < sizeof(kModes) / sizeof(kModes[0]); m++)
+                {
+                    for(LONG field = 0; field < 2; field++)
+                    {
+                        TestConversion((SourceFormat)format, width, height, rcs[r], kModes[m], field, false);
+                        TestConversion((SourceFormat)format, width, height, rcs[r], kModes[m], field, true);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TestOddWidths
+//
+// Regions of an odd number of pixels: the last pixel shares its
+// chroma with a pixel outside the region, and nothing may be written
+// past the region.
+//-------------------------------------------------------------------
+
+static void TestOddWidths()
+{
+    static const DWORD kWidths[] = { 1, 7, 9, 15, 17 };
+
+    for(int format = Source_P010; format <= Source_Y210; format++)
+    {
+        for(size_t w = 0; w < sizeof(kWidths) / sizeof(kWidths[0]); w++)
+        {
+            RECT rc = { 2, 2, 2 + (LONG)kWidths[w], 8 };
+
+            TestConversion((SourceFormat)format, 24, 10, rc, Deinterlace_Weave, 0, false);
+            TestConversion((SourceFormat)format, 24, 10, rc, Deinterlace_Blend, 0, true);
+            TestConversion((SourceFormat)format, 24, 10, rc, Deinterlace_Bob, 1, false);
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// TestExtremes
+//
+// Saturated and zero samples drive every channel out of range in both
+// directions, so the clamping of the SIMD and scalar paths is checked.
+//-------------------------------------------------------------------
+
+static void TestExtremes()
+{
+    static const WORD kValues[] = { 0x0000, 0xFFC0, 0xFFFF, 0x1000, 0xF000 };
+    const DWORD width = 20, height = 4;
+
+    for(size_t a = 0; a < sizeof(kValues) / sizeof(kValues[0]); a++)
+    {
+        for(size_t b = 0; b < sizeof(kValues) / sizeof(kValues[0]); b++)
+        {
+            CSyntheticFrame frame(Source_P016, width, height, 1);
+            for(DWORD y = 0; y < height; y++)
+            {
+                for(DWORD i = 0; i < width; i++)
+                {
+                    ((WORD*)&frame.m_data[y * frame.m_stride])[i] = kValues[(a + i) % 5];
+                }
+            }
+            for(DWORD y = 0; y < height / 2; y++)
+            {
+                for(DWORD i = 0; i < width; i++)
+                {
+                    ((WORD*)&frame.m_data[(height + y) * frame.m_stride])[i] = kValues[(b + i * 3) % 5];
+                }
+            }
+
+            TransformParams params;
+            memset(&params, 0, sizeof(params));
+            RECT rc = { 0, 0, (LONG)width, (LONG)height };
+            params.rcSource = rc;
+            params.deinterlace = Deinterlace_Weave;
+            params.cbScratchRow = (width + kRowPadLeft + kRowPadRight) * 4;
+            std::vector<BYTE> scratch((kNumScratchRows + kNumRowBuffers) * params.cbScratchRow);
+            params.pScratch = &scratch[0];
+            params.pRowBuffer = params.pScratch + kNumScratchRows * params.cbScratchRow;
+
+            for(int wide = 0; wide < 2; wide++)
+            {
+                params.wideOutput = wide != 0;
+                LONG destStride = width * (wide ? 8 : 4);
+                std::vector<BYTE> actual(destStride * height), expected(destStride * height);
+
+                TransformImage_P010(&actual[0], destStride, &frame.m_data[0], frame.m_stride, width, height, params);
+                ReferenceImage(frame, params, &expected[0], destStride);
+                CHECK(actual == expected);
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestFormats();
+    TestOddWidths();
+    TestExtremes();
+
+    if(g_failures)
+    {
+        printf("HighBitDepthTest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("HighBitDepthTest: passed\n");
+    return 0;
+}
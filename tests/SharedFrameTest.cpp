@@ -0,0 +1,116 @@
+//-------------------------------------------------------------------
+// SharedFrameTest
+//
+// Publishes frames through a shared-memory ring and reads them back
+// with a reader in the same process: the pixels and frame data of the
+// newest slot, validation after the writer reuses the slot, frames
+// that do not fit a slot and the lifetime of the name.
+//-------------------------------------------------------------------
+
+#include "SharedFrame.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static const uint32_t kWidth = 16;
+static const uint32_t kHeight = 8;
+static const uint32_t kStride = kWidth * 4;
+static const uint32_t kFrameBytes = kStride * kHeight;
+static const uint32_t kSlotCount = 3;
+
+static void FillFrame(uint8_t *pData, uint32_t seed)
+{
+    for(uint32_t i = 0; i < kFrameBytes; i++)
+    {
+        pData[i] = (uint8_t)(i * 7 + seed * 13);
+    }
+}
+
+static bool PublishFrame(CSharedFrameWriter &writer, uint32_t seed, int64_t timestamp)
+{
+    uint8_t *pData = writer.BeginFrame(kFrameBytes);
+    if(!pData)
+    {
+        return false;
+    }
+    FillFrame(pData, seed);
+    writer.CommitFrame(SHARED_FRAME_FORMAT_BGRA, kWidth, kHeight, kStride, timestamp);
+    return true;
+}
+
+int main()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "SharedFrameTest.%d", (int)getpid());
+
+    CSharedFrameWriter writer;
+    CHECK(writer.Create(name, kFrameBytes, kSlotCount));
+    CHECK(writer.IsOpen());
+
+    CSharedFrameReader reader;
+    CHECK(reader.Open(name));
+
+    SharedFrameView view;
+    CHECK(!reader.GetLatestFrame(&view));
+
+    // The newest frame reads back unchanged.
+    CHECK(PublishFrame(writer, 1, 1000));
+    CHECK(PublishFrame(writer, 2, 2000));
+
+    std::vector<uint8_t> expected(kFrameBytes);
+    FillFrame(&expected[0], 2);
+
+    memset(&view, 0, sizeof(view));
+    CHECK(reader.GetLatestFrame(&view));
+    CHECK(view.format == SHARED_FRAME_FORMAT_BGRA);
+    CHECK(view.frameNumber == 1);
+    CHECK(view.timestamp == 2000);
+    CHECK(view.width == kWidth);
+    CHECK(view.height == kHeight);
+    CHECK(view.stride == (int32_t)kStride);
+    CHECK(view.dataSize == kFrameBytes);
+    CHECK(view.pData && memcmp(view.pData, &expected[0], kFrameBytes) == 0);
+    CHECK(reader.ValidateFrame(view));
+
+    // The view stays valid until the writer comes around to its slot.
+    for(uint32_t i = 1; i < kSlotCount; i++)
+    {
+        CHECK(PublishFrame(writer, 2 + i, 2000 + i * 1000));
+        CHECK(reader.ValidateFrame(view));
+    }
+    CHECK(writer.BeginFrame(kFrameBytes) != NULL);
+    CHECK(!reader.ValidateFrame(view));
+    writer.CommitFrame(SHARED_FRAME_FORMAT_BGRA, kWidth, kHeight, kStride, 9000);
+    CHECK(!reader.ValidateFrame(view));
+
+    SharedFrameView latest;
+    CHECK(reader.GetLatestFrame(&latest));
+    CHECK(latest.frameNumber == 1 + kSlotCount);
+    CHECK(latest.timestamp == 9000);
+    CHECK(latest.slot == view.slot);
+
+    // Frames larger than a slot are refused.
+    CHECK(writer.BeginFrame(kFrameBytes * 64) == NULL);
+
+    // The name goes away with the writer; mapped readers keep their view.
+    writer.Close();
+    CHECK(!writer.IsOpen());
+    CHECK(reader.GetLatestFrame(&latest));
+
+    CSharedFrameReader late;
+    CHECK(!late.Open(name));
+    reader.Close();
+
+    if(g_failures)
+    {
+        printf("SharedFrameTest: %d checks failed\n", g_failures);
+        return 1;
+    }
+
+    printf("SharedFrameTest: passed\n");
+    return 0;
+}
@@ -0,0 +1,292 @@
+//-------------------------------------------------------------------
+// SnapshotSessionTest
+//
+// Drives the snapshot protocol over a Unix domain socket against a
+// synthetic frame source, and checks the error paths of both sides
+// with an in-process stream.
+//-------------------------------------------------------------------
+
+#include "SnapshotSession.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+//-------------------------------------------------------------------
+// CSyntheticSource
+//
+// Frames of a fixed size whose pixels encode the frame number and
+// position. Every snapshot request captures a new frame when it asks
+// for the next one, like a camera running in the background.
+//-------------------------------------------------------------------
+
+class CSyntheticSource : public ISnapshotSource
+{
+public:
+    CSyntheticSource(uint32_t width, uint32_t height) : m_width(width), m_height(height),
+        m_stride(width * 4 + 8), m_frameNumber(1), m_fail(false)
+    {
+        m_pixels.resize(m_stride * height);
+        Render();
+    }
+
+    virtual int32_t GetSnapshot(bool nextFrame, uint32_t timeoutMs, SnapshotFrame *pFrame)
+    {
+        if(m_fail)
+        {
+            return SNAPSHOT_STATUS_TIMEOUT;
+        }
+        if(nextFrame)
+        {
+            m_frameNumber++;
+            Render();
+        }
+
+        pFrame->pData = &m_pixels[0];
+        pFrame->format = 0x41524742;    // 'BGRA'
+        pFrame->frameNumber = m_frameNumber;
+        pFrame->timestamp = (int64_t)m_frameNumber * 333333;
+        pFrame->width = m_width;
+        pFrame->height = m_height;
+        pFrame->stride = m_stride;
+        return SNAPSHOT_STATUS_OK;
+    }
+
+    static uint8_t Pixel(uint64_t frameNumber, uint32_t x, uint32_t y, uint32_t c)
+    {
+        return (uint8_t)(frameNumber * 31 + x * 7 + y * 13 + c * 59);
+    }
+
+    bool CheckPixels(const uint8_t *pData, uint64_t frameNumber) const
+    {
+        for(uint32_t y = 0; y < m_height; y++)
+        {
+            for(uint32_t x = 0; x < m_width * 4; x++)
+            {
+                if(pData[y * m_stride + x] != Pixel(frameNumber, x / 4, y, x % 4))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t    m_width;
+    uint32_t    m_height;
+    uint32_t    m_stride;
+    uint64_t    m_frameNumber;
+    bool        m_fail;
+
+protected:
+    std::vector<uint8_t> m_pixels;
+
+    void Render()
+    {
+        for(uint32_t y = 0; y < m_height; y++)
+        {
+            for(uint32_t x = 0; x < m_width * 4; x++)
+            {
+                m_pixels[y * m_stride + x] = Pixel(m_frameNumber, x / 4, y, x % 4);
+            }
+        }
+    }
+};
+
+//-------------------------------------------------------------------
+// CMemoryStream
+//
+// In-process stream: reads come from a prepared buffer, writes are
+// collected.
+//-------------------------------------------------------------------
+
+class CMemoryStream : public ISnapshotStream
+{
+public:
+    CMemoryStream() : m_readPos(0)
+    {
+    }
+
+    void AddInput(const void *pData, size_t size)
+    {
+        m_input.insert(m_input.end(), (const uint8_t*)pData, (const uint8_t*)pData + size);
+    }
+
+    virtual bool Read(void *pData, uint32_t size)
+    {
+        if(m_input.size() - m_readPos < size)
+            return false;
+        memcpy(pData, &m_input[m_readPos], size);
+        m_readPos += size;
+        return true;
+    }
+
+    virtual bool Write(const void *pData, uint32_t size)
+    {
+        m_output.insert(m_output.end(), (const uint8_t*)pData, (const uint8_t*)pData + size);
+        return true;
+    }
+
+    std::vector<uint8_t>    m_input;
+    size_t                  m_readPos;
+    std::vector<uint8_t>    m_output;
+};
+
+static void ServerThread(CSnapshotSocket *pListener, ISnapshotSource *pSource)
+{
+    bool quit = false;
+
+    while(!quit)
+    {
+        CSnapshotSocket connection;
+        if(pListener->Accept(&connection, 100))
+            quit = ServeSnapshotRequest(&connection, pSource);
+    }
+}
+
+static int32_t Request(const char *path, uint32_t command, uint32_t flags, SnapshotResponse *pResponse, uint8_t **ppData)
+{
+    CSnapshotSocket client;
+    if(!client.Connect(path))
+    {
+        *ppData = NULL;
+        return SNAPSHOT_STATUS_FAIL;
+    }
+    return ExchangeSnapshot(&client, command, flags, pResponse, ppData);
+}
+
+static void TestSocketSession()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/snapshot-test-%d.sock", (int)getpid());
+
+    // Large enough that a frame needs several socket transfers.
+    CSyntheticSource source(321, 240);
+    CSnapshotSocket listener;
+    CHECK(listener.Listen(path));
+
+    std::thread server(ServerThread, &listener, &source);
+
+    SnapshotResponse response;
+    uint8_t *pData = NULL;
+
+    CHECK(Request(path, SnapshotCommand_Ping, 0, &response, &pData) == SNAPSHOT_STATUS_OK);
+    CHECK(response.dataSize == 0 && pData == NULL);
+
+    CHECK(Request(path, SnapshotCommand_Snapshot, 0, &response, &pData) == SNAPSHOT_STATUS_OK);
+    CHECK(response.width == 321 && response.height == 240 && response.stride == 321 * 4 + 8);
+    CHECK(response.dataSize == response.stride * response.height);
+    CHECK(response.frameNumber == 1 && response.timestamp == 333333);
+    CHECK(pData && source.CheckPixels(pData, 1));
+    delete[] pData;
+
+    CHECK(Request(path, SnapshotCommand_Snapshot, SNAPSHOT_FLAG_NEXT_FRAME, &response, &pData) == SNAPSHOT_STATUS_OK);
+    CHECK(response.frameNumber == 2);
+    CHECK(pData && source.CheckPixels(pData, 2));
+    delete[] pData;
+
+    source.m_fail = true;
+    CHECK(Request(path, SnapshotCommand_Snapshot, 0, &response, &pData) == SNAPSHOT_STATUS_TIMEOUT);
+    CHECK(response.dataSize == 0 && pData == NULL);
+    source.m_fail = false;
+
+    // A request from a client that speaks another version.
+    {
+        CSnapshotSocket client;
+        SnapshotRequest request;
+        InitSnapshotRequest(&request, SnapshotCommand_Snapshot, 0);
+        request.version = SNAPSHOT_PROTOCOL_VERSION + 1;
+
+        CHECK(client.Connect(path));
+        CHECK(client.Write(&request, sizeof(request)));
+        CHECK(client.Read(&response, sizeof(response)));
+        CHECK(IsValidSnapshotResponse(response));
+        CHECK(response.status == SNAPSHOT_STATUS_INVALID_REQUEST && response.dataSize == 0);
+    }
+
+    CHECK(Request(path, SnapshotCommand_Quit, 0, &response, &pData) == SNAPSHOT_STATUS_OK);
+    server.join();
+
+    listener.Close();
+    CHECK(access(path, F_OK) != 0);
+    CHECK(Request(path, SnapshotCommand_Ping, 0, &response, &pData) == SNAPSHOT_STATUS_FAIL);
+}
+
+static void TestStreamErrors()
+{
+    CSyntheticSource source(4, 2);
+    SnapshotRequest request;
+    SnapshotResponse response;
+    uint8_t *pData = NULL;
+
+    // A truncated request is dropped without an answer.
+    {
+        CMemoryStream stream;
+        InitSnapshotRequest(&request, SnapshotCommand_Snapshot, 0);
+        stream.AddInput(&request, sizeof(request) - 1);
+        CHECK(!ServeSnapshotRequest(&stream, &source));
+        CHECK(stream.m_output.empty());
+    }
+
+    // Unknown commands are rejected.
+    {
+        CMemoryStream stream;
+        InitSnapshotRequest(&request, 77, 0);
+        stream.AddInput(&request, sizeof(request));
+        CHECK(!ServeSnapshotRequest(&stream, &source));
+        CHECK(stream.m_output.size() == sizeof(response));
+        memcpy(&response, &stream.m_output[0], sizeof(response));
+        CHECK(response.status == SNAPSHOT_STATUS_INVALID_REQUEST);
+    }
+
+    // Served frames: header followed by exactly dataSize bytes.
+    {
+        CMemoryStream stream;
+        InitSnapshotRequest(&request, SnapshotCommand_Snapshot, 0);
+        stream.AddInput(&request, sizeof(request));
+        CHECK(!ServeSnapshotRequest(&stream, &source));
+        CHECK(stream.m_output.size() == sizeof(response) + source.m_stride * source.m_height);
+    }
+
+    // The client rejects a response whose data does not match the
+    // frame size, and one that ends early.
+    {
+        CMemoryStream stream;
+        InitSnapshotResponse(&response, SNAPSHOT_STATUS_OK);
+        response.width = 4;
+        response.height = 2;
+        response.stride = 8;
+        response.dataSize = 16;
+        stream.AddInput(&response, sizeof(response));
+        CHECK(ExchangeSnapshot(&stream, SnapshotCommand_Snapshot, 0, &response, &pData) == SNAPSHOT_STATUS_FAIL);
+        CHECK(pData == NULL);
+    }
+    {
+        CMemoryStream stream;
+        uint8_t pixels[16] = { 0 };
+        InitSnapshotResponse(&response, SNAPSHOT_STATUS_OK);
+        response.width = 2;
+        response.height = 2;
+        response.stride = 8;
+        response.dataSize = 16;
+        stream.AddInput(&response, sizeof(response));
+        stream.AddInput(pixels, 15);
+        CHECK(ExchangeSnapshot(&stream, SnapshotCommand_Snapshot, 0, &response, &pData) == SNAPSHOT_STATUS_FAIL);
+        CHECK(pData == NULL);
+    }
+}
+
+int main()
+{
+    TestSocketSession();
+    TestStreamErrors();
+
+    if(g_failures)
+    {
+        printf("SnapshotSessionTest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("SnapshotSessionTest: passed\n");
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+//-------------------------------------------------------------------
+// TestCheck
+//
+// CHECK records a failed condition with its file and line and lets
+// the test continue; main() returns 1 if g_failures is not zero.
+//-------------------------------------------------------------------
+
+#include <stdio.h>
+
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s(%d): CHECK failed: %s\n", __FILE__, __LINE__, #cond); g_failures++; } } while(0)
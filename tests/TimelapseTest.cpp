@@ -0,0 +1,198 @@
+//-------------------------------------------------------------------
+// TimelapseTest
+//
+// Writes a time-lapse file of uncompressed frames and reads it back,
+// cuts it short inside the last frame as a crash would, appends to
+// the damaged file and opens a file with a fractional frame rate.
+//-------------------------------------------------------------------
+
+#include "TimelapseFile.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static const uint32_t kWidth = 4;
+static const uint32_t kHeight = 2;
+static const uint32_t kFrameBytes = kWidth * kHeight * 4;
+static const uint32_t kFrameCount = 4;
+
+// The headers and the chunk header of each frame, see TimelapseFile.cpp.
+static const uint32_t kHeaderSize = 224;
+static const uint32_t kChunkHeaderSize = 8;
+
+// Offsets in the strh chunk.
+static const long kScaleOffset = 128;
+static const long kRateOffset = 132;
+
+static void FillFrame(uint8_t *pData, uint32_t seed)
+{
+    for(uint32_t i = 0; i < kFrameBytes; i++)
+    {
+        pData[i] = (uint8_t)(i * 11 + seed * 37);
+    }
+}
+
+static bool CheckFrame(CTimelapseReader &reader, uint32_t frame, uint32_t seed)
+{
+    std::vector<uint8_t> expected(kFrameBytes);
+    std::vector<uint8_t> actual(kFrameBytes);
+    FillFrame(&expected[0], seed);
+
+    return reader.GetFrameSize(frame) == kFrameBytes &&
+        reader.ReadFrame(frame, &actual[0], kFrameBytes) &&
+        actual == expected;
+}
+
+static TimelapseFormat GetTestFormat()
+{
+    TimelapseFormat format;
+    memset(&format, 0, sizeof(format));
+    format.width = kWidth;
+    format.height = kHeight;
+    format.codec = TIMELAPSE_CODEC_RAW;
+    format.framesPerSecond = 5;
+    return format;
+}
+
+static bool WriteU32At(const char *path, long offset, uint32_t value)
+{
+    FILE *file = fopen(path, "r+b");
+    if(!file)
+    {
+        return false;
+    }
+
+    uint8_t buf[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    bool ok = fseek(file, offset, SEEK_SET) == 0 && fwrite(buf, 1, sizeof(buf), file) == sizeof(buf);
+    return fclose(file) == 0 && ok;
+}
+
+static void TestWriteAndRead(const char *path)
+{
+    std::vector<uint8_t> frame(kFrameBytes);
+
+    CTimelapseWriter writer;
+    CHECK(writer.Open(path, GetTestFormat()));
+    for(uint32_t i = 0; i < kFrameCount; i++)
+    {
+        FillFrame(&frame[0], i);
+        CHECK(writer.AddFrame(&frame[0], kFrameBytes));
+    }
+    CHECK(writer.GetFrameCount() == kFrameCount);
+    writer.Close();
+
+    CTimelapseReader reader;
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFormat().width == kWidth);
+    CHECK(reader.GetFormat().height == kHeight);
+    CHECK(reader.GetFormat().codec == TIMELAPSE_CODEC_RAW);
+    CHECK(reader.GetFormat().framesPerSecond == 5);
+    CHECK(reader.GetFrameCount() == kFrameCount);
+    CHECK(!reader.WasRecovered());
+    for(uint32_t i = 0; i < kFrameCount; i++)
+    {
+        CHECK(CheckFrame(reader, i, i));
+    }
+    CHECK(!reader.ReadFrame(kFrameCount, &frame[0], kFrameBytes));
+}
+
+static void TestRecovery(const char *path)
+{
+    // Cut the file inside the data of the last frame, which also drops
+    // idx1 behind it.
+    long lastFrame = kHeaderSize + (kFrameCount - 1) * (kChunkHeaderSize + kFrameBytes) + kChunkHeaderSize;
+    CHECK(truncate(path, lastFrame + kFrameBytes / 2) == 0);
+
+    CTimelapseReader reader;
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFrameCount() == kFrameCount - 1);
+    CHECK(reader.WasRecovered());
+    for(uint32_t i = 0; i + 1 < kFrameCount; i++)
+    {
+        CHECK(CheckFrame(reader, i, i));
+    }
+    reader.Close();
+
+    // Appending rebuilds the index and overwrites the partial frame.
+    std::vector<uint8_t> frame(kFrameBytes);
+    FillFrame(&frame[0], 100);
+
+    CTimelapseWriter writer;
+    CHECK(writer.Open(path, GetTestFormat()));
+    CHECK(writer.GetFrameCount() == kFrameCount - 1);
+    CHECK(writer.AddFrame(&frame[0], kFrameBytes));
+    writer.Close();
+
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFrameCount() == kFrameCount);
+    CHECK(!reader.WasRecovered());
+    for(uint32_t i = 0; i + 1 < kFrameCount; i++)
+    {
+        CHECK(CheckFrame(reader, i, i));
+    }
+    CHECK(CheckFrame(reader, kFrameCount - 1, 100));
+
+    // A different size is not appended to.
+    TimelapseFormat other = GetTestFormat();
+    other.width *= 2;
+    CHECK(!writer.Open(path, other));
+}
+
+static void TestFractionalRate(const char *path)
+{
+    // Half a frame per second rounds up to one, a third rounds down to
+    // zero and is raised to one.
+    CHECK(WriteU32At(path, kScaleOffset, 2));
+    CHECK(WriteU32At(path, kRateOffset, 1));
+
+    CTimelapseReader reader;
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFormat().framesPerSecond == 1);
+    reader.Close();
+
+    CHECK(WriteU32At(path, kScaleOffset, 3));
+
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFormat().framesPerSecond == 1);
+    reader.Close();
+
+    // The writer keeps the rate of the file it appends to.
+    std::vector<uint8_t> frame(kFrameBytes);
+    FillFrame(&frame[0], 200);
+
+    CTimelapseWriter writer;
+    CHECK(writer.Open(path, GetTestFormat()));
+    CHECK(writer.GetFormat().framesPerSecond == 1);
+    CHECK(writer.AddFrame(&frame[0], kFrameBytes));
+    writer.Close();
+
+    CHECK(reader.Open(path));
+    CHECK(reader.GetFrameCount() == kFrameCount + 1);
+    CHECK(CheckFrame(reader, kFrameCount, 200));
+}
+
+int main()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "TimelapseTest.%d.avi", (int)getpid());
+    remove(path);
+
+    TestWriteAndRead(path);
+    TestRecovery(path);
+    TestFractionalRate(path);
+
+    remove(path);
+
+    if(g_failures)
+    {
+        printf("TimelapseTest: %d checks failed\n", g_failures);
+        return 1;
+    }
+
+    printf("TimelapseTest: passed\n");
+    return 0;
+}